@@ -5,5 +5,24 @@
  
  #define __CACHE_STUDENT_H__844
 
+ #include <curl/curl.h>
  #include "steque.h"
+ #include "cache_ctl.h"
+
+ #define MAX_SIZE_CLASSES 8
+
+ // 每个 proxy worker 线程的 GFS_WORKER_ARG
+ typedef struct {
+     shm_pool_t *pools;          // 每个 size class 一个池, 段大小从小到大
+     int npools;
+     int mapped_delivery;        // 1 = 零拷贝交付
+     ctl_conn_t *conn;           // 这个 worker 到 cache 的长连接
+     CURL *curl;                 // miss 时回源用, NULL = miss 直接报错
+     const char *server;         // 源站地址, 后面拼上请求路径
+     int max_fills;              // 整个 proxy 同时最多留几份回源副本给 cache 回填
+ } proxy_worker_arg_t;
+
+ // cache 作废 key 时调用 (key 为空 = 全部): 丢掉 L1 里的副本, 关掉缓存着的只读对象 fd
+ void handle_with_cache_invalidate(const char *key);
+
  #endif // __CACHE_STUDENT_H__844
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "cache_ctl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static ctl_conn_t *all_conns;
+static int nconns;
+static char conn_ns[SHM_NAME_LEN];
+static void (*invalidate_fn)(const char *key);
+static pthread_t reconnect_tid;
+static volatile int closing; // ctl_conns_close 置上, 后台线程看到就退出
+
+// 后台线程给每条连接攒的半帧; fd 变了说明重连过, 旧字节作废
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[CTL_MAX_FRAME_LEN];
+} ctl_inbox_t;
+
+int ctl_encode(const ctl_request_t *req, char *buf, size_t buflen) {
+    ctl_header_t hdr;
+    size_t namelen = strnlen(req->shm_name, SHM_NAME_LEN);
+    size_t keylen = strnlen(req->key, CTL_MAX_KEYLEN);
+
+    if (namelen == SHM_NAME_LEN || keylen == CTL_MAX_KEYLEN) return -1;
+    if (buflen < sizeof(hdr) + namelen + keylen) return -1;
+
+    hdr.magic = CTL_MAGIC;
+    hdr.type = req->type;
+    hdr.req_id = req->req_id;
+    hdr.segsize = req->segsize;
+    hdr.generation = req->generation;
+    hdr.namelen = namelen;
+    hdr.keylen = keylen;
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), req->shm_name, namelen);
+    memcpy(buf + sizeof(hdr) + namelen, req->key, keylen);
+    return sizeof(hdr) + namelen + keylen;
+}
+
+int ctl_decode(const char *buf, size_t len, ctl_request_t *req) {
+    ctl_header_t hdr;
+
+    if (len < sizeof(hdr)) return 0;
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != CTL_MAGIC || hdr.namelen >= SHM_NAME_LEN || hdr.keylen >= CTL_MAX_KEYLEN) return -1;
+
+    size_t framelen = sizeof(hdr) + hdr.namelen + hdr.keylen;
+    if (len < framelen) return 0;
+
+    req->type = hdr.type;
+    req->req_id = hdr.req_id;
+    req->segsize = hdr.segsize;
+    req->generation = hdr.generation;
+    memcpy(req->shm_name, buf + sizeof(hdr), hdr.namelen);
+    req->shm_name[hdr.namelen] = '\0';
+    memcpy(req->key, buf + sizeof(hdr) + hdr.namelen, hdr.keylen);
+    req->key[hdr.keylen] = '\0';
+    return framelen;
+}
+
+// 发 CTL_REGISTER, 等 cache 回同样类型的一帧; 超时或被拒绝 (对端关闭) 返回 -1
+static int _register(int fd) {
+    ctl_request_t req;
+    char buf[CTL_MAX_FRAME_LEN];
+    size_t len = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.type = CTL_REGISTER;
+    req.req_id = getpid();
+    strncpy(req.shm_name, conn_ns, sizeof(req.shm_name) - 1);
+
+    int framelen = ctl_encode(&req, buf, sizeof(buf));
+    if (framelen < 0 || send(fd, buf, framelen, MSG_NOSIGNAL) != framelen) return -1;
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (1) {
+        if (poll(&pfd, 1, CTL_REGISTER_TIMEOUT_MS) <= 0) return -1;
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len += n;
+
+        int r = ctl_decode(buf, len, &req);
+        if (r < 0) return -1;
+        if (r > 0) return req.type == CTL_REGISTER ? 0 : -1;
+    }
+}
+
+static int _connect_cache() {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, CACHE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || _register(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void _conn_reset(ctl_conn_t *conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        __atomic_add_fetch(&conn->epoch, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// CTL_ABORT 可能从这个 proxy 的任意一条连接上来, 在所有连接里找等这个请求的 worker; 持有 held->lock.
+// 只有后台线程会同时拿两把连接锁, 不会死锁
+static void _abort_waiting(ctl_conn_t *held, uint32_t req_id) {
+    for (int i = 0; i < nconns; i++) {
+        ctl_conn_t *conn = &all_conns[i];
+        if (conn != held) pthread_mutex_lock(&conn->lock);
+        if (conn->waiting != NULL && conn->waiting_req_id == req_id) {
+            shm_ring_abort(conn->waiting);
+            conn->waiting = NULL;
+        }
+        if (conn != held) pthread_mutex_unlock(&conn->lock);
+    }
+}
+
+// 收下 cache 发来的帧 (作废通知和 CTL_ABORT), 持有 conn->lock; 返回 -1 = 对端关闭, 出错或者坏帧
+static int _conn_receive(ctl_conn_t *conn, ctl_inbox_t *inbox) {
+    if (inbox->fd != conn->fd) {
+        inbox->fd = conn->fd;
+        inbox->len = 0;
+    }
+
+    ssize_t n = recv(conn->fd, inbox->buf + inbox->len, sizeof(inbox->buf) - inbox->len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if (n <= 0) return -1;
+    inbox->len += n;
+
+    ctl_request_t req;
+    int r, consumed = 0;
+    while ((r = ctl_decode(inbox->buf + consumed, inbox->len - consumed, &req)) > 0) {
+        consumed += r;
+        if (req.type == CTL_ABORT) {
+            _abort_waiting(conn, req.req_id);
+            continue;
+        }
+        if (req.type != CTL_INVALIDATE) return -1;
+        if (invalidate_fn != NULL) invalidate_fn(req.key);
+    }
+    if (r < 0) return -1;
+    memmove(inbox->buf, inbox->buf + consumed, inbox->len - consumed);
+    inbox->len -= consumed;
+    return 0;
+}
+
+// 后台线程: 收 cache 的作废通知, 发现对端关闭就断开, 每 CTL_RECONNECT_MS 重连一次断开的连接
+static void* _reconnect_thread(void *arg) {
+    (void)arg;
+    struct pollfd *pfds = malloc(nconns * sizeof(struct pollfd));
+    ctl_inbox_t *inboxes = calloc(nconns, sizeof(ctl_inbox_t));
+    for (int i = 0; i < nconns; i++) inboxes[i].fd = -1;
+
+    while (!closing) {
+        for (int i = 0; i < nconns; i++) {
+            // 只有这个线程会把 fd 从 -1 改成有效值, 所以连接和报到可以不拿锁做;
+            // cache 没起来或者报到很慢时, ctl_conn_send 照样能立刻看到 fd < 0 失败返回
+            pthread_mutex_lock(&all_conns[i].lock);
+            int down = all_conns[i].fd < 0;
+            pthread_mutex_unlock(&all_conns[i].lock);
+
+            int fd = down ? _connect_cache() : -1;
+            pthread_mutex_lock(&all_conns[i].lock);
+            if (fd >= 0) all_conns[i].fd = fd;
+            pfds[i].fd = all_conns[i].fd;
+            pfds[i].events = POLLIN;
+            pthread_mutex_unlock(&all_conns[i].lock);
+
+            if (fd >= 0) {
+                printf("[PROXY] control connection %d established\n", i);
+                // 断开期间发来的作废通知收不到了, 本地副本全部不再可信
+                if (invalidate_fn != NULL) invalidate_fn("");
+            }
+        }
+
+        // 报到确认之后 cache 只会往这些连接上写作废通知
+        if (poll(pfds, nconns, CTL_RECONNECT_MS) <= 0) continue;
+
+        for (int i = 0; i < nconns; i++) {
+            if (pfds[i].fd < 0 || pfds[i].revents == 0) continue;
+            pthread_mutex_lock(&all_conns[i].lock);
+            if (all_conns[i].fd == pfds[i].fd && _conn_receive(&all_conns[i], &inboxes[i]) < 0) {
+                fprintf(stderr, "[PROXY] control connection %d lost, reconnecting\n", i);
+                _conn_reset(&all_conns[i]);
+            }
+            pthread_mutex_unlock(&all_conns[i].lock);
+        }
+    }
+    free(pfds);
+    free(inboxes);
+    return NULL;
+}
+
+void ctl_conns_on_invalidate(void (*fn)(const char *key)) {
+    invalidate_fn = fn;
+}
+
+void ctl_conns_start(ctl_conn_t *conns, int n, const char *ns) {
+    all_conns = conns;
+    nconns = n;
+    strncpy(conn_ns, ns, sizeof(conn_ns) - 1);
+
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&conns[i].lock, NULL);
+        conns[i].fd = _connect_cache();
+    }
+
+    pthread_create(&reconnect_tid, NULL, _reconnect_thread, NULL);
+}
+
+int ctl_conn_send(ctl_conn_t *conn, const ctl_request_t *req) {
+    char buf[CTL_MAX_FRAME_LEN];
+    int len = ctl_encode(req, buf, sizeof(buf));
+    if (len < 0) return -1;
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->fd < 0) {
+        pthread_mutex_unlock(&conn->lock);
+        return -1;
+    }
+
+    int sent = 0;
+    while (sent < len) {
+        ssize_t n = send(conn->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            _conn_reset(conn);
+            pthread_mutex_unlock(&conn->lock);
+            return -1;
+        }
+        sent += n;
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return 0;
+}
+
+void ctl_conn_set_waiting(ctl_conn_t *conn, shm_payload_t *payload, uint32_t req_id) {
+    pthread_mutex_lock(&conn->lock);
+    conn->waiting = payload;
+    conn->waiting_req_id = req_id;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+uint32_t ctl_conn_epoch(ctl_conn_t *conn) {
+    return __atomic_load_n(&conn->epoch, __ATOMIC_ACQUIRE);
+}
+
+int ctl_conns_send_any(ctl_conn_t *conns, int n, const ctl_request_t *req) {
+    for (int i = 0; i < n; i++) {
+        if (ctl_conn_send(&conns[i], req) == 0) return 0;
+    }
+    return -1;
+}
+
+void ctl_conns_close(ctl_conn_t *conns, int n) {
+    // 先停掉后台线程, 不然它会把刚关的连接重连上
+    closing = 1;
+    pthread_join(reconnect_tid, NULL);
+
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_lock(&conns[i].lock);
+        _conn_reset(&conns[i]);
+        pthread_mutex_unlock(&conns[i].lock);
+        pthread_mutex_destroy(&conns[i].lock);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef __CACHE_CTL_H__
+#define __CACHE_CTL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "shm_channel.h"
+
+#define CACHE_SOCKET_PATH "/tmp/cache_socket"
+#define CTL_MAX_KEYLEN 1024
+#define CTL_MAGIC 0x5343 // "SC"
+#define CTL_RECONNECT_MS 100
+#define CTL_REGISTER_TIMEOUT_MS 1000
+#define CTL_REPLY_TIMEOUT_MS 30000 // proxy 等 cache 在段上推进一步 (填一块 / 读一块) 最多等多久
+
+// 帧类型
+#define CTL_GET 1
+#define CTL_RETIRE 2 // proxy 要销毁这个段了, cache 释放它的映射
+#define CTL_REGISTER 3 // 连接上的第一帧: req_id = pid, shm_name = 这个 proxy 的段名前缀; cache 原样回一帧确认
+#define CTL_INVALIDATE 4 // cache -> proxy: key 的内容变了, 丢掉副本; key 为空 = 全部丢掉
+#define CTL_FILL 5 // proxy 把回源取到的 key 写进段里 (大小和 req_id 先写进段头), cache 读出来存下
+#define CTL_ABORT 6 // cache -> proxy: req_id 的段 attach 不上, 没法在段里回复; proxy 中止那个段的 ring, 等着的 worker 马上失败
+
+// 线上的帧头, 后面紧跟 namelen 字节的段名和 keylen 字节的 key (都不带 '\0')
+typedef struct __attribute__((packed)) {
+    uint16_t magic;
+    uint16_t type;
+    uint32_t req_id;
+    uint64_t segsize;
+    uint32_t generation;  // 段创建时写进段头的代号
+    uint16_t namelen;
+    uint16_t keylen;
+} ctl_header_t;
+
+#define CTL_MAX_FRAME_LEN (sizeof(ctl_header_t) + SHM_NAME_LEN + CTL_MAX_KEYLEN)
+
+// 解码后的请求
+typedef struct {
+    uint16_t type;
+    uint32_t req_id;
+    size_t segsize;
+    uint32_t generation;
+    char shm_name[SHM_NAME_LEN];
+    char key[CTL_MAX_KEYLEN];
+} ctl_request_t;
+
+// proxy 到 cache 的长连接
+typedef struct {
+    int fd;                // -1 = 断开, 由后台线程重连
+    uint32_t epoch;        // 每断开一次加一; 等回复的请求靠它发现 cache 可能已经重启
+    shm_payload_t *waiting; // 这条连接的 worker 正在等 cache 回复的段, NULL = 没有
+    uint32_t waiting_req_id;
+    pthread_mutex_t lock;
+} ctl_conn_t;
+
+// 把请求编码进 buf, 返回帧长度; 名字或 key 太长返回 -1
+int ctl_encode(const ctl_request_t *req, char *buf, size_t buflen);
+
+// 从 buf 解出一帧: 返回消耗的字节数, 0 = 还不完整, -1 = 坏帧
+int ctl_decode(const char *buf, size_t len, ctl_request_t *req);
+
+// Proxy: 初始化 n 个连接并启动后台重连线程; 每条连接先用 ns (段名前缀) 向 cache 报到
+void ctl_conns_start(ctl_conn_t *conns, int n, const char *ns);
+
+// Proxy: 收到 CTL_INVALIDATE 时调用 fn(key); 连接断过重连上时调用 fn(""), 断开期间的通知可能丢了
+void ctl_conns_on_invalidate(void (*fn)(const char *key));
+
+// Proxy: 在连接上发一个请求; 没连上就立刻返回 -1, 从不睡眠
+int ctl_conn_send(ctl_conn_t *conn, const ctl_request_t *req);
+
+// Proxy: 在 n 条连接里找一条连着的发出去; 全都断开返回 -1
+int ctl_conns_send_any(ctl_conn_t *conns, int n, const ctl_request_t *req);
+
+// Proxy: 发请求之前登记要等哪个段上的回复, 等到了 (或者放弃了) 用 NULL 清掉;
+// cache 回 CTL_ABORT 时, 登记的 req_id 对得上就中止这个段的 ring
+void ctl_conn_set_waiting(ctl_conn_t *conn, shm_payload_t *payload, uint32_t req_id);
+
+// Proxy: 连接当前的断开次数; 发请求之前取一次, 等回复时对不上就说明连接断过
+uint32_t ctl_conn_epoch(ctl_conn_t *conn);
+
+// Proxy: 停掉后台重连线程并关闭所有连接; 之后不能再用这些连接
+void ctl_conns_close(ctl_conn_t *conns, int n);
+
+#endif // __CACHE_CTL_H__
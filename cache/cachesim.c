@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "keyindex.h"
+#include "evict.h"
+
+/*
+ * 用记录下来的访问轨迹离线比较 simplecached -P 的各个淘汰策略.  每行取第一个以 '/'
+ * 开头的词当 key (workload.txt 和 cache 自己的日志都能用), 在每个预算下回放一遍,
+ * 报命中率, 字节命中率, 省下的读盘字节和每 GB 内存换来的命中率.
+ */
+
+#define MAX_BUDGETS 32
+#define DEFAULT_FRACTIONS { 1, 5, 10, 25, 50 }	/* 不给 -m 时, 按去重后总字节数的百分比取预算 */
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  cachesim [options] trace...\n"                                             \
+"options:\n"                                                                  \
+"  -c [manifest]       Take object sizes from the files a locals.txt-style manifest names\n"	\
+"                      (Default: the first plain number on each trace line, e.g. \"sent N bytes\")\n"	\
+"  -z [bytes]          Size of objects whose size is not known otherwise (Default: 4096)\n"	\
+"  -m [megabytes,...]  Budgets to try (Default: 1, 5, 10, 25 and 50%% of the unique bytes)\n"	\
+"  -p [policy,...]     Policies to try: lru, clock, s3fifo, tinylfu (Default: all)\n"	\
+"  -h                  Show this help message\n"
+
+static struct option gLongOptions[] = {
+  {"manifest",     required_argument,      NULL,           'c'},
+  {"size",         required_argument,      NULL,           'z'},
+  {"memory",       required_argument,      NULL,           'm'},
+  {"policies",     required_argument,      NULL,           'p'},
+  {"help",         no_argument,            NULL,           'h'},
+  {NULL,           0,                      NULL,             0}
+};
+
+static keyindex_t keys;
+static size_t *sizes;	/* 每个 key 的大小, 0 = 还不知道 */
+static int nkeys, sizes_cap;
+static int *trace;	/* 按顺序的 key 下标 */
+static size_t ntrace, trace_cap;
+
+static int _key_id(const char *key){
+	int64_t id = keyindex_find(&keys, key);
+
+	if (id >= 0)
+		return (int) id;
+	if (0 > keyindex_insert(&keys, key, nkeys)){
+		fprintf(stderr, "Too many keys at %s\n", key);
+		exit(__LINE__);
+	}
+	if (nkeys == sizes_cap){
+		sizes_cap = sizes_cap ? sizes_cap * 2 : 1024;
+		sizes = realloc(sizes, sizes_cap * sizeof(size_t));
+	}
+	sizes[nkeys] = 0;
+	return nkeys++;
+}
+
+/* 清单里每个文件的大小 */
+static void _load_manifest(const char *filename){
+	FILE *list;
+	char *line = NULL, *ptr, *key, *path;
+	size_t linecap = 0;
+	struct stat st;
+
+	if (NULL == (list = fopen(filename, "r"))){
+		fprintf(stderr, "Unable to open manifest %s\n", filename);
+		exit(__LINE__);
+	}
+	while (0 < getline(&line, &linecap, list)){
+		ptr = line;
+		key = strsep(&ptr, " \t\r\n");
+		path = strsep(&ptr, " \t\r\n");
+		if (NULL == path || '\0' == key[0] || 0 > stat(path, &st))
+			continue;
+		sizes[_key_id(key)] = (size_t) st.st_size;
+	}
+	free(line);
+	fclose(list);
+}
+
+static void _load_trace(const char *filename, int sized){
+	FILE *in;
+	char *line = NULL, *ptr, *tok, *key;
+	size_t linecap = 0, size;
+	int id;
+
+	if (NULL == (in = fopen(filename, "r"))){
+		fprintf(stderr, "Unable to open trace %s\n", filename);
+		exit(__LINE__);
+	}
+	while (0 < getline(&line, &linecap, in)){
+		key = NULL;
+		size = 0;
+		ptr = line;
+		while (NULL != (tok = strsep(&ptr, " \t\r\n():,"))){
+			if (NULL == key && '/' == tok[0])
+				key = tok;
+			else if (0 == size && isdigit((unsigned char) tok[0]) && tok[strspn(tok, "0123456789")] == '\0')
+				size = strtoul(tok, NULL, 10);
+		}
+		if (NULL == key)
+			continue;
+
+		id = _key_id(key);
+		if (!sized && 0 == sizes[id])
+			sizes[id] = size;
+		if (ntrace == trace_cap){
+			trace_cap = trace_cap ? trace_cap * 2 : 1 << 16;
+			trace = realloc(trace, trace_cap * sizeof(int));
+		}
+		trace[ntrace++] = id;
+	}
+	free(line);
+	fclose(in);
+}
+
+typedef struct{
+	int policy;
+	evict_stats_t st;
+} result_t;
+
+static void _replay(int policy, size_t budget, result_t *r){
+	evict_t *ev = evict_create(policy, budget, nkeys);
+	size_t i;
+	int id;
+
+	for (i = 0; i < ntrace; i++){
+		id = trace[i];
+		if (evict_resident(ev, id)){
+			evict_hit(ev, id, sizes[id]);
+		} else {
+			evict_miss(ev, id, sizes[id]);
+			evict_insert(ev, id, sizes[id], NULL, NULL);
+		}
+	}
+	r->policy = policy;
+	evict_get_stats(ev, &r->st);
+	evict_destroy(ev);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+	size_t budgets[MAX_BUDGETS], unique = 0, default_size = 4096;
+	int fractions[] = DEFAULT_FRACTIONS;
+	int policies[EVICT_NPOLICIES], npolicies = 0, nbudgets = 0;
+	char *manifest = NULL, *list, *tok;
+	int option_char, i, b, p;
+	result_t results[EVICT_NPOLICIES];
+
+	while ((option_char = getopt_long(argc, argv, "c:z:m:p:h", gLongOptions, NULL)) != -1) {
+		switch (option_char) {
+			case 'c':
+				manifest = optarg;
+				break;
+			case 'z':
+				default_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				list = optarg;
+				while (NULL != (tok = strsep(&list, ",")) && nbudgets < MAX_BUDGETS)
+					if (0 < (budgets[nbudgets] = strtoul(tok, NULL, 10) << 20))
+						nbudgets++;
+				break;
+			case 'p':
+				list = optarg;
+				while (NULL != (tok = strsep(&list, ",")) && npolicies < EVICT_NPOLICIES){
+					if (0 > (policies[npolicies++] = evict_policy_parse(tok))){
+						fprintf(stderr, "Unknown eviction policy %s\n", tok);
+						exit(__LINE__);
+					}
+				}
+				break;
+			case 'h': // help
+				printf(USAGE);
+				exit(0);
+				break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(__LINE__);
+		}
+	}
+
+	if (optind >= argc) {
+		fprintf(stderr, USAGE);
+		exit(__LINE__);
+	}
+	if (npolicies == 0)
+		for (p = 0; p < EVICT_NPOLICIES; p++)
+			policies[npolicies++] = p;
+
+	keyindex_init(&keys, 1 << 16);
+	if (NULL != manifest)
+		_load_manifest(manifest);
+	for (i = optind; i < argc; i++)
+		_load_trace(argv[i], NULL != manifest);
+	for (i = 0; i < nkeys; i++){
+		if (0 == sizes[i])
+			sizes[i] = default_size;
+		unique += sizes[i];
+	}
+	if (ntrace == 0) {
+		fprintf(stderr, "No requests in the trace\n");
+		exit(__LINE__);
+	}
+
+	if (nbudgets == 0)
+		for (b = 0; b < (int) (sizeof(fractions) / sizeof(fractions[0])); b++)
+			if (0 < (budgets[nbudgets] = unique / 100 * fractions[b]))
+				nbudgets++;
+
+	printf("%zu requests, %d objects, %.1f MB unique\n", ntrace, nkeys, unique / 1048576.0);
+	printf("%10s  %-8s %9s %9s %12s %10s %12s\n",
+		"budget_MB", "policy", "hit_ratio", "byte_hit", "saved_MB", "evictions", "hit_per_GB");
+	for (b = 0; b < nbudgets; b++){
+		int best = 0;
+		double ratio, best_ratio = -1;
+
+		for (p = 0; p < npolicies; p++){
+			evict_stats_t *st = &results[p].st;
+			_replay(policies[p], budgets[b], &results[p]);
+			ratio = (double) st->hits / (st->hits + st->misses);
+			if (ratio > best_ratio){
+				best_ratio = ratio;
+				best = p;
+			}
+			printf("%10.1f  %-8s %9.4f %9.4f %12.1f %10lu %12.4f\n",
+				budgets[b] / 1048576.0, evict_policy_name(policies[p]), ratio,
+				st->bytes_hit + st->bytes_missed ? (double) st->bytes_hit / (st->bytes_hit + st->bytes_missed) : 0.0,
+				st->bytes_hit / 1048576.0, st->evictions, ratio / (budgets[b] / 1073741824.0));
+		}
+		printf("%10.1f  best: %s\n", budgets[b] / 1048576.0, evict_policy_name(policies[best]));
+	}
+
+	free(trace);
+	free(sizes);
+	keyindex_destroy(&keys);
+	return 0;
+}
@@ -0,0 +1,420 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "evict.h"
+
+#define S3FIFO_SMALL_PCT 10	/* S3-FIFO: small 队列占预算的比例 */
+#define S3FIFO_FREQ_MAX 3
+#define TINYLFU_WINDOW_PCT 1	/* W-TinyLFU: 窗口 LRU 占预算的比例 */
+#define TINYLFU_PROTECTED_PCT 80	/* 主区里 protected 段占的比例 */
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15		/* 计数器只用 4 位的范围 */
+#define SKETCH_SAMPLE 10	/* 计数次数到 宽度 * 这个数 就全部减半, 旧的热度慢慢淡掉 */
+#define SKETCH_MIN_WIDTH 64
+#define SKETCH_MAX_WIDTH (1 << 24)
+
+/* 对象所在的队列; LRU 和 CLOCK 只用 Q_MAIN, S3-FIFO 用 small + main, W-TinyLFU 用后三个 */
+enum { Q_NONE = 0, Q_MAIN, Q_SMALL, Q_WINDOW, Q_PROBATION, Q_PROTECTED, Q_COUNT };
+
+typedef struct{
+	int head, tail;	/* head = 最新进来的 */
+	size_t bytes;
+	int count;
+} evict_queue_t;
+
+typedef struct{
+	int prev, next;
+	size_t size;
+	unsigned char queue;	/* Q_NONE = 不在缓存里 */
+	unsigned char freq;	/* CLOCK 的引用位, S3-FIFO 的 0-3 计数; 命中时不拿锁改 */
+	unsigned long ghost;	/* S3-FIFO: 从 small 淘汰时的序号, 0 = 不在 ghost 里 */
+} evict_node_t;
+
+struct evict{
+	int policy;
+	size_t budget;
+	size_t used;
+	int nids;
+	evict_node_t *nodes;
+	evict_queue_t queues[Q_COUNT];
+	pthread_mutex_t lock;	/* 保护队列和 used; 命中路径只 trylock */
+	size_t small_cap;	/* S3-FIFO */
+	unsigned long ghost_seq;
+	size_t window_cap, protected_cap;	/* W-TinyLFU */
+	unsigned char *sketch;	/* count-min 草图, SKETCH_DEPTH 行, 每行 sketch_mask + 1 个计数器 */
+	size_t sketch_mask;
+	unsigned long sketch_adds, sketch_reset_at;
+	/* 下面三个不拿锁原子地加 */
+	unsigned long hits, misses, skipped;
+	unsigned long long bytes_hit, bytes_missed;
+	unsigned long inserts, rejects, evictions;
+};
+
+static const char *policy_names[EVICT_NPOLICIES] = { "lru", "clock", "s3fifo", "tinylfu" };
+
+int evict_policy_parse(const char *name){
+	int p;
+	for (p = 0; p < EVICT_NPOLICIES; p++)
+		if (0 == strcmp(name, policy_names[p]))
+			return p;
+	return -1;
+}
+
+const char *evict_policy_name(int policy){
+	return policy >= 0 && policy < EVICT_NPOLICIES ? policy_names[policy] : "?";
+}
+
+static void _q_unlink(evict_t *ev, int id){
+	evict_node_t *n = &ev->nodes[id];
+	evict_queue_t *q = &ev->queues[n->queue];
+
+	if (n->prev >= 0) ev->nodes[n->prev].next = n->next;
+	else q->head = n->next;
+	if (n->next >= 0) ev->nodes[n->next].prev = n->prev;
+	else q->tail = n->prev;
+	q->bytes -= n->size;
+	q->count--;
+	n->prev = n->next = -1;
+	__atomic_store_n(&n->queue, Q_NONE, __ATOMIC_RELAXED);
+}
+
+static void _q_push(evict_t *ev, int queue, int id){
+	evict_node_t *n = &ev->nodes[id];
+	evict_queue_t *q = &ev->queues[queue];
+
+	n->prev = -1;
+	n->next = q->head;
+	if (q->head >= 0) ev->nodes[q->head].prev = id;
+	else q->tail = id;
+	q->head = id;
+	q->bytes += n->size;
+	q->count++;
+	__atomic_store_n(&n->queue, queue, __ATOMIC_RELAXED);
+}
+
+/* 移到所在队列的最前面 */
+static void _q_touch(evict_t *ev, int id){
+	int queue = ev->nodes[id].queue;
+	if (ev->queues[queue].head == id)
+		return;
+	_q_unlink(ev, id);
+	_q_push(ev, queue, id);
+}
+
+static unsigned char _freq(evict_t *ev, int id){
+	return __atomic_load_n(&ev->nodes[id].freq, __ATOMIC_RELAXED);
+}
+
+static void _set_freq(evict_t *ev, int id, unsigned char freq){
+	__atomic_store_n(&ev->nodes[id].freq, freq, __ATOMIC_RELAXED);
+}
+
+/* 踢出去; self 是正在插入的那个, 它被踢掉的话由 evict_insert 按拒绝处理, 不回调 */
+static void _drop(evict_t *ev, int id, int self, void (*evicted)(int id, void *arg), void *arg){
+	_q_unlink(ev, id);
+	ev->used -= ev->nodes[id].size;
+	if (id == self)
+		return;
+	ev->evictions++;
+	if (NULL != evicted)
+		evicted(id, arg);
+}
+
+static uint64_t _mix(uint64_t x){
+	/* splitmix64 */
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static unsigned char *_sketch_cell(evict_t *ev, int id, int row){
+	uint64_t h = _mix((uint64_t) id * SKETCH_DEPTH + row);
+	return &ev->sketch[row * (ev->sketch_mask + 1) + (h & ev->sketch_mask)];
+}
+
+static unsigned char _sketch_freq(evict_t *ev, int id){
+	unsigned char f = SKETCH_MAX, c;
+	int row;
+	for (row = 0; row < SKETCH_DEPTH; row++){
+		c = __atomic_load_n(_sketch_cell(ev, id, row), __ATOMIC_RELAXED);
+		if (c < f) f = c;
+	}
+	return f;
+}
+
+/* 计数器不拿锁加, 偶尔丢一次无所谓; 减半要拿锁, 拿不到下次再说. 调用时不能拿着 ev->lock */
+static void _sketch_add(evict_t *ev, int id){
+	unsigned char *cell, c;
+	size_t i, n;
+	int row;
+
+	for (row = 0; row < SKETCH_DEPTH; row++){
+		cell = _sketch_cell(ev, id, row);
+		c = __atomic_load_n(cell, __ATOMIC_RELAXED);
+		if (c < SKETCH_MAX)
+			__atomic_store_n(cell, c + 1, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&ev->sketch_adds, 1, __ATOMIC_RELAXED) < ev->sketch_reset_at ||
+		0 != pthread_mutex_trylock(&ev->lock))
+		return;
+	if (ev->sketch_adds >= ev->sketch_reset_at){
+		n = SKETCH_DEPTH * (ev->sketch_mask + 1);
+		for (i = 0; i < n; i++)
+			__atomic_store_n(&ev->sketch[i], __atomic_load_n(&ev->sketch[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&ev->sketch_adds, ev->sketch_adds / 2, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ev->lock);
+}
+
+evict_t *evict_create(int policy, size_t budget, int nids){
+	evict_t *ev = calloc(1, sizeof(evict_t));
+	size_t width = SKETCH_MIN_WIDTH;
+	int q;
+
+	ev->policy = policy;
+	ev->budget = budget;
+	ev->nids = nids;
+	ev->nodes = calloc(nids > 0 ? nids : 1, sizeof(evict_node_t));
+	for (q = 0; q < Q_COUNT; q++)
+		ev->queues[q].head = ev->queues[q].tail = -1;
+	pthread_mutex_init(&ev->lock, NULL);
+
+	ev->small_cap = budget / 100 * S3FIFO_SMALL_PCT;
+	ev->window_cap = budget / 100 * TINYLFU_WINDOW_PCT;
+	ev->protected_cap = (budget - ev->window_cap) / 100 * TINYLFU_PROTECTED_PCT;
+	if (policy == EVICT_TINYLFU){
+		while (width < (size_t) nids && width < SKETCH_MAX_WIDTH)
+			width *= 2;
+		ev->sketch = calloc(SKETCH_DEPTH, width);
+		ev->sketch_mask = width - 1;
+		ev->sketch_reset_at = SKETCH_SAMPLE * width;
+	}
+	return ev;
+}
+
+void evict_destroy(evict_t *ev){
+	pthread_mutex_destroy(&ev->lock);
+	free(ev->sketch);
+	free(ev->nodes);
+	free(ev);
+}
+
+/* W-TinyLFU 命中: 窗口和 protected 里挪到最前, probation 里的升进 protected */
+static void _tinylfu_touch(evict_t *ev, int id){
+	evict_queue_t *protected = &ev->queues[Q_PROTECTED];
+
+	switch (ev->nodes[id].queue){
+		case Q_WINDOW:
+		case Q_PROTECTED:
+			_q_touch(ev, id);
+			break;
+		case Q_PROBATION:
+			_q_unlink(ev, id);
+			_q_push(ev, Q_PROTECTED, id);
+			/* protected 满了就把最老的降回 probation */
+			while (protected->bytes > ev->protected_cap && protected->count > 1){
+				int demoted = protected->tail;
+				_q_unlink(ev, demoted);
+				_q_push(ev, Q_PROBATION, demoted);
+			}
+			break;
+	}
+}
+
+void evict_hit(evict_t *ev, int id, size_t size){
+	unsigned char f;
+
+	__atomic_add_fetch(&ev->hits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ev->bytes_hit, size, __ATOMIC_RELAXED);
+
+	switch (ev->policy){
+		case EVICT_CLOCK:
+			if (0 == _freq(ev, id))
+				_set_freq(ev, id, 1);
+			return;
+		case EVICT_S3FIFO:
+			if (S3FIFO_FREQ_MAX > (f = _freq(ev, id)))
+				_set_freq(ev, id, f + 1);
+			return;
+		case EVICT_TINYLFU:
+			_sketch_add(ev, id);
+			break;
+	}
+
+	/* 重排队列要拿锁; 别人拿着就跳过这次, 热对象很快还会再被命中 */
+	if (0 != pthread_mutex_trylock(&ev->lock)){
+		__atomic_add_fetch(&ev->skipped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (Q_NONE != ev->nodes[id].queue){
+		if (ev->policy == EVICT_TINYLFU)
+			_tinylfu_touch(ev, id);
+		else
+			_q_touch(ev, id);
+	}
+	pthread_mutex_unlock(&ev->lock);
+}
+
+void evict_miss(evict_t *ev, int id, size_t size){
+	__atomic_add_fetch(&ev->misses, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ev->bytes_missed, size, __ATOMIC_RELAXED);
+	if (ev->policy == EVICT_TINYLFU)
+		_sketch_add(ev, id);
+}
+
+/* S3-FIFO 淘汰一个: small 超了份额就从 small 出, 被访问过的挪进 main, 没有的进 ghost */
+static void _s3fifo_evict(evict_t *ev, int self, void (*evicted)(int id, void *arg), void *arg){
+	evict_queue_t *small = &ev->queues[Q_SMALL], *main = &ev->queues[Q_MAIN];
+	int victim;
+
+	if (small->count > 0 && (small->bytes > ev->small_cap || main->count == 0)){
+		victim = small->tail;
+		if (_freq(ev, victim) > 0){
+			_q_unlink(ev, victim);
+			_set_freq(ev, victim, 0);
+			_q_push(ev, Q_MAIN, victim);
+		} else {
+			ev->nodes[victim].ghost = ++ev->ghost_seq;
+			_drop(ev, victim, self, evicted, arg);
+		}
+		return;
+	}
+
+	/* main 是带重插的 FIFO: 还有计数的减一放回队头 */
+	victim = main->tail;
+	if (_freq(ev, victim) > 0){
+		_q_unlink(ev, victim);
+		_set_freq(ev, victim, _freq(ev, victim) - 1);
+		_q_push(ev, Q_MAIN, victim);
+	} else {
+		_drop(ev, victim, self, evicted, arg);
+	}
+}
+
+/* W-TinyLFU: 窗口超了份额, 最老的作为候选进主区; 主区放不下时候选和主区最老的比频率, 低的出去 */
+static void _tinylfu_balance(evict_t *ev, int self, void (*evicted)(int id, void *arg), void *arg){
+	evict_queue_t *window = &ev->queues[Q_WINDOW];
+	evict_queue_t *probation = &ev->queues[Q_PROBATION];
+	evict_queue_t *protected = &ev->queues[Q_PROTECTED];
+	int candidate, victim, q;
+
+	while (window->count > 0 && window->bytes > ev->window_cap){
+		candidate = window->tail;
+		_q_unlink(ev, candidate);
+		_q_push(ev, Q_PROBATION, candidate);
+
+		while (ev->used > ev->budget){
+			victim = probation->tail != candidate ? probation->tail : protected->tail;
+			if (victim < 0 || _sketch_freq(ev, candidate) <= _sketch_freq(ev, victim)){
+				_drop(ev, candidate, self, evicted, arg);
+				break;
+			}
+			_drop(ev, victim, self, evicted, arg);
+		}
+	}
+
+	/* 窗口没超但总量超了 (主区是空的时候会这样): 按 probation, protected, 窗口的顺序踢 */
+	while (ev->used > ev->budget){
+		q = probation->count > 0 ? Q_PROBATION : protected->count > 0 ? Q_PROTECTED : Q_WINDOW;
+		_drop(ev, ev->queues[q].tail, self, evicted, arg);
+	}
+}
+
+int evict_insert(evict_t *ev, int id, size_t size, void (*evicted)(int id, void *arg), void *arg){
+	evict_node_t *n;
+	int rc;
+
+	if (id < 0 || id >= ev->nids)
+		return -1;
+	n = &ev->nodes[id];
+
+	pthread_mutex_lock(&ev->lock);
+	if (Q_NONE != n->queue){
+		pthread_mutex_unlock(&ev->lock);
+		return 0;
+	}
+	if (size > ev->budget){
+		ev->rejects++;
+		pthread_mutex_unlock(&ev->lock);
+		return -1;
+	}
+
+	n->size = size;
+	_set_freq(ev, id, 0);
+	ev->used += size;
+	ev->inserts++;
+
+	switch (ev->policy){
+		case EVICT_LRU:
+			_q_push(ev, Q_MAIN, id);
+			while (ev->used > ev->budget)
+				_drop(ev, ev->queues[Q_MAIN].tail, id, evicted, arg);
+			break;
+		case EVICT_CLOCK:
+			/* 指针扫过的对象: 引用位清掉给第二次机会, 没有引用的淘汰 */
+			_q_push(ev, Q_MAIN, id);
+			while (ev->used > ev->budget){
+				int victim = ev->queues[Q_MAIN].tail;
+				if (_freq(ev, victim) > 0){
+					_set_freq(ev, victim, 0);
+					_q_touch(ev, victim);
+				} else {
+					_drop(ev, victim, id, evicted, arg);
+				}
+			}
+			break;
+		case EVICT_S3FIFO:
+			/* 刚从 small 淘汰不久又来了: 说明不是一次性的, 直接进 main */
+			if (0 != n->ghost && ev->ghost_seq - n->ghost <= (unsigned long) ev->queues[Q_MAIN].count)
+				_q_push(ev, Q_MAIN, id);
+			else
+				_q_push(ev, Q_SMALL, id);
+			n->ghost = 0;
+			while (ev->used > ev->budget)
+				_s3fifo_evict(ev, id, evicted, arg);
+			break;
+		case EVICT_TINYLFU:
+			_q_push(ev, Q_WINDOW, id);
+			_tinylfu_balance(ev, id, evicted, arg);
+			break;
+	}
+
+	rc = Q_NONE != n->queue ? 0 : -1;
+	if (rc < 0)
+		ev->rejects++;
+	pthread_mutex_unlock(&ev->lock);
+	return rc;
+}
+
+void evict_remove(evict_t *ev, int id){
+	if (id < 0 || id >= ev->nids)
+		return;
+	pthread_mutex_lock(&ev->lock);
+	if (Q_NONE != ev->nodes[id].queue){
+		_q_unlink(ev, id);
+		ev->used -= ev->nodes[id].size;
+	}
+	pthread_mutex_unlock(&ev->lock);
+}
+
+int evict_resident(evict_t *ev, int id){
+	return id >= 0 && id < ev->nids && Q_NONE != __atomic_load_n(&ev->nodes[id].queue, __ATOMIC_RELAXED);
+}
+
+void evict_get_stats(evict_t *ev, evict_stats_t *stats){
+	pthread_mutex_lock(&ev->lock);
+	stats->budget = ev->budget;
+	stats->used = ev->used;
+	stats->inserts = ev->inserts;
+	stats->rejects = ev->rejects;
+	stats->evictions = ev->evictions;
+	pthread_mutex_unlock(&ev->lock);
+	stats->hits = __atomic_load_n(&ev->hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&ev->misses, __ATOMIC_RELAXED);
+	stats->skipped = __atomic_load_n(&ev->skipped, __ATOMIC_RELAXED);
+	stats->bytes_hit = __atomic_load_n(&ev->bytes_hit, __ATOMIC_RELAXED);
+	stats->bytes_missed = __atomic_load_n(&ev->bytes_missed, __ATOMIC_RELAXED);
+}
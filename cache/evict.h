@@ -0,0 +1,66 @@
+#ifndef __EVICT_H__
+#define __EVICT_H__
+
+#include <stddef.h>
+
+/*
+ * Byte-budgeted eviction policies over small integer ids.  The caller
+ * keeps the objects; a policy only decides which ids stay resident and
+ * reports the ones it drops through a callback.  Hits never wait on the
+ * policy lock: CLOCK and S3-FIFO only bump a per-id counter, LRU and
+ * W-TinyLFU reorder their queues when the lock happens to be free and
+ * skip the promotion otherwise.
+ */
+
+typedef enum {
+	EVICT_LRU,
+	EVICT_CLOCK,
+	EVICT_S3FIFO,
+	EVICT_TINYLFU,
+	EVICT_NPOLICIES
+} evict_policy_t;
+
+typedef struct evict evict_t;
+
+typedef struct {
+	size_t budget;
+	size_t used;
+	unsigned long hits, misses;
+	unsigned long long bytes_hit;	/* bytes served from resident objects */
+	unsigned long long bytes_missed;
+	unsigned long inserts, rejects, evictions;
+	unsigned long skipped;		/* hit promotions dropped because the lock was busy */
+} evict_stats_t;
+
+/* Returns the policy named name ("lru", "clock", "s3fifo", "tinylfu"), or -1. */
+int evict_policy_parse(const char *name);
+
+const char *evict_policy_name(int policy);
+
+/* Creates a policy holding at most budget bytes of objects with ids in [0, nids). */
+evict_t *evict_create(int policy, size_t budget, int nids);
+
+void evict_destroy(evict_t *ev);
+
+/* Records a request for a resident id. */
+void evict_hit(evict_t *ev, int id, size_t size);
+
+/* Records a request for an id that is not resident; call before evict_insert. */
+void evict_miss(evict_t *ev, int id, size_t size);
+
+/*
+ * Makes id resident with the given size, evicting others as needed;
+ * evicted is called with each dropped id while the policy lock is held.
+ * Returns 0 if id is resident afterwards and -1 if the policy turned it
+ * away (too large, or less popular than what it would displace).
+ */
+int evict_insert(evict_t *ev, int id, size_t size, void (*evicted)(int id, void *arg), void *arg);
+
+/* Drops id without calling the eviction callback; no-op if it is not resident. */
+void evict_remove(evict_t *ev, int id);
+
+int evict_resident(evict_t *ev, int id);
+
+void evict_get_stats(evict_t *ev, evict_stats_t *stats);
+
+#endif // __EVICT_H__
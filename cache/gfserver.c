@@ -0,0 +1,570 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "gfserver.h"
+
+/*
+ * One thread runs an epoll loop that accepts connections and reads
+ * requests without blocking; a complete request goes on req_queue for
+ * the first free worker, which runs the handler and closes the
+ * connection.  Handlers block (on the cache, on curl), so they keep
+ * their own threads, but a client that is connected and idle only
+ * costs a gfcontext_t.  A handler may also detach the response for an
+ * event loop to finish, which frees the worker right away.
+ */
+
+#define GFS_MAX_EVENTS 256
+#define GFS_REQUEST_TIMEOUT 30      // seconds a client gets to send its request
+#define GFS_SEND_TIMEOUT_MS 30000   // how long gfs_send waits on a client that takes no data
+#define GFS_OUT_BUFSIZE 16384       // per worker; a header and sends that fit leave in one write
+#define GFS_SCHEME "GETFILE"
+#define GFS_METHOD "GET"
+#define GFS_TERMINATOR "\r\n\r\n"
+
+typedef struct {
+  gfserver_t *gfs;
+  int index;
+} gfs_worker_t;
+
+void gfserver_init(gfserver_t *gfs, int nthreads){
+  memset(gfs, 0, sizeof(*gfs));
+  steque_init(&gfs->req_queue);
+  gfs->nthreads = nthreads;
+  gfs->max_npending = SOMAXCONN;
+  gfs->socket_fd = gfs->epoll_fd = gfs->wake_fd = -1;
+  gfs->worker_args = calloc(nthreads > 0 ? nthreads : 1, sizeof(void *));
+  pthread_mutex_init(&gfs->queue_lock, NULL);
+  pthread_cond_init(&gfs->req_inserted, NULL);
+}
+
+void gfserver_setopt(gfserver_t *gfs, gfserver_option_t option, ...){
+  va_list ap;
+  int index;
+  void *arg;
+
+  va_start(ap, option);
+  switch (option){
+    case GFS_PORT:
+      gfs->port = (unsigned short) va_arg(ap, int);
+      break;
+    case GFS_MAXNPENDING:
+      gfs->max_npending = va_arg(ap, int);
+      break;
+    case GFS_WORKER_FUNC:
+      gfs->worker_func = va_arg(ap, ssize_t (*)(gfcontext_t *, const char *, void *));
+      break;
+    case GFS_WORKER_ARG:
+      index = va_arg(ap, int);
+      arg = va_arg(ap, void *);
+      if (index >= 0 && index < gfs->nthreads)
+        gfs->worker_args[index] = arg;
+      break;
+    default:
+      fprintf(stderr, "gfserver_setopt: Invalid option\n");
+  }
+  va_end(ap);
+}
+
+// Decides whether a send that returned n may be retried, waiting while the client's receive window is full
+static int _may_retry(gfcontext_t *ctx, ssize_t n){
+  struct pollfd pfd;
+
+  if (n < 0 && errno == EINTR)
+    return 1;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+    pfd.fd = ctx->socket;
+    pfd.events = POLLOUT;
+    n = poll(&pfd, 1, GFS_SEND_TIMEOUT_MS);
+    if (n > 0 || (n < 0 && errno == EINTR))
+      return 1;
+  }
+  ctx->failed = 1;
+  return 0;
+}
+
+// Writes all of iov in as few syscalls as the socket allows
+static ssize_t _sendv(gfcontext_t *ctx, struct iovec *iov, int iovcnt, int flags){
+  struct msghdr msg;
+  size_t total = 0;
+  ssize_t n;
+  int i;
+
+  if (ctx->failed)
+    return -1;
+  for (i = 0; i < iovcnt; i++)
+    total += iov[i].iov_len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = iovcnt;
+  while (total > 0){
+    n = sendmsg(ctx->socket, &msg, flags | MSG_NOSIGNAL);
+    if (n <= 0){
+      if (!_may_retry(ctx, n))
+        return -1;
+      continue;
+    }
+    total -= n;
+    while (msg.msg_iovlen > 0 && (size_t) n >= msg.msg_iov->iov_len){
+      n -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0){
+      msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + n;
+      msg.msg_iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+// Writes out whatever the handler has buffered; MSG_MORE when more follows right away
+static int _flush(gfcontext_t *ctx, int flags){
+  struct iovec iov;
+
+  if (ctx->out_len == 0)
+    return ctx->failed ? -1 : 0;
+  iov.iov_base = ctx->out;
+  iov.iov_len = ctx->out_len;
+  ctx->out_len = 0;
+  return (int) _sendv(ctx, &iov, 1, flags);
+}
+
+ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
+  char header[64];
+  int len;
+
+  switch (status){
+    case GF_OK:
+      len = snprintf(header, sizeof(header), GFS_SCHEME " OK %zu ", file_len);
+      break;
+    case GF_FILE_NOT_FOUND:
+      len = snprintf(header, sizeof(header), GFS_SCHEME " FILE_NOT_FOUND 0\n");
+      file_len = 0;
+      break;
+    case GF_ERROR:
+      len = snprintf(header, sizeof(header), GFS_SCHEME " ERROR 0\n");
+      file_len = 0;
+      break;
+    default:
+      fprintf(stderr, "gfs_sendheader: Invalid gfstatus argument\n");
+      return -1;
+  }
+  if (ctx->header_sent){
+    fprintf(stderr, "gfs_sendheader: header already sent for %s\n", ctx->path);
+    return -1;
+  }
+
+  ctx->header_sent = 1;
+  ctx->file_len = file_len;
+  if (ctx->failed || (ctx->out_len + len > GFS_OUT_BUFSIZE && 0 > _flush(ctx, 0)))
+    return -1;
+
+  // Held back to leave with the first body bytes; without a body the response is complete now.
+  // A detached response must not wait here: it goes out with gfs_send_nowait or gfs_finish
+  memcpy(ctx->out + ctx->out_len, header, len);
+  ctx->out_len += len;
+  if (file_len == 0 && !ctx->detached && 0 > _flush(ctx, 0))
+    return -1;
+  return len;
+}
+
+ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size){
+  struct iovec iov[2];
+
+  if (ctx->failed)
+    return -1;
+  if (ctx->detached){
+    fprintf(stderr, "gfs_send: response for %s is detached, use gfs_send_nowait\n", ctx->path);
+    return -1;
+  }
+  if (ctx->out_len + size <= GFS_OUT_BUFSIZE){
+    memcpy(ctx->out + ctx->out_len, data, size);
+    ctx->out_len += size;
+    ctx->bytes_transferred += size;
+    if (ctx->bytes_transferred >= ctx->file_len && 0 > _flush(ctx, 0))
+      return -1;
+    return size;
+  }
+
+  iov[0].iov_base = ctx->out;
+  iov[0].iov_len = ctx->out_len;
+  iov[1].iov_base = data;
+  iov[1].iov_len = size;
+  ctx->out_len = 0;
+  if (0 > _sendv(ctx, iov, 2, 0))
+    return -1;
+  ctx->bytes_transferred += size;
+  return size;
+}
+
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len){
+  size_t left = len;
+  ssize_t n;
+
+  // The header goes out with the first pages of the file
+  if (0 > _flush(ctx, len > 0 ? MSG_MORE : 0))
+    return -1;
+  while (left > 0){
+    // The kernel copies from the page cache straight into the socket
+    n = sendfile(ctx->socket, fd, &offset, left);
+    if (n > 0){
+      left -= n;
+      ctx->bytes_transferred += n;
+    } else if (n == 0){
+      break;  // the file is shorter than len; the caller sees the short count
+    } else if (!_may_retry(ctx, n)){
+      return -1;
+    }
+  }
+  return len - left;
+}
+
+// Splits "GETFILE GET /path" in place; scheme and method are case-insensitive
+static int _parse_request(gfcontext_t *ctx){
+  char *line = ctx->request;
+
+  *strstr(line, "\r\n") = '\0';
+  ctx->protocol = strsep(&line, " ");
+  ctx->method = strsep(&line, " ");
+  ctx->path = strsep(&line, " ");
+
+  if (0 != strcasecmp(ctx->protocol, GFS_SCHEME)){
+    fprintf(stderr, "unsupported protocol: %s\n", ctx->protocol);
+    return -1;
+  }
+  if (NULL == ctx->method || 0 != strcasecmp(ctx->method, GFS_METHOD)){
+    fprintf(stderr, "unsupported request method: %s\n", ctx->method ? ctx->method : "");
+    return -1;
+  }
+  if (NULL == ctx->path || '/' != ctx->path[0]){
+    fprintf(stderr, "bad request: no leading slash on request URI: %s\n", ctx->path ? ctx->path : "");
+    return -1;
+  }
+  return 0;
+}
+
+static void _reading_unlink(gfserver_t *gfs, gfcontext_t *ctx){
+  if (ctx->prev) ctx->prev->next = ctx->next;
+  else gfs->reading = ctx->next;
+  if (ctx->next) ctx->next->prev = ctx->prev;
+  else gfs->reading_tail = ctx->prev;
+  ctx->prev = ctx->next = NULL;
+}
+
+// Gives up on a connection that has not handed over a request
+static void _drop(gfserver_t *gfs, gfcontext_t *ctx){
+  _reading_unlink(gfs, ctx);
+  close(ctx->socket);
+  free(ctx);
+}
+
+static void _accept(gfserver_t *gfs, time_t now){
+  struct epoll_event ev;
+  gfcontext_t *ctx;
+  int fd, one = 1;
+
+  while (!gfs->stopping){
+    fd = accept(gfs->socket_fd, NULL, NULL);
+    if (fd < 0){
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno == EMFILE || errno == ENFILE){
+        // The listening socket stays readable; stop watching it until the next tick
+        fprintf(stderr, "accept failed: out of file descriptors\n");
+        ev.events = 0;
+        ev.data.ptr = NULL;
+        epoll_ctl(gfs->epoll_fd, EPOLL_CTL_MOD, gfs->socket_fd, &ev);
+        gfs->accept_paused = 1;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK){
+        perror("accept failed");
+      }
+      return;
+    }
+
+    if (0 > fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) ||
+        NULL == (ctx = calloc(1, sizeof(gfcontext_t)))){
+      close(fd);
+      continue;
+    }
+    // Responses are already coalesced into whole writes; do not let Nagle hold back their tails
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    ctx->gfs = gfs;
+    ctx->socket = fd;
+    ctx->accepted = now;
+    ctx->prev = gfs->reading_tail;
+    if (gfs->reading_tail) gfs->reading_tail->next = ctx;
+    else gfs->reading = ctx;
+    gfs->reading_tail = ctx;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ctx;
+    if (0 > epoll_ctl(gfs->epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+      _drop(gfs, ctx);
+  }
+}
+
+// Reads what the client has sent; a complete request goes to the workers
+static void _read_request(gfserver_t *gfs, gfcontext_t *ctx){
+  ssize_t n;
+
+  for (;;){
+    n = recv(ctx->socket, ctx->request + ctx->request_len, MAX_REQUEST_LEN - 1 - ctx->request_len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    if (n <= 0){
+      _drop(gfs, ctx);
+      return;
+    }
+    ctx->request_len += n;
+    ctx->request[ctx->request_len] = '\0';
+    if (NULL != strstr(ctx->request, GFS_TERMINATOR))
+      break;
+    if (ctx->request_len == MAX_REQUEST_LEN - 1){
+      fprintf(stderr, "bad request: longer than %d bytes\n", MAX_REQUEST_LEN - 1);
+      _drop(gfs, ctx);
+      return;
+    }
+  }
+
+  epoll_ctl(gfs->epoll_fd, EPOLL_CTL_DEL, ctx->socket, NULL);
+  if (0 > _parse_request(ctx)){
+    _drop(gfs, ctx);
+    return;
+  }
+  _reading_unlink(gfs, ctx);
+
+  pthread_mutex_lock(&gfs->queue_lock);
+  steque_enqueue(&gfs->req_queue, ctx);
+  pthread_cond_signal(&gfs->req_inserted);
+  pthread_mutex_unlock(&gfs->queue_lock);
+}
+
+// Once a second: drop clients that never finished a request, resume accepting
+static void _tick(gfserver_t *gfs, time_t now){
+  struct epoll_event ev;
+
+  while (gfs->reading != NULL && now - gfs->reading->accepted >= GFS_REQUEST_TIMEOUT)
+    _drop(gfs, gfs->reading);
+
+  if (gfs->accept_paused && !gfs->stopping){
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(gfs->epoll_fd, EPOLL_CTL_MOD, gfs->socket_fd, &ev);
+    gfs->accept_paused = 0;
+  }
+}
+
+int gfs_detach(gfcontext_t *ctx){
+  // The worker's buffer goes back to the worker; only a header is held back from now on
+  if (0 > _flush(ctx, 0))
+    return -1;
+  ctx->out = ctx->held;
+  ctx->detached = 1;
+  return 0;
+}
+
+ssize_t gfs_send_nowait(gfcontext_t *ctx, const void *data, size_t size){
+  struct iovec iov[2];
+  struct msghdr msg;
+  ssize_t n;
+
+  if (ctx->failed)
+    return -1;
+  iov[0].iov_base = ctx->out;
+  iov[0].iov_len = ctx->out_len;
+  iov[1].iov_base = (void *) data;
+  iov[1].iov_len = size;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  do
+    n = sendmsg(ctx->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  while (n < 0 && errno == EINTR);
+  if (n < 0){
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    ctx->failed = 1;
+    return -1;
+  }
+
+  if ((size_t) n < ctx->out_len){
+    memmove(ctx->out, ctx->out + n, ctx->out_len - n);
+    ctx->out_len -= n;
+    return 0;
+  }
+  n -= ctx->out_len;
+  ctx->out_len = 0;
+  ctx->bytes_transferred += n;
+  return n;
+}
+
+int gfs_socket(gfcontext_t *ctx){
+  return ctx->socket;
+}
+
+void gfs_finish(gfcontext_t *ctx, ssize_t rc){
+  // No padding: a short body is reported to the client by closing early
+  if (rc < 0 && !ctx->header_sent)
+    gfs_sendheader(ctx, GF_ERROR, 0);
+  // At most a header is left of a detached response, and the socket took everything before it
+  if (ctx->detached)
+    gfs_send_nowait(ctx, NULL, 0);
+  else
+    _flush(ctx, 0);
+  if (ctx->header_sent && !ctx->failed && ctx->bytes_transferred < ctx->file_len)
+    fprintf(stderr, "gfserver: sent %zu of %zu bytes of %s, closing the connection\n",
+            ctx->bytes_transferred, ctx->file_len, ctx->path);
+  close(ctx->socket);
+  free(ctx);
+}
+
+static void *_worker(void *arg){
+  gfs_worker_t *worker = arg;
+  gfserver_t *gfs = worker->gfs;
+  gfcontext_t *ctx;
+  char out[GFS_OUT_BUFSIZE];
+  sigset_t pipe;
+  ssize_t rc;
+
+  // sendfile has no MSG_NOSIGNAL; a client that hangs up should fail the call, not kill the process
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+  for (;;){
+    pthread_mutex_lock(&gfs->queue_lock);
+    while (steque_isempty(&gfs->req_queue) && !gfs->stopping)
+      pthread_cond_wait(&gfs->req_inserted, &gfs->queue_lock);
+    if (gfs->stopping){
+      pthread_mutex_unlock(&gfs->queue_lock);
+      break;
+    }
+    ctx = steque_pop(&gfs->req_queue);
+    pthread_mutex_unlock(&gfs->queue_lock);
+
+    ctx->out = out;
+    rc = gfs->worker_func(ctx, ctx->path, gfs->worker_args[worker->index]);
+
+    // A detached response belongs to whoever calls gfs_finish, and may be gone already
+    if (rc != GFS_DETACHED)
+      gfs_finish(ctx, rc);
+  }
+  return NULL;
+}
+
+static void _listen(gfserver_t *gfs){
+  struct sockaddr_in addr;
+  int on = 1;
+
+  if (0 > (gfs->socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))){
+    fprintf(stderr, "failed to create the listening socket\n");
+    exit(SERVER_FAILURE);
+  }
+  if (0 > setsockopt(gfs->socket_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)))
+    fprintf(stderr, "failed to set SO_REUSEADDR socket option (not fatal)\n");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(gfs->port);
+  if (0 > bind(gfs->socket_fd, (struct sockaddr *) &addr, sizeof(addr))){
+    fprintf(stderr, "failed to bind; port = %d\n", gfs->port);
+    exit(SERVER_FAILURE);
+  }
+  if (0 > listen(gfs->socket_fd, gfs->max_npending)){
+    fprintf(stderr, "failed to listen\n");
+    exit(SERVER_FAILURE);
+  }
+}
+
+void gfserver_serve(gfserver_t *gfs){
+  struct epoll_event ev, events[GFS_MAX_EVENTS];
+  gfs_worker_t *workers;
+  time_t now, last_tick = 0;
+  int i, n;
+
+  _listen(gfs);
+  gfs->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  gfs->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (gfs->epoll_fd < 0 || gfs->wake_fd < 0){
+    perror("gfserver_serve");
+    exit(SERVER_FAILURE);
+  }
+  // data.ptr tells the two server descriptors apart from client connections
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(gfs->epoll_fd, EPOLL_CTL_ADD, gfs->socket_fd, &ev);
+  ev.data.ptr = &gfs->wake_fd;
+  epoll_ctl(gfs->epoll_fd, EPOLL_CTL_ADD, gfs->wake_fd, &ev);
+
+  workers = calloc(gfs->nthreads, sizeof(gfs_worker_t));
+  gfs->workers = calloc(gfs->nthreads, sizeof(pthread_t));
+  for (i = 0; i < gfs->nthreads; i++){
+    workers[i].gfs = gfs;
+    workers[i].index = i;
+    pthread_create(&gfs->workers[i], NULL, _worker, &workers[i]);
+  }
+
+  while (!gfs->stopping){
+    n = epoll_wait(gfs->epoll_fd, events, GFS_MAX_EVENTS, 1000);
+    if (n < 0 && errno != EINTR){
+      perror("epoll_wait");
+      break;
+    }
+    now = time(NULL);
+    for (i = 0; i < n && !gfs->stopping; i++){
+      if (events[i].data.ptr == NULL)
+        _accept(gfs, now);
+      else if (events[i].data.ptr != &gfs->wake_fd)
+        _read_request(gfs, events[i].data.ptr);
+    }
+    if (now != last_tick){
+      _tick(gfs, now);
+      last_tick = now;
+    }
+  }
+
+  // Requests nobody picked up yet are dropped; running handlers finish first
+  pthread_mutex_lock(&gfs->queue_lock);
+  gfs->stopping = 1;
+  pthread_cond_broadcast(&gfs->req_inserted);
+  pthread_mutex_unlock(&gfs->queue_lock);
+  for (i = 0; i < gfs->nthreads; i++)
+    pthread_join(gfs->workers[i], NULL);
+  while (!steque_isempty(&gfs->req_queue)){
+    gfcontext_t *ctx = steque_pop(&gfs->req_queue);
+    close(ctx->socket);
+    free(ctx);
+  }
+  while (gfs->reading != NULL)
+    _drop(gfs, gfs->reading);
+
+  if (gfs->socket_fd >= 0)
+    close(gfs->socket_fd);
+  close(gfs->epoll_fd);
+  close(gfs->wake_fd);
+  free(gfs->workers);
+  free(workers);
+}
+
+void gfserver_stop(gfserver_t *gfs){
+  uint64_t one = 1;
+  ssize_t rc;
+
+  // Only async-signal-safe calls: the proxies stop from their SIGINT handler
+  gfs->stopping = 1;
+  if (gfs->wake_fd >= 0){
+    rc = write(gfs->wake_fd, &one, sizeof(one));
+    (void) rc;
+  }
+}
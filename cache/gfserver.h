@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/signal.h>
+#include <time.h>
 #include "steque.h"
 
 
@@ -24,49 +25,62 @@
 
 typedef int gfstatus_t;
 
-//Status definitions
 #define  GF_OK 200
 #define  GF_FILE_NOT_FOUND 400
 #define  GF_ERROR 500
 
-/*
-Appropriate server failure definition
-*/
 #if !defined(SERVER_FAILURE)
-#define SERVER_FAILURE (-1) 
-#endif 
+#define SERVER_FAILURE (-1)
+#endif // SERVER_FAILURE
+
+/* What a handler returns after handing its response on with gfs_detach */
+#define GFS_DETACHED (-2)
 
 typedef struct _gfserver_t gfserver_t;
 typedef struct _gfcontext_t gfcontext_t;
 
-/*
-Main struct definition
-*/
+
 struct _gfserver_t{
-	steque_t req_queue;
+	steque_t req_queue;	/* gfcontext_t* whose request has been read, waiting for a worker */
 	unsigned short port;
 	int max_npending;
 	int nthreads;
 	int socket_fd;
+	int epoll_fd;
+	int wake_fd;		/* eventfd gfserver_stop writes to */
+	volatile sig_atomic_t stopping;
+	int accept_paused;	/* out of descriptors; accepting again on the next tick */
+
 	ssize_t (*worker_func)(gfcontext_t *, const char *, void*);
-	gfcontext_t *contexts;
+
+	void **worker_args;	/* GFS_WORKER_ARG of each worker thread */
+	pthread_t *workers;
+	gfcontext_t *reading;	/* connections still sending their request, oldest first */
+	gfcontext_t *reading_tail;
 	pthread_mutex_t queue_lock;
 	pthread_cond_t req_inserted;
 };
 
 struct _gfcontext_t{
-	pthread_t thread;
-	void *arg;
 	gfserver_t *gfs;
+	gfcontext_t *prev, *next;	/* place in gfs->reading */
+	time_t accepted;
 
 	int socket;
+	int header_sent;
+	int failed;		/* the client stopped taking data */
 	size_t file_len;
 	size_t bytes_transferred;
+	char *out;		/* the worker's output buffer while the handler runs, then held */
+	size_t out_len;		/* bytes in out that have not been written yet */
+	int detached;		/* the response is finished outside the worker, see gfs_detach */
+	char held[64];		/* a detached response's buffer: room for the header */
 
 	char *protocol;
 	char *method;
 	char *path;
-	char request[MAX_REQUEST_LEN];	
+	size_t request_len;
+	char request[MAX_REQUEST_LEN];
 };
 
 typedef enum{
@@ -76,9 +90,9 @@ typedef enum{
   GFS_WORKER_ARG
 } gfserver_option_t;
 
-
 /* 
- * Initializes the input gfserver_t object to use nthreads.
+ * Initializes the input gfserver_t object to run handlers on nthreads
+ * worker threads.
  */
 void gfserver_init(gfserver_t *gfh, int nthreads);
 
@@ -109,9 +123,13 @@ void gfserver_init(gfserver_t *gfh, int nthreads);
  *
  *						Returning a negative number will cause the 
  *						gfserver library to send an error message to the
- *						client.  Otherwise, gfserver will assume that
- *						this function has performed all the necessary 
- *						communication.
+ *						client, or to close the connection if a header
+ *						was already sent.  Otherwise, gfserver will assume
+ *						that this function has performed all the necessary 
+ *						communication; a body shorter than the length in
+ *						the header closes the connection early.
+ *						Returning GFS_DETACHED after gfs_detach leaves
+ *						the connection to gfs_finish.
  *
  *
  * GFS_WORKER_ARG		This option is followed by two arguments, an int
@@ -124,12 +142,17 @@ void gfserver_init(gfserver_t *gfh, int nthreads);
 void gfserver_setopt(gfserver_t *gfh, gfserver_option_t option, ...);
 
 /*
- * Connects the server to the socket so that it can begin handling requests.  
+ * Connects the server to the socket so that it can begin handling
+ * requests.  The calling thread accepts connections and reads requests
+ * with epoll, so idle clients do not hold a thread; a client has 30
+ * seconds to send its request.  Only complete requests are handed to
+ * the worker threads.  Does not return until gfserver_stop is called.
  */
 void gfserver_serve(gfserver_t *gfh);
 
 /*
- * Shuts down the server and severs conenctions associated with the input gfserver_t object.  
+ * Shuts down the server associated with the input gfserver_t object.  
+ * Safe to call from a signal handler.
  */
 void gfserver_stop(gfserver_t *gfh);
 
@@ -144,9 +167,49 @@ ssize_t gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
 /*
  * Sends size bytes starting at the pointer data to the client 
  * This function should only be called from within a callback registered 
- * with the GFS_WORKER_FUNC option.  It returns once the data has been
- * written to the socket.
+ * with the GFS_WORKER_FUNC option.  Small sends, and the header before
+ * them, are held back and leave in one write with the next send, once
+ * the whole body is there, or when the callback returns.  It returns
+ * once the data has been buffered or written to the socket, or -1 if the
+ * client went away or took no data for 30 seconds.
  */
 ssize_t gfs_send(gfcontext_t *ctx, void *data, size_t size);
 
+/*
+ * Sends len bytes of the open file fd, starting at offset, to the client
+ * without copying them through user space.  The file position of fd is
+ * left alone.  Returns the number of bytes sent, which is short only if
+ * the file ends first, or -1 if the client went away, took no data for
+ * 30 seconds or fd could not be read.  Like gfs_send, it should only be
+ * called from within a GFS_WORKER_FUNC callback.
+ */
+ssize_t gfs_sendfile(gfcontext_t *ctx, int fd, off_t offset, size_t len);
+
+/*
+ * Hands the response over to another thread, so the worker can take the
+ * next request: anything the callback buffered is written out first.  On
+ * success the callback must return GFS_DETACHED without touching ctx
+ * again; whoever takes it over continues with gfs_sendheader and
+ * gfs_send_nowait and ends with gfs_finish.  Returns -1 if the client
+ * went away, in which case the callback keeps ctx and returns as usual.
+ */
+int gfs_detach(gfcontext_t *ctx);
+
+/*
+ * For detached responses: writes the held-back header and then as much of
+ * data as the socket takes right now.  Returns the number of data bytes
+ * written, fewer than size when the socket is full (wait for gfs_socket
+ * to become writable and send the rest), or -1 if the client went away.
+ */
+ssize_t gfs_send_nowait(gfcontext_t *ctx, const void *data, size_t size);
+
+// The client's socket, to wait for it with poll or epoll
+int gfs_socket(gfcontext_t *ctx);
+
+/*
+ * Ends a detached response as if its callback had returned rc, closes
+ * the connection and frees ctx.  Does not wait on the client.
+ */
+void gfs_finish(gfcontext_t *ctx, ssize_t rc);
+
 #endif
@@ -1,131 +1,481 @@
 #include "gfserver.h"
 #include "cache-student.h"
 #include "shm_channel.h"
+#include "l1cache.h"
+#include "readthrough.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
-#include <sys/un.h>
 #include <unistd.h>
+#include <stdint.h>
 
-#define SOCKET_PATH "/tmp/cache_socket"
-#define MAX_RETRIES 5
-#define RETRY_DELAY_SEC 1
+#define OBJECT_CACHE_SIZE 1024
+#define SIZE_MEMO_SIZE 4096
+#define SLOT_MIN_SHARE 16 // 一个对象最多分成大约这么多块
 
-ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg) {
-    printf("[PROXY] handle_with_cache called with path: %s\n", path);
+// 打开过的只读对象, 按对象名开放寻址. name 为空 = 空位; fd < 0 = 删掉了, 查找要跨过去, 插入可以复用
+// 文件变了 cache 会换个名字重新导出, 并发 CTL_INVALIDATE; 那时按 key_hash 关掉旧对象的 fd
+typedef struct {
+    char name[SHM_NAME_LEN];
+    uint64_t key_hash;          // 请求路径的 _path_hash
+    size_t size;
+    int fd;
+} object_fd_t;
 
-    void** args = (void**) arg;
-    steque_t* pool = (steque_t*) args[0];
-    size_t segsize = *((size_t*) args[1]);
-    pthread_mutex_t* lock = (pthread_mutex_t*) args[2];
+static object_fd_t objects[OBJECT_CACHE_SIZE];
+static pthread_mutex_t objects_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int next_req_id;
+static int fills_active; // 正在留副本准备回填的回源请求数
 
-    pthread_mutex_lock(lock);
-    if (steque_isempty(pool)) {
-        pthread_mutex_unlock(lock);
-        fprintf(stderr, "No free shared memory segments!\n");
-        return gfs_sendheader(ctx, GF_ERROR, 0);
+// 最近见过的对象大小, 按路径哈希直接映射, 冲突就覆盖; 只用来挑 size class
+typedef struct {
+    uint64_t hash;
+    size_t size;
+} size_memo_t;
+
+static size_memo_t size_memo[SIZE_MEMO_SIZE];
+static pthread_mutex_t size_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t _path_hash(const char *path) {
+    uint64_t h = 14695981039346656037ull;
+    while (*path) h = (h ^ (unsigned char)*path++) * 1099511628211ull;
+    return h | 1; // 0 留给空槽
+}
+
+static int _size_memo_get(const char *path, size_t *size) {
+    uint64_t h = _path_hash(path);
+    size_memo_t *m = &size_memo[h % SIZE_MEMO_SIZE];
+    int found;
+
+    pthread_mutex_lock(&size_memo_lock);
+    if ((found = (m->hash == h))) *size = m->size;
+    pthread_mutex_unlock(&size_memo_lock);
+    return found;
+}
+
+static void _size_memo_put(const char *path, size_t size) {
+    uint64_t h = _path_hash(path);
+    size_memo_t *m = &size_memo[h % SIZE_MEMO_SIZE];
+
+    pthread_mutex_lock(&size_memo_lock);
+    m->hash = h;
+    m->size = size;
+    pthread_mutex_unlock(&size_memo_lock);
+}
+
+// 池里的段的 ring 可能被中止过 (cache 以为这个 proxy 已经退出, 或者 CTL_ABORT 晚到): 用之前换成新段
+static shm_segment_t* _fresh_segment(shm_segment_t *seg) {
+    if (seg == NULL || !__atomic_load_n(&((shm_payload_t*)seg->addr)->aborted, __ATOMIC_ACQUIRE)) return seg;
+    if (shm_segment_recreate(seg) == 0) return seg;
+    fprintf(stderr, "[PROXY] failed to recreate %s, dropping it from the pool\n", seg->shm_name);
+    free(seg);
+    return NULL;
+}
+
+// 按大小提示挑段: 一块至少装得下对象 1/SLOT_MIN_SHARE 的最小一类, 再大的类只会让更多请求挤在少数几个大段上.
+// 大小未知就用最大的一类; 零拷贝交付时 ring 里只有元数据, 总是用最小的一类.
+// 那一类没空闲段时先看别的类有没有空闲的 (先往大的找, 再往小的找), 都没有再在那一类排队
+static shm_segment_t* _acquire_segment(proxy_worker_arg_t *args, const char *path) {
+    int n = args->npools, c = n - 1;
+    size_t size;
+
+    if (args->mapped_delivery) {
+        c = 0;
+    } else if (_size_memo_get(path, &size)) {
+        for (int i = 0; i < n; i++) {
+            shm_pool_t *pool = &args->pools[i];
+            if (shm_slot_capacity(pool->segsize, pool->nslots) * SLOT_MIN_SHARE >= size) {
+                c = i;
+                break;
+            }
+        }
     }
-    shm_segment_t* seg = steque_pop(pool);
-    pthread_mutex_unlock(lock);
 
-    shm_payload_t* payload = (shm_payload_t*) seg->addr;
+    for (int k = 0; k < n; k++) {
+        shm_segment_t *seg = shm_pool_try_acquire(&args->pools[c + k < n ? c + k : n - 1 - k]);
+        if (seg != NULL) return _fresh_segment(seg);
+    }
+    return _fresh_segment(shm_pool_acquire(&args->pools[c]));
+}
 
-    char request[1024];
-    snprintf(request, sizeof(request), "%s %s %zu\n", seg->shm_name, path, segsize);
+static unsigned int _name_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h;
+}
 
-    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+// 返回对象的只读 fd, 用完要 close; 表里缓存的那个随时可能被作废关掉, 所以给的是 dup 出来的
+static int _open_object(const char *name, const char *path, size_t size) {
+    unsigned int idx = _name_hash(name) % OBJECT_CACHE_SIZE;
+    object_fd_t *found = NULL, *slot = NULL;
+    int fd;
 
-    int connected = 0;
-    for (int i = 0; i < 5; ++i) {
-        if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-            connected = 1;
+    pthread_mutex_lock(&objects_lock);
+    for (int probe = 0; probe < OBJECT_CACHE_SIZE; probe++) {
+        object_fd_t *o = &objects[(idx + probe) % OBJECT_CACHE_SIZE];
+        if (o->name[0] == '\0') {
+            if (slot == NULL) slot = o;
+            break;
+        }
+        if (o->fd < 0) {
+            if (slot == NULL) slot = o;
+        } else if (strcmp(o->name, name) == 0) {
+            found = o;
             break;
         }
-        sleep(1);
     }
-    if (!connected) {
-        close(sockfd);
-        fprintf(stderr, "[PROXY] ERROR reason A\n");
-        goto error;
+
+    // 同名但大小对不上: 缓存的 fd 是别的内容, 关掉换成新打开的
+    if (found != NULL && found->size != size) {
+        close(found->fd);
+        found->fd = -1;
+        slot = found;
+        found = NULL;
+    }
+    if (found != NULL) {
+        fd = dup(found->fd);
+        pthread_mutex_unlock(&objects_lock);
+        return fd;
+    }
+
+    // 表满了就不缓存, 每次都打开
+    if ((fd = shm_object_open(name)) >= 0 && slot != NULL) {
+        strncpy(slot->name, name, SHM_NAME_LEN - 1);
+        slot->name[SHM_NAME_LEN - 1] = '\0';
+        slot->key_hash = _path_hash(path);
+        slot->size = size;
+        slot->fd = fd;
+        fd = dup(fd);
+    }
+    pthread_mutex_unlock(&objects_lock);
+    return fd;
+}
+
+void handle_with_cache_invalidate(const char *key) {
+    uint64_t h = _path_hash(key);
+
+    l1cache_invalidate(key);
+
+    // key 为空 = 全部作废, 顺便把删掉的位置也清空
+    pthread_mutex_lock(&objects_lock);
+    for (int i = 0; i < OBJECT_CACHE_SIZE; i++) {
+        object_fd_t *o = &objects[i];
+        if (o->name[0] == '\0' || (key[0] != '\0' && (o->fd < 0 || o->key_hash != h))) continue;
+        if (o->fd >= 0) close(o->fd);
+        o->fd = -1;
+        if (key[0] == '\0') o->name[0] = '\0';
+    }
+    pthread_mutex_unlock(&objects_lock);
+}
+
+// 一段 ring 等待到期之后调用: 控制连接断过 (cache 可能已经重启), ring 被中止, 或者累计等够 CTL_REPLY_TIMEOUT_MS 就不再等
+static int _keep_waiting(proxy_worker_arg_t *args, shm_payload_t *payload, uint32_t epoch, int *waited_ms) {
+    *waited_ms += CTL_RECONNECT_MS;
+    return *waited_ms < CTL_REPLY_TIMEOUT_MS &&
+           !__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE) &&
+           ctl_conn_epoch(args->conn) == epoch;
+}
+
+// 等 cache 填好下一块; 等不到返回 NULL, 这时段已经不可信, 要交给 _release_dirty
+static shm_slot_t* _next_chunk(proxy_worker_arg_t *args, shm_payload_t *payload, uint32_t epoch) {
+    shm_slot_t *slot;
+    int waited_ms = 0;
+    while ((slot = shm_ring_begin_read_timed(payload, CTL_RECONNECT_MS)) == NULL &&
+           _keep_waiting(args, payload, epoch, &waited_ms))
+        ;
+    return slot;
+}
+
+// CTL_FILL 时反过来: 等 cache 读走一块腾出空槽
+static shm_slot_t* _free_slot(proxy_worker_arg_t *args, shm_payload_t *payload, uint32_t epoch) {
+    shm_slot_t *slot;
+    int waited_ms = 0;
+    while ((slot = shm_ring_begin_write_timed(payload, CTL_RECONNECT_MS)) == NULL &&
+           _keep_waiting(args, payload, epoch, &waited_ms))
+        ;
+    return slot;
+}
+
+// 等待失败的段: cache 也许还会晚到地往里写, 换成新代号的同名段再还回池子; 重建失败就让池子少一个段
+static void _release_dirty(shm_segment_t *seg) {
+    shm_pool_t *pool = seg->pool;
+
+    fprintf(stderr, "[PROXY] no progress from cache on %s, recreating it\n", seg->shm_name);
+    if (shm_segment_recreate(seg) < 0) {
+        fprintf(stderr, "[PROXY] failed to recreate %s, dropping it from the pool\n", seg->shm_name);
+        free(seg);
+        return;
+    }
+    shm_pool_release(pool, seg);
+}
+
+// 把回源取到的整个对象经段交给 cache. 不排队: 段留给等 cache 的请求, 没有空闲的就不填了
+static void _fill_cache(proxy_worker_arg_t *args, const char *path, const char *data, size_t size) {
+    shm_segment_t *seg = NULL;
+    for (int i = args->npools - 1; i >= 0 && seg == NULL; i--) {
+        seg = _fresh_segment(shm_pool_try_acquire(&args->pools[i]));
+    }
+    if (seg == NULL) return;
+
+    shm_payload_t *payload = (shm_payload_t*) seg->addr;
+    ctl_request_t req;
+    req.type = CTL_FILL;
+    req.req_id = __sync_add_and_fetch(&next_req_id, 1);
+    req.segsize = seg->size;
+    req.generation = payload->generation;
+    strncpy(req.shm_name, seg->shm_name, sizeof(req.shm_name));
+    strncpy(req.key, path, sizeof(req.key) - 1);
+    req.key[sizeof(req.key) - 1] = '\0';
+
+    // 这次 proxy 是写的一方; 段头先填好, cache 收到请求才会来读
+    payload->req_id = req.req_id;
+    payload->total_file_size = size;
+    uint32_t epoch = ctl_conn_epoch(args->conn);
+    ctl_conn_set_waiting(args->conn, payload, req.req_id);
+    if (ctl_conn_send(args->conn, &req) < 0) {
+        ctl_conn_set_waiting(args->conn, NULL, 0);
+        shm_pool_release(seg->pool, seg);
+        return;
     }
 
-    if (write(sockfd, request, strlen(request)) < 0) {
-        close(sockfd);
-        fprintf(stderr, "[PROXY] ERROR reason A\n");
+    size_t max_chunk_size = payload->slot_size - sizeof(shm_slot_t);
+    size_t offset = 0;
+    int last;
+    do {
+        shm_slot_t *slot = _free_slot(args, payload, epoch);
+        if (slot == NULL) {
+            ctl_conn_set_waiting(args->conn, NULL, 0);
+            _release_dirty(seg);
+            return;
+        }
+        size_t n = size - offset < max_chunk_size ? size - offset : max_chunk_size;
+        memcpy(slot->data, data + offset, n);
+        offset += n;
+        slot->datalen = n;
+        last = (offset >= size);
+        slot->is_last_chunk = last;
+        shm_ring_commit_write(payload);
+    } while (!last);
+
+    // cache 读完最后一块之前段还是它的
+    int waited_ms = 0, drained;
+    while ((drained = shm_ring_wait_drained_timed(payload, CTL_RECONNECT_MS)) < 0 &&
+           _keep_waiting(args, payload, epoch, &waited_ms))
+        ;
+    ctl_conn_set_waiting(args->conn, NULL, 0);
+    if (drained < 0) {
+        _release_dirty(seg);
+        return;
+    }
+    shm_pool_release(seg->pool, seg);
+    printf("[PROXY] filled %s (%zu bytes) into the cache\n", path, size);
+}
+
+// miss 之后回源. cache 想要这个对象 (fill_limit > 0) 并且回填名额没用完的话, 发完再填回 cache
+static ssize_t _read_through(gfcontext_t *ctx, const char *path, proxy_worker_arg_t *args, size_t fill_limit) {
+    char url[CTL_MAX_KEYLEN + 512];
+    char *kept = NULL;
+    size_t kept_size, keep_limit = 0;
+
+    snprintf(url, sizeof(url), "%s%s", args->server, path);
+    if (fill_limit > 0) {
+        if (__sync_add_and_fetch(&fills_active, 1) <= args->max_fills) keep_limit = fill_limit;
+        else __sync_sub_and_fetch(&fills_active, 1);
+    }
+
+    ssize_t sent = readthrough_fetch(args->curl, url, ctx, keep_limit, &kept, &kept_size);
+    if (kept != NULL) {
+        _fill_cache(args, path, kept, kept_size);
+        free(kept);
+    }
+    if (keep_limit > 0) __sync_sub_and_fetch(&fills_active, 1);
+    return sent;
+}
+
+ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg) {
+    printf("[PROXY] handle_with_cache called with path: %s\n", path);
+
+    proxy_worker_arg_t* args = (proxy_worker_arg_t*) arg;
+
+    // 小的热对象直接从进程内的 L1 发, 不用段也不用找 cache
+    l1cache_entry_t *hit = l1cache_get(path);
+    if (hit != NULL) {
+        ssize_t sent = -1;
+        size_t size = hit->size;
+        if (gfs_sendheader(ctx, GF_OK, size) >= 0) {
+            sent = gfs_send(ctx, hit->data, size);
+        }
+        l1cache_release(hit);
+        return (sent == (ssize_t)size) ? sent : SERVER_FAILURE;
+    }
+    // 请求发出之前拿代号, 传输期间 key 被作废的话这份内容就不进 L1
+    uint64_t l1_generation = l1cache_generation(path);
+    l1cache_entry_t *fill = NULL;
+
+    // 池空时按 FIFO 排队, 超过期限才报错
+    shm_segment_t* seg = _acquire_segment(args, path);
+    if (seg == NULL) {
+        fprintf(stderr, "No free shared memory segments!\n");
+        return gfs_sendheader(ctx, GF_ERROR, 0);
+    }
+
+    shm_payload_t* payload = (shm_payload_t*) seg->addr;
+    payload->delivery = args->mapped_delivery ? SHM_DELIVER_MAPPED : SHM_DELIVER_COPY;
+
+    ctl_request_t req;
+    req.type = CTL_GET;
+    req.req_id = __sync_add_and_fetch(&next_req_id, 1);
+    req.segsize = seg->size;
+    req.generation = payload->generation;
+    strncpy(req.shm_name, seg->shm_name, sizeof(req.shm_name));
+    strncpy(req.key, path, sizeof(req.key) - 1);
+    req.key[sizeof(req.key) - 1] = '\0';
+
+    // 长连接断了就直接失败, 后台线程负责重连
+    // cache attach 不上段的话会回 CTL_ABORT, 后台线程靠这个登记找到我们的段
+    uint32_t epoch = ctl_conn_epoch(args->conn);
+    ctl_conn_set_waiting(args->conn, payload, req.req_id);
+    if (ctl_conn_send(args->conn, &req) < 0) {
+        ctl_conn_set_waiting(args->conn, NULL, 0);
+        fprintf(stderr, "[PROXY] no control connection to cache for %s\n", path);
         goto error;
     }
-    close(sockfd);
 
     // wait for the first chunk before sending header
-    printf("[PROXY] waiting on sem_proxy_ready for %s\n", path);
-    if (sem_wait(&payload->sem_proxy_ready) < 0) {
-        perror("sem_wait");
-        goto error;
+    printf("[PROXY] waiting for first chunk of %s\n", path);
+    shm_slot_t* slot = _next_chunk(args, payload, epoch);
+    ctl_conn_set_waiting(args->conn, NULL, 0);
+    if (slot == NULL) {
+        fprintf(stderr, "[PROXY] no reply from cache for %s\n", path);
+        _release_dirty(seg);
+        return gfs_sendheader(ctx, GF_ERROR, 0);
     }
 
-    if (payload->datalen == 0) {
-        if (payload->is_last_chunk) {
-            fprintf(stderr, "[PROXY] cache miss or empty file: %s\n", path);
-        } else {
-            fprintf(stderr, "[PROXY] unexpected zero-length chunk for: %s\n", path);
+    if (payload->req_id != req.req_id) {
+        fprintf(stderr, "[PROXY] reply %u does not match request %u for %s\n", payload->req_id, req.req_id, path);
+        while (!slot->is_last_chunk) {
+            shm_ring_end_read(payload);
+            if ((slot = _next_chunk(args, payload, epoch)) == NULL) {
+                _release_dirty(seg);
+                return gfs_sendheader(ctx, GF_ERROR, 0);
+            }
         }
+        shm_ring_end_read(payload);
         goto error;
     }
 
+    if (payload->delivery == SHM_DELIVER_MAPPED) {
+        // 段只用来查找和传元数据, 马上还回去
+        char object_name[SHM_NAME_LEN];
+        size_t object_size = payload->total_file_size;
+        strncpy(object_name, payload->object_name, SHM_NAME_LEN);
+        _size_memo_put(path, object_size);
+        shm_ring_end_read(payload);
+
+        shm_pool_release(seg->pool, seg);
+
+        int objfd = _open_object(object_name, path, object_size);
+        if (objfd < 0) {
+            fprintf(stderr, "[PROXY] failed to open %s for %s\n", object_name, path);
+            return gfs_sendheader(ctx, GF_ERROR, 0);
+        }
+        // 内核直接从对象的页发到 socket, 不经过用户态
+        ssize_t sent = -1;
+        if (gfs_sendheader(ctx, GF_OK, object_size) >= 0) {
+            sent = gfs_sendfile(ctx, objfd, 0, object_size);
+        }
+        if (l1cache_admits(object_size) && (fill = l1cache_new(path, object_size)) != NULL) {
+            if (pread(objfd, fill->data, object_size, 0) == (ssize_t)object_size) {
+                l1cache_insert(fill, l1_generation);
+            } else {
+                l1cache_discard(fill);
+            }
+        }
+        close(objfd);
+        return (sent == (ssize_t)object_size) ? sent : SERVER_FAILURE;
+    }
+
+    if (slot->datalen == 0) {
+        size_t fill_limit = payload->fill_limit;
+        fprintf(stderr, "[PROXY] cache miss or empty file: %s\n", path);
+        _size_memo_put(path, 0); // 再来也只需要最小的段
+        shm_ring_end_read(payload);
+        if (args->curl == NULL) goto error;
+
+        // 回源期间不占着段
+        shm_pool_release(seg->pool, seg);
+        return _read_through(ctx, path, args, fill_limit);
+    }
+
+    size_t max_chunk_size = payload->slot_size - sizeof(shm_slot_t);
     size_t total_file_size = payload->total_file_size;
+    _size_memo_put(path, total_file_size);
     if (gfs_sendheader(ctx, GF_OK, total_file_size) < 0) {
         fprintf(stderr, "[PROXY] failed to send header for %s\n", path);
-        goto error;
+        goto drain;
     }
-    fprintf(stderr, "[PROXY] sent GF_OK header for %s\n", path);
 
     ssize_t total_sent = 0;
+    if (l1cache_admits(total_file_size)) fill = l1cache_new(path, total_file_size);
 
-
+    // cache 在另一端继续填后面的槽, 这里边读边发
     while (1) {
-        printf("[PROXY] got chunk: %zu bytes, last=%d for path=%s\n", payload->datalen, payload->is_last_chunk, path);
-        
-        if (payload->datalen > segsize - sizeof(*payload)) {
-            fprintf(stderr, "[PROXY] chunk length overflow: %zu\n", payload->datalen);
-            goto error;
+        if (slot->datalen > max_chunk_size) {
+            fprintf(stderr, "[PROXY] chunk length overflow: %zu\n", slot->datalen);
+            goto drain;
         }
 
-        printf("[PROXY] sending chunk: %zu bytes, last=%d\n", payload->datalen, payload->is_last_chunk);
-        ssize_t sent = gfs_send(ctx, payload->data, payload->datalen);
+        if (fill != NULL && (size_t)total_sent + slot->datalen <= fill->size) {
+            memcpy(fill->data + total_sent, slot->data, slot->datalen);
+        }
+        ssize_t sent = gfs_send(ctx, slot->data, slot->datalen);
         if (sent < 0) {
             perror("[PROXY] gfs_send failed");
-            goto error;
+            goto drain;
         }
         total_sent += sent;
 
-        sem_post(&payload->sem_cache_ready);
-
-        if (payload->is_last_chunk) {
-            fprintf(stderr, "[PROXY] finished sending all data for %s\n", path);
-            break;
-        }
+        int last = slot->is_last_chunk;
+        shm_ring_end_read(payload);
+        if (last) break;
 
-        if (sem_wait(&payload->sem_proxy_ready) < 0) {
-            perror("sem_wait");
-            goto error;
+        if ((slot = _next_chunk(args, payload, epoch)) == NULL) {
+            fprintf(stderr, "[PROXY] cache stopped in the middle of %s\n", path);
+            _release_dirty(seg);
+            if (fill != NULL) l1cache_discard(fill);
+            return SERVER_FAILURE;
         }
     }
 
-    pthread_mutex_lock(lock);
-    steque_enqueue(pool, seg);
-    pthread_mutex_unlock(lock);
+    shm_pool_release(seg->pool, seg);
 
+    if ((size_t)total_sent != total_file_size) {
+        fprintf(stderr, "[PROXY] short transfer for %s: %zd of %zu\n", path, total_sent, total_file_size);
+        if (fill != NULL) l1cache_discard(fill);
+        return SERVER_FAILURE;
+    }
+    if (fill != NULL) l1cache_insert(fill, l1_generation);
     return total_sent;
 
+drain:
+    // header 已经发出去了; 把这次传输剩下的槽读完, 段才能安全地还回池子
+    while (!slot->is_last_chunk) {
+        shm_ring_end_read(payload);
+        if ((slot = _next_chunk(args, payload, epoch)) == NULL) {
+            _release_dirty(seg);
+            if (fill != NULL) l1cache_discard(fill);
+            return SERVER_FAILURE;
+        }
+    }
+    shm_ring_end_read(payload);
+
+    shm_pool_release(seg->pool, seg);
+    if (fill != NULL) l1cache_discard(fill);
+    return SERVER_FAILURE;
+
 error:
-    pthread_mutex_lock(lock);
-    steque_enqueue(pool, seg);
-    pthread_mutex_unlock(lock);
+    shm_pool_release(seg->pool, seg);
     return gfs_sendheader(ctx, GF_ERROR, 0);
 }
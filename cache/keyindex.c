@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "keyindex.h"
+
+#define KEYINDEX_MIN_SLOTS 16
+
+uint64_t keyindex_hash(const char *key){
+	uint64_t h = 14695981039346656037ULL;	/* FNV-1a */
+	while (*key)
+		h = (h ^ (unsigned char) *key++) * 1099511628211ULL;
+	/* 再混一下高位, 让低位 (用来取槽) 也受整个 key 影响 */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h ? h : 1;	/* 0 留给空槽 */
+}
+
+static void _place(keyindex_slot_t *slots, size_t mask, keyindex_slot_t slot){
+	size_t i = slot.hash & mask;
+	while (slots[i].hash != 0)
+		i = (i + 1) & mask;
+	slots[i] = slot;
+}
+
+/* 装载因子保持在 1/2 以下; 槽里存着哈希, 扩容不用重新算 */
+static void _grow(keyindex_t *index){
+	size_t nslots = (index->mask + 1) * 2;
+	keyindex_slot_t *slots = calloc(nslots, sizeof(keyindex_slot_t));
+	size_t i;
+
+	for (i = 0; i <= index->mask; i++)
+		if (index->slots[i].hash != 0)
+			_place(slots, nslots - 1, index->slots[i]);
+
+	free(index->slots);
+	index->slots = slots;
+	index->mask = nslots - 1;
+}
+
+void keyindex_init(keyindex_t *index, size_t expected){
+	size_t nslots = KEYINDEX_MIN_SLOTS;
+	while (nslots < expected * 2)
+		nslots *= 2;
+
+	index->slots = calloc(nslots, sizeof(keyindex_slot_t));
+	index->mask = nslots - 1;
+	index->count = 0;
+	index->arena_cap = expected * 32 + 64;
+	index->arena = malloc(index->arena_cap);
+	index->arena_len = 0;
+}
+
+int keyindex_insert(keyindex_t *index, const char *key, uint32_t id){
+	return keyindex_insert_hashed(index, key, keyindex_hash(key), id);
+}
+
+int keyindex_insert_hashed(keyindex_t *index, const char *key, uint64_t h, uint32_t id){
+	size_t keylen = strlen(key) + 1;
+	size_t i;
+
+	for (i = h & index->mask; index->slots[i].hash != 0; i = (i + 1) & index->mask)
+		if (index->slots[i].hash == h && 0 == strcmp(index->arena + index->slots[i].key_off, key))
+			return 1;
+
+	if (index->arena_len + keylen > UINT32_MAX)
+		return -1;
+	if (index->arena_len + keylen > index->arena_cap){
+		while (index->arena_len + keylen > index->arena_cap)
+			index->arena_cap *= 2;
+		index->arena = realloc(index->arena, index->arena_cap);
+	}
+
+	keyindex_slot_t slot;
+	slot.hash = h;
+	slot.key_off = (uint32_t) index->arena_len;
+	slot.id = id;
+	memcpy(index->arena + index->arena_len, key, keylen);
+	index->arena_len += keylen;
+
+	if ((index->count + 1) * 2 > index->mask + 1)
+		_grow(index);
+	_place(index->slots, index->mask, slot);
+	index->count++;
+	return 0;
+}
+
+int64_t keyindex_find(const keyindex_t *index, const char *key){
+	uint64_t h = keyindex_hash(key);
+	size_t i;
+
+	for (i = h & index->mask; index->slots[i].hash != 0; i = (i + 1) & index->mask)
+		if (index->slots[i].hash == h && 0 == strcmp(index->arena + index->slots[i].key_off, key))
+			return index->slots[i].id;
+	return -1;
+}
+
+void keyindex_destroy(keyindex_t *index){
+	free(index->slots);
+	free(index->arena);
+	index->slots = NULL;
+	index->arena = NULL;
+	index->count = 0;
+}
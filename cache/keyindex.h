@@ -0,0 +1,52 @@
+#ifndef __KEYINDEX_H__
+#define __KEYINDEX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Open-addressing hash index from string keys to 32-bit ids.  Keys are
+ * interned in one arena and each slot keeps the full 64-bit hash, so a
+ * lookup normally touches one slot line plus the matching key.
+ */
+
+typedef struct {
+	uint64_t hash;		/* 0 = empty slot */
+	uint32_t key_off;	/* key offset in the arena */
+	uint32_t id;
+} keyindex_slot_t;
+
+typedef struct {
+	keyindex_slot_t *slots;
+	size_t mask;		/* number of slots - 1, always a power of two minus one */
+	size_t count;
+	char *arena;
+	size_t arena_len;
+	size_t arena_cap;
+} keyindex_t;
+
+/* Initializes an empty index sized for about expected keys. */
+void keyindex_init(keyindex_t *index, size_t expected);
+
+/*
+ * Adds key with the given id.  Returns 0 if the key was added, 1 if it
+ * was already present (the existing id is kept), and -1 if the arena is
+ * full.
+ */
+int keyindex_insert(keyindex_t *index, const char *key, uint32_t id);
+
+/*
+ * The hash keyindex uses for key.  Callers building a large index can
+ * compute hashes in parallel and add keys with keyindex_insert_hashed.
+ */
+uint64_t keyindex_hash(const char *key);
+
+int keyindex_insert_hashed(keyindex_t *index, const char *key, uint64_t hash, uint32_t id);
+
+/* Returns the id stored for key, or -1 if the key is not present. */
+int64_t keyindex_find(const keyindex_t *index, const char *key);
+
+/* Frees the slots and the key arena. */
+void keyindex_destroy(keyindex_t *index);
+
+#endif // __KEYINDEX_H__
@@ -0,0 +1,214 @@
+#include "l1cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define L1_SHARDS 16
+#define L1_BUCKETS 256 // 每片的桶数, 2 的幂
+
+// 每片单独一条缓存行开头, 不同片的锁互不干扰
+typedef struct {
+    pthread_mutex_t lock;
+    l1cache_entry_t *buckets[L1_BUCKETS];
+    l1cache_entry_t *lru_head, *lru_tail; // head = 最近用过
+    size_t used;
+    uint64_t generation;  // 片里有 key 被作废一次加一
+    unsigned long hits, misses, inserts, evictions, invalidations, stale;
+} __attribute__((aligned(64))) l1cache_shard_t;
+
+static l1cache_shard_t shards[L1_SHARDS];
+static size_t shard_budget; // 0 = 没开
+static size_t max_object;
+
+static uint64_t _key_hash(const char *key) {
+    uint64_t h = 14695981039346656037ull;
+    while (*key) h = (h ^ (unsigned char)*key++) * 1099511628211ull;
+    h ^= h >> 33; // 高位选片, 低位选桶, 都要打散
+    return h;
+}
+
+static l1cache_shard_t* _shard(uint64_t hash) {
+    return &shards[hash >> 60];
+}
+
+static l1cache_entry_t** _bucket(l1cache_shard_t *shard, uint64_t hash) {
+    return &shard->buckets[hash & (L1_BUCKETS - 1)];
+}
+
+static void _lru_unlink(l1cache_shard_t *shard, l1cache_entry_t *e) {
+    if (e->prev) e->prev->next = e->next;
+    else shard->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else shard->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void _lru_push(l1cache_shard_t *shard, l1cache_entry_t *e) {
+    e->prev = NULL;
+    e->next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->prev = e;
+    else shard->lru_tail = e;
+    shard->lru_head = e;
+}
+
+// 从片里摘掉并放掉表的引用; 持有片锁
+static void _remove(l1cache_shard_t *shard, l1cache_entry_t *e) {
+    for (l1cache_entry_t **link = _bucket(shard, e->hash); *link != NULL; link = &(*link)->chain) {
+        if (*link == e) {
+            *link = e->chain;
+            break;
+        }
+    }
+    _lru_unlink(shard, e);
+    shard->used -= e->size;
+    l1cache_release(e);
+}
+
+static l1cache_entry_t* _find(l1cache_shard_t *shard, uint64_t hash, const char *key) {
+    for (l1cache_entry_t *e = *_bucket(shard, hash); e != NULL; e = e->chain) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) return e;
+    }
+    return NULL;
+}
+
+void l1cache_init(size_t budget, size_t max) {
+    for (int s = 0; s < L1_SHARDS; s++) {
+        pthread_mutex_init(&shards[s].lock, NULL);
+    }
+    shard_budget = budget / L1_SHARDS;
+    max_object = max < shard_budget ? max : shard_budget;
+}
+
+l1cache_entry_t* l1cache_get(const char *key) {
+    if (shard_budget == 0) return NULL;
+
+    uint64_t hash = _key_hash(key);
+    l1cache_shard_t *shard = _shard(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    l1cache_entry_t *e = _find(shard, hash, key);
+    if (e != NULL) {
+        __sync_add_and_fetch(&e->refs, 1);
+        if (shard->lru_head != e) {
+            _lru_unlink(shard, e);
+            _lru_push(shard, e);
+        }
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return e;
+}
+
+// 不用拿锁: 表里的条目至少有表自己的一个引用, 只有摘掉之后才可能减到 0
+void l1cache_release(l1cache_entry_t *entry) {
+    if (__sync_sub_and_fetch(&entry->refs, 1) == 0) free(entry);
+}
+
+uint64_t l1cache_generation(const char *key) {
+    if (shard_budget == 0) return 0;
+    return __atomic_load_n(&_shard(_key_hash(key))->generation, __ATOMIC_ACQUIRE);
+}
+
+int l1cache_admits(size_t size) {
+    return size > 0 && size <= max_object;
+}
+
+l1cache_entry_t* l1cache_new(const char *key, size_t size) {
+    size_t keylen = strlen(key) + 1;
+    l1cache_entry_t *e = malloc(sizeof(l1cache_entry_t) + keylen + size);
+    if (e == NULL) return NULL;
+
+    memcpy(e->key, key, keylen);
+    e->hash = _key_hash(key);
+    e->size = size;
+    e->refs = 1;
+    e->chain = e->prev = e->next = NULL;
+    e->data = e->key + keylen;
+    return e;
+}
+
+void l1cache_discard(l1cache_entry_t *entry) {
+    free(entry);
+}
+
+void l1cache_insert(l1cache_entry_t *entry, uint64_t generation) {
+    l1cache_shard_t *shard = _shard(entry->hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // 取数据期间被作废过, 这份内容可能是旧的
+    if (shard->generation != generation || entry->size > max_object) {
+        shard->stale++;
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    // 两个 worker 同时没命中同一个 key, 留新的
+    l1cache_entry_t *old = _find(shard, entry->hash, entry->key);
+    if (old != NULL) _remove(shard, old);
+
+    while (shard->used + entry->size > shard_budget && shard->lru_tail != NULL) {
+        _remove(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+
+    l1cache_entry_t **bucket = _bucket(shard, entry->hash);
+    entry->chain = *bucket;
+    *bucket = entry;
+    _lru_push(shard, entry);
+    shard->used += entry->size;
+    shard->inserts++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void _invalidate_shard(l1cache_shard_t *shard, uint64_t hash, const char *key) {
+    pthread_mutex_lock(&shard->lock);
+    __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+    if (key == NULL) {
+        while (shard->lru_head != NULL) {
+            _remove(shard, shard->lru_head);
+            shard->invalidations++;
+        }
+    } else {
+        l1cache_entry_t *e = _find(shard, hash, key);
+        if (e != NULL) {
+            _remove(shard, e);
+            shard->invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void l1cache_invalidate(const char *key) {
+    if (shard_budget == 0) return;
+
+    if (key[0] == '\0') {
+        for (int s = 0; s < L1_SHARDS; s++) _invalidate_shard(&shards[s], 0, NULL);
+        return;
+    }
+    uint64_t hash = _key_hash(key);
+    _invalidate_shard(_shard(hash), hash, key);
+}
+
+void l1cache_print_stats(FILE *out) {
+    unsigned long hits = 0, misses = 0, inserts = 0, evictions = 0, invalidations = 0, stale = 0;
+    size_t used = 0;
+
+    if (shard_budget == 0) return;
+    for (int s = 0; s < L1_SHARDS; s++) {
+        pthread_mutex_lock(&shards[s].lock);
+        hits += shards[s].hits;
+        misses += shards[s].misses;
+        inserts += shards[s].inserts;
+        evictions += shards[s].evictions;
+        invalidations += shards[s].invalidations;
+        stale += shards[s].stale;
+        used += shards[s].used;
+        pthread_mutex_unlock(&shards[s].lock);
+    }
+    fprintf(out, "[L1] budget=%zu used=%zu max_object=%zu hits=%lu misses=%lu inserts=%lu evictions=%lu invalidations=%lu stale=%lu\n",
+            shard_budget * L1_SHARDS, used, max_object, hits, misses, inserts, evictions, invalidations, stale);
+}
@@ -0,0 +1,45 @@
+#ifndef __L1CACHE_H__
+#define __L1CACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define L1_DEFAULT_BUDGET (4UL << 20)
+#define L1_DEFAULT_MAX_OBJECT (16UL << 10)
+
+// proxy 进程里的小对象缓存: 按 key 哈希分片, 每片一把锁, 片内 LRU 按字节预算淘汰
+typedef struct l1cache_entry_t {
+    uint64_t hash;
+    size_t size;
+    int refs;                     // 表本身算一个引用, 最后一个引用负责释放
+    struct l1cache_entry_t *chain; // 桶里的下一个
+    struct l1cache_entry_t *prev, *next; // 片内 LRU, prev 方向更新
+    char *data;                   // size 字节, 紧跟在 key 后面
+    char key[];
+} l1cache_entry_t;
+
+// budget = 0 关掉 L1; 只缓存不超过 max_object 字节的对象. 启动 worker 之前调用
+void l1cache_init(size_t budget, size_t max_object);
+
+// 命中返回带引用的条目, 发完交给 l1cache_release; 没命中或者没开返回 NULL
+l1cache_entry_t* l1cache_get(const char *key);
+void l1cache_release(l1cache_entry_t *entry);
+
+// 向 cache 发请求之前先拿这个代号; 期间 key 被作废过, 插入时就会被丢掉
+uint64_t l1cache_generation(const char *key);
+
+// 这么大的对象要不要放进 L1
+int l1cache_admits(size_t size);
+
+// 新条目, 调用者把 size 字节填进 entry->data, 再 insert 或者 discard
+l1cache_entry_t* l1cache_new(const char *key, size_t size);
+void l1cache_insert(l1cache_entry_t *entry, uint64_t generation);
+void l1cache_discard(l1cache_entry_t *entry);
+
+// 丢掉 key 的副本; key 为空串时全部丢掉 (cache 的作废通知走这里)
+void l1cache_invalidate(const char *key);
+
+void l1cache_print_stats(FILE *out);
+
+#endif // __L1CACHE_H__
@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/prctl.h>
+
+/*
+ * Getfile load generator.  Closed loop by default: each of -t threads
+ * sends its next request as soon as the last one finished.  With -r the
+ * requests follow a fixed arrival schedule instead (open loop), and with
+ * -T they follow the timestamps of a recorded trace.  Latencies go into
+ * a log-linear histogram with 3 significant digits.  The corrected row
+ * measures each request from when it should have been sent, so a stall
+ * is charged to every request it held back; in closed loop that is
+ * estimated from the expected interval between requests.
+ */
+
+#ifndef DEFAULT_PORT
+#define DEFAULT_PORT 25462
+#endif
+#define _STR(x) #x
+#define STR(x) _STR(x)
+
+#define MAX_THREADS 1000
+#define MAX_KEYLEN 1024
+#define RECV_TIMEOUT 30             // seconds without data before a request counts as an error
+#define HIST_SUB_BITS 10
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_US (1ULL << 36)    // about 19 hours; longer latencies are clamped
+#define HIST_SIZE ((36 - HIST_SUB_BITS + 2) * HIST_SUB)
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  loadgen [options]\n"                                                       \
+"options:\n"                                                                  \
+"  -s [server_addr]    Server address (Default: 127.0.0.1)\n"                 \
+"  -p [server_port]    Server port (Default: " STR(DEFAULT_PORT) ")\n"        \
+"  -t [thread_count]   Concurrent requests (Default: 8, Range: 1-" STR(MAX_THREADS) ")\n" \
+"  -n [requests]       Total requests (Default: 1000, or the length of the trace)\n" \
+"  -d [seconds]        Run for this long instead of a request count\n"        \
+"  -r [rate]           Open loop: requests per second across all threads (Default: 0 = closed loop)\n" \
+"  -w [workload_path]  Keys to request, one per line (Default: workload.txt)\n" \
+"  -k [mode]           Key selection: sequential, uniform or zipf (Default: sequential)\n" \
+"  -a [exponent]       Zipf exponent, the first key in the workload being the hottest (Default: 0.99)\n" \
+"  -T [trace]          Replay \"<seconds> <path>\" lines at their recorded times instead of -w/-k/-r\n" \
+"  -x [speedup]        Replay the trace this many times faster (Default: 1)\n"  \
+"  -e [microseconds]   Closed loop: expected interval for the correction (Default: mean latency)\n" \
+"  -S [seed]           Random seed, for repeatable key sequences (Default: 1)\n" \
+"  -P                  Print the full percentile distribution\n"              \
+"  -h                  Show this help message\n"
+
+static struct option gLongOptions[] = {
+  {"server",       required_argument,      NULL,           's'},
+  {"port",         required_argument,      NULL,           'p'},
+  {"threads",      required_argument,      NULL,           't'},
+  {"requests",     required_argument,      NULL,           'n'},
+  {"duration",     required_argument,      NULL,           'd'},
+  {"rate",         required_argument,      NULL,           'r'},
+  {"workload",     required_argument,      NULL,           'w'},
+  {"keys",         required_argument,      NULL,           'k'},
+  {"alpha",        required_argument,      NULL,           'a'},
+  {"trace",        required_argument,      NULL,           'T'},
+  {"speedup",      required_argument,      NULL,           'x'},
+  {"interval",     required_argument,      NULL,           'e'},
+  {"seed",         required_argument,      NULL,           'S'},
+  {"percentiles",  no_argument,            NULL,           'P'},
+  {"help",         no_argument,            NULL,           'h'},
+  {NULL,           0,                      NULL,             0}
+};
+
+typedef enum { KEYS_SEQUENTIAL, KEYS_UNIFORM, KEYS_ZIPF, KEYS_TRACE } key_mode_t;
+
+typedef struct {
+  uint64_t counts[HIST_SIZE];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+} hist_t;
+
+typedef struct {
+  int index;
+  uint64_t rng;
+} worker_t;
+
+static struct addrinfo *server;
+static int nthreads = 8;
+static long nrequests = -1;
+static double duration, rate, speedup = 1, expected_us;
+static key_mode_t key_mode = KEYS_SEQUENTIAL;
+
+static char **keys;
+static long nkeys;
+static double *zipf_cdf;
+static double *trace_times;         // seconds after the first trace line
+
+static uint64_t start_ns;
+static long next_request;           // closed loop: the next request a thread may claim
+static hist_t service, corrected;   // shared; a request is slow enough that the atomics do not matter
+static unsigned long nok, nnotfound, nerror, nlate;
+static unsigned long long nbytes;
+
+static uint64_t _now_ns(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64*; each thread has its own state so runs repeat for a given seed
+static uint64_t _rand(uint64_t *state){
+  uint64_t x = *state;
+
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+/* Histogram ==================================================== */
+
+// Values below 2 * HIST_SUB are exact; above, each power of two gets HIST_SUB buckets
+static int _hist_index(uint64_t v){
+  int e;
+
+  if (v >= HIST_MAX_US)
+    v = HIST_MAX_US - 1;
+  if (v < 2 * HIST_SUB)
+    return (int) v;
+  e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+  return e * HIST_SUB + (int) (v >> e);
+}
+
+// The largest value that lands in bucket index
+static uint64_t _hist_value(int index){
+  int e;
+
+  if (index < 2 * HIST_SUB)
+    return index;
+  e = index / HIST_SUB - 1;
+  return ((uint64_t) (index - e * HIST_SUB) << e) + ((1ULL << e) - 1);
+}
+
+static void _hist_add(hist_t *h, uint64_t v, uint64_t count){
+  uint64_t max;
+
+  __sync_fetch_and_add(&h->counts[_hist_index(v)], count);
+  __sync_fetch_and_add(&h->total, count);
+  __sync_fetch_and_add(&h->sum, v * count);
+  while (v > (max = h->max) && !__sync_bool_compare_and_swap(&h->max, max, v))
+    ;
+}
+
+static uint64_t _hist_percentile(const hist_t *h, double p){
+  uint64_t want = (uint64_t) ceil(p / 100 * h->total), seen = 0;
+  int i;
+
+  if (want == 0)
+    want = 1;
+  for (i = 0; i < HIST_SIZE; i++){
+    seen += h->counts[i];
+    if (seen >= want)
+      return _hist_value(i) < h->max ? _hist_value(i) : h->max;
+  }
+  return h->max;
+}
+
+// What a closed loop would have seen had it kept sending every interval while a request stalled
+static void _hist_correct(hist_t *dst, const hist_t *src, uint64_t interval){
+  uint64_t v, missed;
+  int i;
+
+  memcpy(dst, src, sizeof(hist_t));
+  if (interval == 0)
+    return;
+  for (i = 0; i < HIST_SIZE; i++){
+    if (src->counts[i] == 0)
+      continue;
+    v = i == _hist_index(src->max) ? src->max : _hist_value(i);
+    for (missed = v - interval; v > interval && missed >= interval; missed -= interval)
+      _hist_add(dst, missed, src->counts[i]);
+  }
+}
+
+static void _hist_print(const char *name, const hist_t *h){
+  printf("  %-10s %9lu %9lu %9lu %9lu %9lu %9lu %11.1f\n", name,
+         (unsigned long) _hist_percentile(h, 50), (unsigned long) _hist_percentile(h, 90),
+         (unsigned long) _hist_percentile(h, 99), (unsigned long) _hist_percentile(h, 99.9),
+         (unsigned long) _hist_percentile(h, 99.99), (unsigned long) h->max,
+         h->total ? (double) h->sum / h->total : 0.0);
+}
+
+static void _hist_print_distribution(const char *name, const hist_t *h){
+  static const double points[] = { 0, 10, 20, 30, 40, 50, 55, 60, 65, 70, 75, 80, 85, 90, 92.5, 95,
+                                   96.25, 97.5, 98.4375, 99, 99.5, 99.75, 99.9, 99.95, 99.99, 99.999, 100 };
+  size_t i;
+
+  printf("%s latency distribution (us):\n", name);
+  for (i = 0; i < sizeof(points) / sizeof(points[0]); i++)
+    printf("  %9.4f%% %12lu\n", points[i], (unsigned long) _hist_percentile(h, points[i]));
+}
+
+/* Keys ========================================================= */
+
+static void _add_key(const char *key){
+  if ((nkeys & (nkeys - 1)) == 0){
+    keys = realloc(keys, (nkeys ? nkeys * 2 : 1) * sizeof(char *));
+    if (key_mode == KEYS_TRACE)
+      trace_times = realloc(trace_times, (nkeys ? nkeys * 2 : 1) * sizeof(double));
+  }
+  keys[nkeys++] = strdup(key);
+}
+
+static void _load_workload(const char *filename){
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  FILE *in;
+
+  if (NULL == (in = fopen(filename, "r"))){
+    fprintf(stderr, "Unable to open workload file %s\n", filename);
+    exit(__LINE__);
+  }
+  while (0 < (len = getline(&line, &linecap, in))){
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len > 0 && len < MAX_KEYLEN)
+      _add_key(line);
+  }
+  free(line);
+  fclose(in);
+}
+
+// Lines of "<seconds> <path>"; the first timestamp is time zero
+static void _load_trace(const char *filename){
+  char *line = NULL, *ptr, *tok, *key, *end;
+  size_t linecap = 0;
+  double t = 0, first = 0;
+  int have_time;
+  FILE *in;
+
+  if (NULL == (in = fopen(filename, "r"))){
+    fprintf(stderr, "Unable to open trace %s\n", filename);
+    exit(__LINE__);
+  }
+  while (0 < getline(&line, &linecap, in)){
+    key = NULL;
+    have_time = 0;
+    ptr = line;
+    while (NULL != (tok = strsep(&ptr, " \t\r\n"))){
+      if (NULL == key && '/' == tok[0])
+        key = tok;
+      else if (!have_time && '\0' != tok[0] && (t = strtod(tok, &end), '\0' == *end))
+        have_time = 1;
+    }
+    if (NULL == key || !have_time || strlen(key) >= MAX_KEYLEN)
+      continue;
+    if (nkeys == 0)
+      first = t;
+    _add_key(key);
+    trace_times[nkeys - 1] = t - first < 0 ? 0 : t - first;
+  }
+  free(line);
+  fclose(in);
+}
+
+// Rank i (0 = first line of the workload) is requested in proportion to 1 / (i + 1)^alpha
+static void _build_zipf(double alpha){
+  double sum = 0;
+  long i;
+
+  zipf_cdf = malloc(nkeys * sizeof(double));
+  for (i = 0; i < nkeys; i++)
+    sum += 1.0 / pow(i + 1, alpha);
+  for (i = 0; i < nkeys; i++)
+    zipf_cdf[i] = (i ? zipf_cdf[i - 1] : 0) + 1.0 / pow(i + 1, alpha) / sum;
+  zipf_cdf[nkeys - 1] = 1.0;
+}
+
+static const char *_pick_key(worker_t *w, long request){
+  double u;
+  long lo, hi, mid;
+
+  switch (key_mode){
+    case KEYS_UNIFORM:
+      return keys[_rand(&w->rng) % nkeys];
+    case KEYS_ZIPF:
+      u = (_rand(&w->rng) >> 11) * (1.0 / 9007199254740992.0);
+      lo = 0;
+      hi = nkeys - 1;
+      while (lo < hi){
+        mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+      }
+      return keys[lo];
+    default:
+      return keys[request % nkeys];
+  }
+}
+
+/* Requests ===================================================== */
+
+typedef enum { RESULT_OK, RESULT_NOT_FOUND, RESULT_ERROR } result_t;
+
+// One request on a fresh connection; the server closes after each response
+static result_t _request(const char *key, char *buf, size_t bufsize, size_t *body){
+  struct timeval tv = { RECV_TIMEOUT, 0 };
+  size_t have = 0, want = 0;
+  char *space, *end;
+  int fd, len;
+  ssize_t n;
+
+  *body = 0;
+  if (0 > (fd = socket(server->ai_family, SOCK_STREAM, 0)))
+    return RESULT_ERROR;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  len = snprintf(buf, bufsize, "GETFILE GET %s\r\n\r\n", key);
+  if (0 > connect(fd, server->ai_addr, server->ai_addrlen) || len != send(fd, buf, len, MSG_NOSIGNAL))
+    goto error;
+
+  // "GETFILE OK <len> " is followed by the body; the other statuses end in a newline
+  for (;;){
+    if (0 >= (n = recv(fd, buf + have, bufsize - 1 - have, 0)))
+      goto error;
+    have += n;
+    buf[have] = '\0';
+    if (0 == strncmp(buf, "GETFILE OK ", have < 11 ? have : 11) && have > 11 &&
+        NULL != (space = strchr(buf + 11, ' '))){
+      want = strtoul(buf + 11, &end, 10);
+      if (end != space)
+        goto error;
+      *body = have - (space + 1 - buf);
+      break;
+    }
+    if (NULL != strchr(buf, '\n')){
+      close(fd);
+      return 0 == strncmp(buf, "GETFILE FILE_NOT_FOUND", 22) ? RESULT_NOT_FOUND : RESULT_ERROR;
+    }
+    if (have == bufsize - 1)
+      goto error;
+  }
+
+  while (*body < want){
+    if (0 >= (n = recv(fd, buf, bufsize, 0)))
+      goto error;
+    *body += n;
+  }
+  close(fd);
+  return *body == want ? RESULT_OK : RESULT_ERROR;
+
+error:
+  close(fd);
+  return RESULT_ERROR;
+}
+
+// When request should be sent, relative to start; -1 once the run is over
+static double _schedule(long request){
+  if (nrequests >= 0 && request >= nrequests)
+    return -1;
+  if (key_mode == KEYS_TRACE){
+    if (request >= nkeys)
+      return -1;
+    return trace_times[request] / speedup;
+  }
+  if (duration > 0 && request / rate >= duration)
+    return -1;
+  return request / rate;
+}
+
+static void *_worker(void *arg){
+  worker_t *w = arg;
+  int open_loop = rate > 0 || key_mode == KEYS_TRACE;
+  char buf[65536];
+  long request, k;
+  uint64_t intended, sent, done;
+  struct timespec ts;
+  const char *key;
+  result_t result;
+  size_t body;
+  double at;
+
+  // The default 50us of timer slack would show up in every open-loop latency
+  prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+  for (k = 0;; k++){
+    if (open_loop){
+      // Open loop: thread i owns requests i, i + nthreads, ... and sends each at its time
+      request = w->index + k * nthreads;
+      if (0 > (at = _schedule(request)))
+        break;
+      intended = start_ns + (uint64_t) (at * 1e9);
+      sent = _now_ns();
+      if (sent < intended){
+        ts.tv_sec = (intended - sent) / 1000000000ULL;
+        ts.tv_nsec = (intended - sent) % 1000000000ULL;
+        while (0 > nanosleep(&ts, &ts) && errno == EINTR)
+          ;
+        sent = _now_ns();
+      } else if (sent - intended > 1000000){
+        __sync_fetch_and_add(&nlate, 1);
+      }
+    } else {
+      request = __sync_fetch_and_add(&next_request, 1);
+      if ((nrequests >= 0 && request >= nrequests) || (duration > 0 && _now_ns() - start_ns >= duration * 1e9))
+        break;
+      intended = sent = _now_ns();
+    }
+
+    key = key_mode == KEYS_TRACE ? keys[request] : _pick_key(w, request);
+    result = _request(key, buf, sizeof(buf), &body);
+    done = _now_ns();
+
+    __sync_fetch_and_add(&nbytes, (unsigned long long) body);
+    if (result == RESULT_ERROR){
+      __sync_fetch_and_add(&nerror, 1);
+      continue;
+    }
+    __sync_fetch_and_add(result == RESULT_OK ? &nok : &nnotfound, 1);
+    _hist_add(&service, (done - sent) / 1000, 1);
+    if (open_loop)
+      _hist_add(&corrected, (done - intended) / 1000, 1);
+  }
+  return NULL;
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+  char *hostname = "127.0.0.1", *workload = "workload.txt", *trace = NULL;
+  unsigned short port = DEFAULT_PORT;
+  uint64_t seed = 1, elapsed;
+  int option_char, i, print_all = 0;
+  double alpha = 0.99, seconds;
+  struct addrinfo hints;
+  char portstr[16];
+  pthread_t *threads;
+  worker_t *workers;
+
+  while ((option_char = getopt_long(argc, argv, "s:p:t:n:d:r:w:k:a:T:x:e:S:Ph", gLongOptions, NULL)) != -1) {
+    switch (option_char) {
+      case 's': // server
+        hostname = optarg;
+        break;
+      case 'p': // port
+        port = atoi(optarg);
+        break;
+      case 't': // thread count
+        nthreads = atoi(optarg);
+        break;
+      case 'n': // requests
+        nrequests = atol(optarg);
+        break;
+      case 'd': // duration
+        duration = atof(optarg);
+        break;
+      case 'r': // open loop rate
+        rate = atof(optarg);
+        break;
+      case 'w': // workload
+        workload = optarg;
+        break;
+      case 'k': // key selection
+        if (0 == strcmp(optarg, "sequential")) key_mode = KEYS_SEQUENTIAL;
+        else if (0 == strcmp(optarg, "uniform")) key_mode = KEYS_UNIFORM;
+        else if (0 == strcmp(optarg, "zipf")) key_mode = KEYS_ZIPF;
+        else {
+          fprintf(stderr, "Unknown key selection %s\n", optarg);
+          exit(__LINE__);
+        }
+        break;
+      case 'a': // zipf exponent
+        alpha = atof(optarg);
+        break;
+      case 'T': // trace
+        trace = optarg;
+        break;
+      case 'x': // trace speedup
+        speedup = atof(optarg);
+        break;
+      case 'e': // expected interval
+        expected_us = atof(optarg);
+        break;
+      case 'S': // seed
+        seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'P': // percentiles
+        print_all = 1;
+        break;
+      case 'h': // help
+        printf(USAGE);
+        exit(0);
+        break;
+      default:
+        fprintf(stderr, USAGE);
+        exit(__LINE__);
+    }
+  }
+
+  if (nthreads < 1 || nthreads > MAX_THREADS) {
+    fprintf(stderr, "Invalid number of threads, must be in between 1-%d\n", MAX_THREADS);
+    exit(__LINE__);
+  }
+  if (rate < 0 || duration < 0 || speedup <= 0 || expected_us < 0) {
+    fprintf(stderr, "Rate, duration, speedup and interval must be positive\n");
+    exit(__LINE__);
+  }
+  if (NULL != trace) {
+    key_mode = KEYS_TRACE;
+    _load_trace(trace);
+  } else {
+    _load_workload(workload);
+  }
+  if (nkeys == 0) {
+    fprintf(stderr, "No keys in %s\n", trace ? trace : workload);
+    exit(__LINE__);
+  }
+  if (key_mode == KEYS_ZIPF)
+    _build_zipf(alpha);
+  if (nrequests < 0 && duration == 0)
+    nrequests = key_mode == KEYS_TRACE ? nkeys : 1000;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(portstr, sizeof(portstr), "%u", port);
+  if (0 != (i = getaddrinfo(hostname, portstr, &hints, &server))) {
+    fprintf(stderr, "Unable to resolve %s: %s\n", hostname, gai_strerror(i));
+    exit(__LINE__);
+  }
+
+  threads = calloc(nthreads, sizeof(pthread_t));
+  workers = calloc(nthreads, sizeof(worker_t));
+  start_ns = _now_ns();
+  for (i = 0; i < nthreads; i++) {
+    workers[i].index = i;
+    workers[i].rng = (seed + i + 1) * 0x9E3779B97F4A7C15ULL;
+    if (0 != pthread_create(&threads[i], NULL, _worker, &workers[i])) {
+      fprintf(stderr, "Unable to start thread %d\n", i);
+      exit(__LINE__);
+    }
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  elapsed = _now_ns() - start_ns;
+  seconds = elapsed / 1e9;
+
+  printf("%s loop, %d threads, %s keys: %lu ok, %lu not found, %lu errors in %.2fs\n",
+         rate > 0 || key_mode == KEYS_TRACE ? "open" : "closed", nthreads,
+         key_mode == KEYS_TRACE ? "trace" : key_mode == KEYS_ZIPF ? "zipf" : key_mode == KEYS_UNIFORM ? "uniform" : "sequential",
+         nok, nnotfound, nerror, seconds);
+  printf("throughput: %.1f requests/s, %.2f MB/s\n", (nok + nnotfound) / seconds, nbytes / seconds / 1048576);
+  if (nlate > 0)
+    printf("%lu requests went out more than 1ms late; add threads if this is most of them\n", nlate);
+
+  if (rate == 0 && key_mode != KEYS_TRACE) {
+    // Closed loop: each thread would have sent a request every expected interval
+    _hist_correct(&corrected, &service, expected_us > 0 ? (uint64_t) expected_us :
+                  service.total ? service.sum / service.total : 0);
+  }
+  printf("latency (us)       p50       p90       p99     p99.9    p99.99       max        mean\n");
+  _hist_print("service", &service);
+  _hist_print("corrected", &corrected);
+  if (print_all) {
+    _hist_print_distribution("service", &service);
+    _hist_print_distribution("corrected", &corrected);
+  }
+
+  freeaddrinfo(server);
+  free(threads);
+  free(workers);
+  return 0;
+}
@@ -0,0 +1,178 @@
+#include "readthrough.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define READTHROUGH_BUFSIZE (64 * 1024) // curl 一次交给 write 回调的最大块
+
+// 一次回源的状态
+typedef struct {
+    CURL *curl;
+    gfcontext_t *ctx;
+    long length;         // 当前响应的 Content-Length, -1 = 没有
+    int redirect;        // 当前响应带 Location, curl 会跟过去
+    int started;         // 最终响应的头收完了
+    int rejected;        // 不是 200, body 丢掉
+    int streaming;       // 头已经发给客户端, body 边收边转
+    int client_failed;   // 客户端断了; 还要留副本的话接着收完
+    size_t sent;
+    size_t keep_limit;   // 0 = 不留副本
+    char *data;          // 副本; 不知道长度时整个 body 也先攒在这里
+    size_t size;
+    size_t cap;
+} readthrough_t;
+
+static int _append(readthrough_t *rt, const void *data, size_t len) {
+    if (rt->size + len > rt->cap) {
+        size_t cap = rt->cap ? rt->cap : READTHROUGH_BUFSIZE;
+        while (cap < rt->size + len) cap *= 2;
+        char *grown = realloc(rt->data, cap);
+        if (grown == NULL) return -1;
+        rt->data = grown;
+        rt->cap = cap;
+    }
+    memcpy(rt->data + rt->size, data, len);
+    rt->size += len;
+    return 0;
+}
+
+// 不再留副本
+static void _drop_copy(readthrough_t *rt) {
+    free(rt->data);
+    rt->data = NULL;
+    rt->size = rt->cap = 0;
+    rt->keep_limit = 0;
+}
+
+// 最终响应的头收完了: 有长度就先发头再边收边转, 没有就整个攒下来
+static void _begin_body(readthrough_t *rt) {
+    long http_code = 0;
+
+    rt->started = 1;
+    curl_easy_getinfo(rt->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 200) {
+        rt->rejected = 1;
+        return;
+    }
+    if (rt->length < 0) return;
+
+    // 副本按长度一次分配好; 太大的不留
+    if (rt->keep_limit > 0 && (rt->length == 0 || (size_t)rt->length > rt->keep_limit ||
+                               NULL == (rt->data = malloc(rt->length)))) {
+        rt->keep_limit = 0;
+    }
+    rt->cap = rt->data != NULL ? (size_t)rt->length : 0;
+
+    rt->streaming = 1;
+    if (gfs_sendheader(rt->ctx, GF_OK, rt->length) < 0) rt->client_failed = 1;
+}
+
+// 从响应头里取 Content-Length; 每个响应 (跳转, 100 Continue) 都从状态行开始重来
+static size_t _header_callback(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t total_size = size * nitems;
+    readthrough_t *rt = userp;
+    static const char content_length[] = "Content-Length:";
+
+    if (total_size >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        rt->length = -1;
+        rt->redirect = 0;
+    } else if (total_size >= 9 && strncasecmp(buffer, "Location:", 9) == 0) {
+        rt->redirect = 1;
+    } else if (total_size > sizeof(content_length) - 1 &&
+               strncasecmp(buffer, content_length, sizeof(content_length) - 1) == 0) {
+        char *end;
+        long length = strtol(buffer + sizeof(content_length) - 1, &end, 10);
+        if (end != buffer + sizeof(content_length) - 1 && length >= 0) rt->length = length;
+    } else if (!rt->started && (total_size == 2 || total_size == 1) && (buffer[0] == '\r' || buffer[0] == '\n')) {
+        // 空行: 这个响应的头完了; 中间响应和跳转的 body 不会交给我们
+        long http_code = 0;
+        curl_easy_getinfo(rt->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code >= 200 && !(http_code / 100 == 3 && rt->redirect)) _begin_body(rt);
+    }
+    return total_size;
+}
+
+static size_t _write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t total_size = size * nmemb;
+    readthrough_t *rt = userp;
+
+    if (!rt->started) _begin_body(rt);
+    if (rt->rejected) return total_size;
+
+    // 不知道长度: 全部攒起来, 收完再发
+    if (!rt->streaming) return _append(rt, contents, total_size) < 0 ? 0 : total_size;
+
+    if (rt->sent + total_size > (size_t)rt->length) return 0; // 比说好的长, 中止
+    if (rt->data != NULL) memcpy(rt->data + rt->sent, contents, total_size);
+    if (!rt->client_failed && gfs_send(rt->ctx, contents, total_size) < 0) {
+        rt->client_failed = 1;
+        if (rt->data == NULL) return 0; // 没人要了
+    }
+    rt->sent += total_size;
+    return total_size;
+}
+
+CURL* readthrough_handle(void) {
+    CURL *curl = curl_easy_init();
+    if (curl == NULL) return NULL;
+
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // 多线程, 不要 SIGALRM
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)READTHROUGH_BUFSIZE);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, _header_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _write_callback);
+    return curl;
+}
+
+ssize_t readthrough_fetch(CURL *curl, const char *url, gfcontext_t *ctx, size_t keep_limit,
+                          char **kept, size_t *kept_size) {
+    readthrough_t rt;
+    long http_code = 0;
+    CURLcode res;
+
+    memset(&rt, 0, sizeof(rt));
+    rt.curl = curl;
+    rt.ctx = ctx;
+    rt.length = -1;
+    rt.keep_limit = keep_limit;
+    *kept = NULL;
+    *kept_size = 0;
+
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&rt);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&rt);
+    res = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+
+    if (res != CURLE_OK || http_code != 200 || (rt.streaming && rt.sent != (size_t)rt.length)) {
+        fprintf(stderr, "[PROXY] origin fetch of %s failed: %s, HTTP %ld\n", url, curl_easy_strerror(res), http_code);
+        free(rt.data);
+        // 头已经发出去的话只能断开连接
+        if (rt.streaming) return SERVER_FAILURE;
+        return gfs_sendheader(ctx, http_code == 404 ? GF_FILE_NOT_FOUND : GF_ERROR, 0);
+    }
+
+    ssize_t total_sent;
+    if (rt.streaming) {
+        total_sent = rt.client_failed ? SERVER_FAILURE : (ssize_t)rt.sent;
+    } else {
+        // 没有 Content-Length (或者空 body, 回调一次都没来): 现在知道多长了
+        total_sent = -1;
+        if (gfs_sendheader(ctx, GF_OK, rt.size) >= 0 && (rt.size == 0 || gfs_send(ctx, rt.data, rt.size) == (ssize_t)rt.size)) {
+            total_sent = rt.size;
+        }
+        if (total_sent < 0) total_sent = SERVER_FAILURE;
+        if (rt.size == 0 || rt.size > rt.keep_limit) _drop_copy(&rt);
+    }
+
+    if (rt.keep_limit > 0 && rt.data != NULL) {
+        *kept = rt.data;
+        *kept_size = rt.streaming ? rt.sent : rt.size;
+    } else {
+        free(rt.data);
+    }
+    return total_sent;
+}
@@ -0,0 +1,19 @@
+#ifndef __READTHROUGH_H__
+#define __READTHROUGH_H__
+
+#include <stddef.h>
+#include <curl/curl.h>
+#include "gfserver.h"
+
+// cache miss 之后回源: 从源站取对象, 边收边发给客户端, 需要的话顺手留一份给 cache 回填
+
+// 建一个回源用的 curl handle, 一个 worker 一个, 连接在请求之间保持; 失败返回 NULL
+CURL* readthrough_handle(void);
+
+// 把 url 的内容发给 ctx, 返回 handler 该返回的值.
+// keep_limit > 0 时, 对象完整收到且不超过 keep_limit 字节的话 *kept 指向一份副本 (调用者 free),
+// 大小在 *kept_size; 否则 *kept = NULL. 客户端中途断开不影响留副本
+ssize_t readthrough_fetch(CURL *curl, const char *url, gfcontext_t *ctx, size_t keep_limit,
+                          char **kept, size_t *kept_size);
+
+#endif // __READTHROUGH_H__
@@ -0,0 +1,422 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "shm_channel.h"
+
+/*
+ * 不经过 socket 和 gfserver, 单独测 shm_channel.  子进程当 cache, 父进程当 proxy.
+ * 先测两个单槽段之间的 ping-pong 往返, 再对 -z/-n/-o/-t 的每个组合测整条传输路径:
+ * proxy 线程从池里拿段, 经这个段配套的请求段告诉 cache 要多大的对象, cache 的线程
+ * 按块写进 ring, proxy 读完再把段还回池.  报对象延迟, 吞吐和池的争用.
+ */
+
+#define MAX_LIST 16
+#define REQ_SEGSIZE 4096	/* 请求段只用一个槽的 datalen */
+#define MAX_SAMPLES (1 << 22)	/* 每个组合最多记这么多个对象的延迟 */
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  shm_bench [options]\n"                                                     \
+"options:\n"                                                                  \
+"  -z [bytes,...]      Segment sizes, K/M suffixes allowed (Default: 5712,64K,1M)\n"	\
+"  -n [count,...]      Segment counts (Default: 8)\n"	\
+"  -o [bytes,...]      Object sizes, K/M suffixes allowed (Default: 1K,100K,1M)\n"	\
+"  -t [threads,...]    Proxy threads taking segments from the pool (Default: 1,4,16)\n"	\
+"  -k [slots]          Slots per segment (Default: 4)\n"	\
+"  -b [doorbell]       Segment handoff: futex or sem (Default: futex)\n"	\
+"  -m [megabytes]      Data moved per combination (Default: 256)\n"	\
+"  -i [iterations]     Ping-pong round trips per doorbell, 0 = skip (Default: 100000)\n"	\
+"  -h                  Show this help message\n"
+
+static struct option gLongOptions[] = {
+  {"segment-size",  required_argument,      NULL,           'z'},
+  {"segment-count", required_argument,      NULL,           'n'},
+  {"object-size",   required_argument,      NULL,           'o'},
+  {"threads",       required_argument,      NULL,           't'},
+  {"slots",         required_argument,      NULL,           'k'},
+  {"doorbell",      required_argument,      NULL,           'b'},
+  {"megabytes",     required_argument,      NULL,           'm'},
+  {"iterations",    required_argument,      NULL,           'i'},
+  {"help",          no_argument,            NULL,           'h'},
+  {NULL,            0,                      NULL,             0}
+};
+
+/* 一个组合的参数和 proxy 线程共享的状态 */
+static shm_pool_t pool;
+static shm_segment_t **reqs;	/* 和数据段同下标的请求段 */
+static size_t object_size;
+static long nobjects, next_object;
+static double *samples;	/* 每个对象从拿段到读完最后一块的纳秒数 */
+static double acquire_ns;	/* 所有 shm_pool_acquire 花的时间, 含排队 */
+static pthread_mutex_t acquire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double _now_ns(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t _parse_size(const char *s){
+	char *end;
+	size_t size = strtoul(s, &end, 10);
+
+	if (*end == 'K' || *end == 'k') size <<= 10;
+	else if (*end == 'M' || *end == 'm') size <<= 20;
+	return size;
+}
+
+static int _parse_list(char *list, size_t *values){
+	char *tok;
+	int n = 0;
+
+	while (NULL != (tok = strsep(&list, ",")) && n < MAX_LIST)
+		if (0 < (values[n] = _parse_size(tok)))
+			n++;
+	return n;
+}
+
+static int _cmp_double(const void *a, const void *b){
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* 段名是 "<prefix>_<i>", 下标就在最后一个 '_' 后面 */
+static int _seg_index(shm_segment_t *seg){
+	return atoi(strrchr(seg->shm_name, '_') + 1);
+}
+
+static void _send_size(shm_payload_t *ring, size_t size){
+	shm_slot_t *slot = shm_ring_begin_write(ring);
+
+	slot->datalen = size;
+	slot->is_last_chunk = 1;
+	shm_ring_commit_write(ring);
+}
+
+static size_t _recv_size(shm_payload_t *ring){
+	shm_slot_t *slot = shm_ring_begin_read(ring);
+	size_t size = slot->datalen;
+
+	shm_ring_end_read(ring);
+	return size;
+}
+
+/* Ping-pong ===================================================== */
+
+/* 两个单槽段, 一个 proxy -> cache, 一个 cache -> proxy; 每次往返两次交接 */
+static void _pingpong(int notify, unsigned int iterations){
+	shm_segment_t ping, pong, cping, cpong;
+	char ping_name[SHM_NAME_LEN], pong_name[SHM_NAME_LEN];
+	double *rtt, start, total = 0;
+	unsigned int i;
+	pid_t pid;
+
+	snprintf(ping_name, sizeof(ping_name), "/shm_bench_%d_ping", (int) getpid());
+	snprintf(pong_name, sizeof(pong_name), "/shm_bench_%d_pong", (int) getpid());
+	shm_channel_set_notify(notify);
+	if (0 > shm_segment_create(&ping, ping_name, REQ_SEGSIZE, 1) ||
+	    0 > shm_segment_create(&pong, pong_name, REQ_SEGSIZE, 1)){
+		fprintf(stderr, "Failed to create the ping-pong segments\n");
+		exit(__LINE__);
+	}
+
+	if (0 > (pid = fork())){
+		perror("fork");
+		exit(__LINE__);
+	}
+	if (pid == 0){
+		/* cache 那边按名字重新 attach, 和真实部署一样是另一份映射 */
+		if (0 > shm_segment_attach(&cping, ping_name, REQ_SEGSIZE) ||
+		    0 > shm_segment_attach(&cpong, pong_name, REQ_SEGSIZE))
+			_exit(1);
+		for (i = 0; i < iterations; i++)
+			_send_size(cpong.addr, _recv_size(cping.addr));
+		_exit(0);
+	}
+
+	rtt = malloc(iterations * sizeof(double));
+	for (i = 0; i < iterations; i++){
+		start = _now_ns();
+		_send_size(ping.addr, i + 1);
+		_recv_size(pong.addr);
+		rtt[i] = _now_ns() - start;
+		total += rtt[i];
+	}
+	waitpid(pid, NULL, 0);
+
+	qsort(rtt, iterations, sizeof(double), _cmp_double);
+	printf("ping-pong %-5s  %8u round trips: mean %7.0f ns  p50 %7.0f ns  p99 %7.0f ns  p99.9 %7.0f ns  max %9.0f ns\n",
+		notify == SHM_NOTIFY_FUTEX ? "futex" : "sem", iterations, total / iterations,
+		rtt[iterations / 2], rtt[(size_t) (iterations * 0.99)], rtt[(size_t) (iterations * 0.999)], rtt[iterations - 1]);
+	free(rtt);
+	shm_segment_destroy(&ping);
+	shm_segment_destroy(&pong);
+}
+
+/* Transfers ===================================================== */
+
+typedef struct{
+	shm_segment_t data;
+	shm_segment_t req;
+} cache_seg_t;
+
+/* cache 端每个段一个线程: 收到大小就把对象按块写进 ring, 收到 0 退出 */
+static void* _cache_thread(void *arg){
+	cache_seg_t *cs = arg;
+	shm_payload_t *data = cs->data.addr;
+	size_t size, off, n, capacity = data->slot_size - sizeof(shm_slot_t);
+	char *source = malloc(object_size);
+	shm_slot_t *slot;
+
+	memset(source, 'x', object_size);
+	while (0 < (size = _recv_size(cs->req.addr))){
+		for (off = 0; off < size; off += n){
+			n = size - off < capacity ? size - off : capacity;
+			slot = shm_ring_begin_write(data);
+			memcpy(slot->data, source + off, n);
+			slot->datalen = n;
+			slot->is_last_chunk = (off + n == size);
+			shm_ring_commit_write(data);
+		}
+	}
+	free(source);
+	return NULL;
+}
+
+static void _cache_process(const char *prefix, int nsegments, size_t segsize){
+	cache_seg_t *segs = calloc(nsegments, sizeof(cache_seg_t));
+	pthread_t *threads = calloc(nsegments, sizeof(pthread_t));
+	char name[2 * SHM_NAME_LEN];
+	int i;
+
+	for (i = 0; i < nsegments; i++){
+		snprintf(name, sizeof(name), "%s_%d", prefix, i);
+		if (0 > shm_segment_attach(&segs[i].data, name, segsize))
+			_exit(1);
+		snprintf(name, sizeof(name), "%s_req_%d", prefix, i);
+		if (0 > shm_segment_attach(&segs[i].req, name, REQ_SEGSIZE))
+			_exit(1);
+		pthread_create(&threads[i], NULL, _cache_thread, &segs[i]);
+	}
+	for (i = 0; i < nsegments; i++)
+		pthread_join(threads[i], NULL);
+	_exit(0);
+}
+
+/* proxy 端: 和 handle_with_cache 一样拿段, 发请求, 读到最后一块, 还段 */
+static void* _proxy_thread(void *arg){
+	char *sink = malloc(object_size);
+	double start, acquired, waited = 0;
+	shm_segment_t *seg;
+	shm_payload_t *data;
+	shm_slot_t *slot;
+	size_t got;
+	long k;
+	int last;
+
+	while ((k = __sync_fetch_and_add(&next_object, 1)) < nobjects){
+		start = _now_ns();
+		if (NULL == (seg = shm_pool_acquire(&pool))){
+			fprintf(stderr, "Timed out waiting for a segment\n");
+			exit(__LINE__);
+		}
+		acquired = _now_ns();
+		waited += acquired - start;
+
+		data = seg->addr;
+		_send_size(reqs[_seg_index(seg)]->addr, object_size);
+		got = 0;
+		do {
+			slot = shm_ring_begin_read(data);
+			memcpy(sink + got, slot->data, slot->datalen);
+			got += slot->datalen;
+			last = slot->is_last_chunk;
+			shm_ring_end_read(data);
+		} while (!last);
+		shm_pool_release(&pool, seg);
+
+		if (k < MAX_SAMPLES)
+			samples[k] = _now_ns() - start;
+	}
+
+	pthread_mutex_lock(&acquire_lock);
+	acquire_ns += waited;
+	pthread_mutex_unlock(&acquire_lock);
+	free(sink);
+	return NULL;
+}
+
+static void _transfer(int run, size_t segsize, int nsegments, unsigned int nslots, size_t objsize, int nthreads, size_t budget){
+	char prefix[SHM_NAME_LEN], name[2 * SHM_NAME_LEN];
+	shm_segment_t **segs, *seg;
+	pthread_t *threads;
+	double start, elapsed, gbps;
+	long nsamples;
+	int i, active;
+	pid_t pid;
+
+	if (0 == shm_slot_capacity(segsize, nslots)){
+		printf("%9zu %5d %10zu %7d  segment too small for %u slots\n", segsize, nsegments, objsize, nthreads, nslots);
+		return;
+	}
+
+	object_size = objsize;
+	nobjects = budget / objsize > 0 ? (long) (budget / objsize) : 1;
+	next_object = 0;
+	acquire_ns = 0;
+	nsamples = nobjects < MAX_SAMPLES ? nobjects : MAX_SAMPLES;
+	samples = malloc(nsamples * sizeof(double));
+
+	/* 和 webproxy 一样建池; 请求段不进池, 跟着同下标的数据段走 */
+	snprintf(prefix, sizeof(prefix), "/shm_bench_%d_%d", (int) getpid(), run);
+	shm_pool_init(&pool, 60000);
+	create_n_segments(nsegments, segsize, nslots, prefix, &pool);
+	if (steque_size(&pool.free_segments) != nsegments){
+		fprintf(stderr, "Failed to create %d segments of %zu bytes\n", nsegments, segsize);
+		exit(__LINE__);
+	}
+	segs = calloc(nsegments, sizeof(shm_segment_t*));
+	reqs = calloc(nsegments, sizeof(shm_segment_t*));
+	for (i = 0; i < nsegments; i++){
+		seg = steque_pop(&pool.free_segments);
+		segs[_seg_index(seg)] = seg;
+		steque_enqueue(&pool.free_segments, seg);
+	}
+	for (i = 0; i < nsegments; i++){
+		reqs[i] = malloc(sizeof(shm_segment_t));
+		snprintf(name, sizeof(name), "%s_req_%d", prefix, i);
+		if (0 > shm_segment_create(reqs[i], name, REQ_SEGSIZE, 1)){
+			fprintf(stderr, "Failed to create shared memory: %s\n", name);
+			exit(__LINE__);
+		}
+	}
+
+	/* 还没有别的线程时 fork */
+	if (0 > (pid = fork())){
+		perror("fork");
+		exit(__LINE__);
+	}
+	if (pid == 0)
+		_cache_process(prefix, nsegments, segsize);
+
+	threads = calloc(nthreads, sizeof(pthread_t));
+	start = _now_ns();
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, _proxy_thread, NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	elapsed = _now_ns() - start;
+
+	qsort(samples, nsamples, sizeof(double), _cmp_double);
+	active = nthreads < nsegments ? nthreads : nsegments;
+	gbps = (double) nobjects * objsize / elapsed;
+	printf("%9zu %5d %10zu %7d %11.0f %8.2f %8.2f %9.1f %9.1f %10.0f %8lu %9.1f %6lu\n",
+		segsize, nsegments, objsize, nthreads, nobjects / (elapsed / 1e9), gbps, gbps / active,
+		samples[nsamples / 2] / 1000, samples[(long) (nsamples * 0.99)] / 1000,
+		acquire_ns / nobjects, pool.waited,
+		pool.waited ? pool.total_wait_ns / pool.waited / 1000 : 0.0, pool.max_queue);
+	fflush(stdout);
+
+	/* 每个 cache 线程收一个 0 退出 */
+	for (i = 0; i < nsegments; i++)
+		_send_size(reqs[i]->addr, 0);
+	waitpid(pid, NULL, 0);
+	for (i = 0; i < nsegments; i++){
+		shm_segment_destroy(segs[i]);
+		shm_segment_destroy(reqs[i]);
+		free(segs[i]);
+		free(reqs[i]);
+	}
+	while (!steque_isempty(&pool.free_segments))
+		steque_pop(&pool.free_segments);
+	free(segs);
+	free(reqs);
+	free(threads);
+	free(samples);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+	size_t segsizes[MAX_LIST] = { SHM_SEGMENT_SIZE, 64 << 10, 1 << 20 };
+	size_t counts[MAX_LIST] = { 8 };
+	size_t objsizes[MAX_LIST] = { 1 << 10, 100 << 10, 1 << 20 };
+	size_t threads[MAX_LIST] = { 1, 4, 16 };
+	int nsegsizes = 3, ncounts = 1, nobjsizes = 3, nthreadcounts = 3;
+	unsigned int nslots = SHM_DEFAULT_SLOTS, iterations = 100000;
+	int option_char, notify = SHM_NOTIFY_FUTEX, run = 0;
+	size_t budget = 256 << 20;
+	int z, n, o, t;
+
+	setbuf(stdout, NULL);
+	while ((option_char = getopt_long(argc, argv, "z:n:o:t:k:b:m:i:h", gLongOptions, NULL)) != -1) {
+		switch (option_char) {
+			case 'z': // segment sizes
+				nsegsizes = _parse_list(optarg, segsizes);
+				break;
+			case 'n': // segment counts
+				ncounts = _parse_list(optarg, counts);
+				break;
+			case 'o': // object sizes
+				nobjsizes = _parse_list(optarg, objsizes);
+				break;
+			case 't': // proxy threads
+				nthreadcounts = _parse_list(optarg, threads);
+				break;
+			case 'k': // slots per segment
+				nslots = atoi(optarg);
+				break;
+			case 'b': // doorbell
+				if (0 == strcmp(optarg, "futex")) notify = SHM_NOTIFY_FUTEX;
+				else if (0 == strcmp(optarg, "sem")) notify = SHM_NOTIFY_SEM;
+				else {
+					fprintf(stderr, "Unknown doorbell %s\n", optarg);
+					exit(__LINE__);
+				}
+				break;
+			case 'm': // megabytes per combination
+				budget = (size_t) atoi(optarg) << 20;
+				break;
+			case 'i': // ping-pong iterations
+				iterations = atoi(optarg);
+				break;
+			case 'h': // help
+				printf(USAGE);
+				exit(0);
+				break;
+			default:
+				fprintf(stderr, USAGE);
+				exit(__LINE__);
+		}
+	}
+
+	if (nslots < 1 || nsegsizes == 0 || ncounts == 0 || nobjsizes == 0 || nthreadcounts == 0 || budget == 0) {
+		fprintf(stderr, USAGE);
+		exit(__LINE__);
+	}
+
+	if (iterations > 0) {
+		_pingpong(SHM_NOTIFY_SEM, iterations);
+		_pingpong(SHM_NOTIFY_FUTEX, iterations);
+	}
+
+	shm_channel_set_notify(notify);
+	printf("%s doorbell, %u slots per segment, %zu MB per combination\n",
+		notify == SHM_NOTIFY_FUTEX ? "futex" : "sem", nslots, budget >> 20);
+	printf("%9s %5s %10s %7s %11s %8s %8s %9s %9s %10s %8s %9s %6s\n",
+		"seg_bytes", "nseg", "obj_bytes", "threads", "objects/s", "GB/s", "GB/s/seg",
+		"p50_us", "p99_us", "acquire_ns", "waited", "wait_us", "queue");
+	for (z = 0; z < nsegsizes; z++)
+		for (n = 0; n < ncounts; n++)
+			for (o = 0; o < nobjsizes; o++)
+				for (t = 0; t < nthreadcounts; t++)
+					_transfer(run++, segsizes[z], (int) counts[n], nslots, objsizes[o], (int) threads[t], budget);
+	return 0;
+}
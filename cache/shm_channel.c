@@ -6,26 +6,82 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
 
-void create_n_segments(int nsegments, size_t segsize, steque_t* free_segments) {
+#define SHM_SLOT_ALIGN 64
+
+static int notify_mode = SHM_NOTIFY_FUTEX;
+static int spin_budget = -1; // -1 = 自动: 单核机器上自旋没有意义
+static __thread unsigned int spin_estimate = SHM_DEFAULT_SPIN / 4;
+
+void shm_channel_set_notify(int notify) {
+    notify_mode = notify;
+}
+
+void shm_channel_set_spin(unsigned int spin) {
+    spin_budget = spin > INT_MAX ? INT_MAX : (int)spin;
+}
+
+static unsigned int _spin_budget(void) {
+    if (spin_budget < 0) {
+        spin_budget = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_DEFAULT_SPIN : 0;
+    }
+    return spin_budget;
+}
+
+static void _payload_init(shm_payload_t *payload, size_t size, unsigned int nslots, int notify) {
+    static uint32_t generation_seq;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    payload->generation = (uint32_t)getpid() * 2654435761u ^ (uint32_t)ts.tv_nsec ^ __sync_add_and_fetch(&generation_seq, 1);
+    payload->nslots = nslots;
+    payload->slot_size = ((size - sizeof(*payload)) / nslots) & ~(size_t)(SHM_SLOT_ALIGN - 1);
+    payload->notify = notify;
+    payload->head = 0;
+    payload->tail = 0;
+    payload->produced = 0;
+    payload->consumed = 0;
+    payload->produced_waiters = 0;
+    payload->consumed_waiters = 0;
+    payload->total_file_size = 0;
+    payload->fill_limit = 0;
+    payload->delivery = SHM_DELIVER_COPY;
+    payload->aborted = 0;
+    sem_init(&payload->sem_proxy_ready, 1, 0);
+    sem_init(&payload->sem_cache_ready, 1, nslots);
+}
+
+void create_n_segments(int nsegments, size_t segsize, unsigned int nslots, const char *prefix, shm_pool_t *pool) {
+    pool->segsize = segsize;
+    pool->nslots = nslots;
     for (int i = 0; i < nsegments; i++) {
         char shm_name[SHM_NAME_LEN];
-        snprintf(shm_name, SHM_NAME_LEN, "/proxy_shm_%d", i);
+        snprintf(shm_name, SHM_NAME_LEN, "%s_%d", prefix, i);
 
         shm_segment_t *seg = malloc(sizeof(shm_segment_t));
-        if (shm_segment_create(seg, shm_name, segsize) < 0) {
+        if (shm_segment_create(seg, shm_name, segsize, nslots) < 0) {
             fprintf(stderr, "Failed to create shared memory: %s\n", shm_name);
             free(seg);
             continue;
         }
 
-        steque_enqueue(free_segments, seg);
+        seg->pool = pool;
+        steque_enqueue(&pool->free_segments, seg);
     }
 }
 
-int shm_segment_create(shm_segment_t *seg, const char *name, size_t size) {
-    strncpy(seg->shm_name, name, SHM_NAME_LEN);
+int shm_segment_create(shm_segment_t *seg, const char *name, size_t size, unsigned int nslots) {
+    if (shm_slot_capacity(size, nslots) == 0) return -1;
+
+    snprintf(seg->shm_name, SHM_NAME_LEN, "%s", name);
     seg->size = size;
+    seg->pool = NULL;
 
     seg->fd = shm_open(name, O_CREAT | O_RDWR, 0666);
     if (seg->fd < 0) return -1;
@@ -34,26 +90,173 @@ int shm_segment_create(shm_segment_t *seg, const char *name, size_t size) {
     seg->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
     if (seg->addr == MAP_FAILED) return -1;
 
-    // 初始化 semaphores
-    shm_payload_t* payload = (shm_payload_t*)seg->addr;
-    sem_init(&payload->sem_proxy_ready, 1, 0);
-    sem_init(&payload->sem_cache_ready, 1, 0);
-    payload->datalen = 0;
+    // 初始化 ring: 所有槽都空闲
+    _payload_init((shm_payload_t*)seg->addr, size, nslots, notify_mode);
 
     return 0;
 }
 
 int shm_segment_attach(shm_segment_t *seg, const char *name, size_t size) {
-    strncpy(seg->shm_name, name, SHM_NAME_LEN);
+    snprintf(seg->shm_name, SHM_NAME_LEN, "%s", name);
+    seg->pool = NULL;
     seg->size = size;
 
     seg->fd = shm_open(name, O_RDWR, 0666);
     if (seg->fd < 0) return -1;
 
     seg->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
-    if (seg->addr == MAP_FAILED) return -1;
+    if (seg->addr == MAP_FAILED) {
+        close(seg->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Cache 这边已经 attach 的段, 按名字分桶
+#define ATTACH_BUCKETS 1024
+
+typedef struct attach_entry_t {
+    shm_segment_t seg;      // 必须是第一个成员, put 时从 seg 指针转回来
+    uint32_t generation;
+    int refs;
+    int retired;            // 已经从表里摘掉, 最后一个 put 负责 munmap
+    struct attach_entry_t *next;
+} attach_entry_t;
+
+static attach_entry_t *attach_table[ATTACH_BUCKETS];
+static pthread_mutex_t attach_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int _attach_bucket(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % ATTACH_BUCKETS;
+}
+
+// 调用者持有 attach_lock; 摘下 entry, 没人用就立刻释放
+static void _attach_unlink(attach_entry_t **link) {
+    attach_entry_t *entry = *link;
+    *link = entry->next;
+    entry->retired = 1;
+    if (entry->refs == 0) {
+        munmap(entry->seg.addr, entry->seg.size);
+        free(entry);
+    }
+}
+
+shm_segment_t* shm_attach_get(const char *name, size_t size, uint32_t generation) {
+    unsigned int b = _attach_bucket(name);
+
+    pthread_mutex_lock(&attach_lock);
+    for (attach_entry_t **link = &attach_table[b]; *link != NULL; link = &(*link)->next) {
+        attach_entry_t *entry = *link;
+        if (strcmp(entry->seg.shm_name, name) != 0) continue;
+
+        if (entry->seg.size == size && entry->generation == generation) {
+            entry->refs++;
+            pthread_mutex_unlock(&attach_lock);
+            return &entry->seg;
+        }
+        // 同名但 proxy 已经重建过这个段: 旧映射作废
+        _attach_unlink(link);
+        break;
+    }
+
+    attach_entry_t *entry = malloc(sizeof(attach_entry_t));
+    if (shm_segment_attach(&entry->seg, name, size) < 0) {
+        pthread_mutex_unlock(&attach_lock);
+        free(entry);
+        return NULL;
+    }
+    // 映射建好后 fd 就没用了, 不占着
+    close(entry->seg.fd);
+    entry->seg.fd = -1;
+    entry->generation = ((shm_payload_t*)entry->seg.addr)->generation;
+    entry->retired = 0;
+    entry->next = attach_table[b];
+    attach_table[b] = entry;
+    // 新映射留在表里给之后的请求用, 但这个请求要的那一代已经没了
+    if (entry->generation != generation) {
+        entry->refs = 0;
+        pthread_mutex_unlock(&attach_lock);
+        errno = ESTALE;
+        return NULL;
+    }
+    entry->refs = 1;
+    pthread_mutex_unlock(&attach_lock);
+    return &entry->seg;
+}
+
+void shm_attach_put(shm_segment_t *seg) {
+    attach_entry_t *entry = (attach_entry_t*)seg;
+
+    pthread_mutex_lock(&attach_lock);
+    if (--entry->refs == 0 && entry->retired) {
+        munmap(entry->seg.addr, entry->seg.size);
+        free(entry);
+    }
+    pthread_mutex_unlock(&attach_lock);
+}
+
+void shm_attach_retire(const char *name) {
+    unsigned int b = _attach_bucket(name);
+
+    pthread_mutex_lock(&attach_lock);
+    for (attach_entry_t **link = &attach_table[b]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->seg.shm_name, name) == 0) {
+            _attach_unlink(link);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&attach_lock);
+}
+
+void shm_attach_retire_prefix(const char *prefix) {
+    size_t len = strlen(prefix);
+
+    pthread_mutex_lock(&attach_lock);
+    for (int b = 0; b < ATTACH_BUCKETS; b++) {
+        attach_entry_t **link = &attach_table[b];
+        while (*link != NULL) {
+            if (strncmp((*link)->seg.shm_name, prefix, len) != 0) {
+                link = &(*link)->next;
+                continue;
+            }
+            if ((*link)->refs > 0) {
+                shm_ring_abort((shm_payload_t*)(*link)->seg.addr);
+            }
+            _attach_unlink(link);
+        }
+    }
+    pthread_mutex_unlock(&attach_lock);
+}
+
+int shm_segment_recreate(shm_segment_t *seg) {
+    shm_payload_t *payload = (shm_payload_t*) seg->addr;
+    unsigned int nslots = payload->nslots;
+    int notify = payload->notify;
+    size_t size = seg->size;
+    char name[SHM_NAME_LEN];
+
+    snprintf(name, SHM_NAME_LEN, "%s", seg->shm_name);
+    // 旧段被 unlink 之后 cache 那边的映射还在; 先中止, 卡在上面的 cache 线程醒来放手
+    shm_ring_abort(payload);
+    shm_segment_destroy(seg);
+
+    seg->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (seg->fd < 0) return -1;
+    if (ftruncate(seg->fd, size) < 0) goto fail;
+    seg->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->addr == MAP_FAILED) goto fail;
 
+    // 新的代号让 cache 下次 attach 时丢掉旧映射
+    _payload_init((shm_payload_t*)seg->addr, size, nslots, notify);
     return 0;
+
+fail:
+    close(seg->fd);
+    shm_unlink(name);
+    return -1;
 }
 
 int shm_segment_destroy(shm_segment_t *seg) {
@@ -66,3 +269,405 @@ int shm_segment_destroy(shm_segment_t *seg) {
     shm_unlink(seg->shm_name);
     return 0;
 }
+
+int shm_object_export(const char *name, int fd, size_t size) {
+    if (size == 0) return -1;
+
+    shm_unlink(name);
+    // 0444: 只有创建者这一次能写, proxy 只能以只读方式打开
+    int objfd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0444);
+    if (objfd < 0) return -1;
+    if (ftruncate(objfd, size) < 0) goto fail;
+
+    char *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, objfd, 0);
+    if (addr == MAP_FAILED) goto fail;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, addr + done, size - done, done);
+        if (n <= 0) {
+            munmap(addr, size);
+            goto fail;
+        }
+        done += n;
+    }
+
+    munmap(addr, size);
+    close(objfd);
+    return 0;
+
+fail:
+    close(objfd);
+    shm_unlink(name);
+    return -1;
+}
+
+int shm_object_open(const char *name) {
+    return shm_open(name, O_RDONLY, 0);
+}
+
+// 一个排队等段的请求, 在等待者自己的栈上
+typedef struct {
+    pthread_cond_t cond;
+    shm_segment_t *seg; // release 直接交到这里
+} shm_pool_waiter_t;
+
+void shm_pool_init(shm_pool_t *pool, unsigned int wait_ms) {
+    steque_init(&pool->free_segments);
+    pool->segsize = 0;
+    pool->nslots = 0;
+    steque_init(&pool->waiters);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->wait_ms = wait_ms;
+    pool->acquired = 0;
+    pool->waited = 0;
+    pool->timeouts = 0;
+    pool->max_queue = 0;
+    pool->total_wait_ns = 0;
+    pool->max_wait_ns = 0;
+}
+
+static double _now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// 超时的等待者把自己从队列里摘掉, 其余顺序不变
+static void _pool_remove_waiter(shm_pool_t *pool, shm_pool_waiter_t *waiter) {
+    int n = steque_size(&pool->waiters);
+    for (int i = 0; i < n; i++) {
+        if (steque_front(&pool->waiters) == waiter) {
+            steque_pop(&pool->waiters);
+        } else {
+            steque_cycle(&pool->waiters);
+        }
+    }
+}
+
+shm_segment_t* shm_pool_try_acquire(shm_pool_t *pool) {
+    shm_segment_t *seg = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!steque_isempty(&pool->free_segments) && steque_isempty(&pool->waiters)) {
+        seg = steque_pop(&pool->free_segments);
+        pool->acquired++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return seg;
+}
+
+shm_segment_t* shm_pool_acquire(shm_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+
+    // 有人在排队时不能插队
+    if (!steque_isempty(&pool->free_segments) && steque_isempty(&pool->waiters)) {
+        shm_segment_t *seg = steque_pop(&pool->free_segments);
+        pool->acquired++;
+        pthread_mutex_unlock(&pool->lock);
+        return seg;
+    }
+
+    if (pool->wait_ms == 0) {
+        pool->timeouts++;
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    shm_pool_waiter_t waiter;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiter.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    waiter.seg = NULL;
+
+    steque_enqueue(&pool->waiters, &waiter);
+    if ((unsigned long)steque_size(&pool->waiters) > pool->max_queue) {
+        pool->max_queue = steque_size(&pool->waiters);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    double start = deadline.tv_sec * 1e9 + deadline.tv_nsec;
+    deadline.tv_sec += pool->wait_ms / 1000;
+    deadline.tv_nsec += (long)(pool->wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (waiter.seg == NULL) {
+        if (pthread_cond_timedwait(&waiter.cond, &pool->lock, &deadline) == ETIMEDOUT) break;
+    }
+
+    // 超时和交接可能同时发生: 段已经到手就照常用
+    double waited_ns = _now_ns() - start;
+    pool->waited++;
+    pool->total_wait_ns += waited_ns;
+    if (waited_ns > pool->max_wait_ns) pool->max_wait_ns = waited_ns;
+    if (waiter.seg == NULL) {
+        _pool_remove_waiter(pool, &waiter);
+        pool->timeouts++;
+    } else {
+        pool->acquired++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_cond_destroy(&waiter.cond);
+    return waiter.seg;
+}
+
+void shm_pool_release(shm_pool_t *pool, shm_segment_t *seg) {
+    pthread_mutex_lock(&pool->lock);
+    if (!steque_isempty(&pool->waiters)) {
+        shm_pool_waiter_t *waiter = steque_pop(&pool->waiters);
+        waiter->seg = seg;
+        pthread_cond_signal(&waiter->cond);
+    } else {
+        seg->pool = pool;
+        steque_enqueue(&pool->free_segments, seg);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void shm_pool_print_stats(shm_pool_t *pool, FILE *out) {
+    pthread_mutex_lock(&pool->lock);
+    fprintf(out, "[POOL %zu] acquired=%lu waited=%lu timeouts=%lu max_queue=%lu avg_wait=%.1fus max_wait=%.1fus\n",
+            pool->segsize, pool->acquired, pool->waited, pool->timeouts, pool->max_queue,
+            pool->waited ? pool->total_wait_ns / pool->waited / 1000 : 0.0,
+            pool->max_wait_ns / 1000);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+size_t shm_slot_capacity(size_t size, unsigned int nslots) {
+    if (nslots == 0 || size <= sizeof(shm_payload_t)) return 0;
+    size_t slot_size = ((size - sizeof(shm_payload_t)) / nslots) & ~(size_t)(SHM_SLOT_ALIGN - 1);
+    if (slot_size <= sizeof(shm_slot_t)) return 0;
+    return slot_size - sizeof(shm_slot_t);
+}
+
+static shm_slot_t* _ring_slot(shm_payload_t *payload, unsigned int idx) {
+    return (shm_slot_t*)(payload->data + (size_t)(idx % payload->nslots) * payload->slot_size);
+}
+
+// timeout_ms < 0 = 一直等, 否则换成 clock 下的绝对期限
+static const struct timespec* _deadline(struct timespec *ts, clockid_t clock, int timeout_ms) {
+    if (timeout_ms < 0) return NULL;
+    clock_gettime(clock, ts);
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+// deadline 是 CLOCK_REALTIME 的绝对时间 (sem_timedwait 只认这个), NULL = 一直等; 超时返回 -1
+static int _sem_wait_nointr(sem_t *sem, const struct timespec *deadline) {
+    int r;
+    while ((r = deadline ? sem_timedwait(sem, deadline) : sem_wait(sem)) < 0 && errno == EINTR)
+        ;
+    return r;
+}
+
+static inline void _cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// 等 *word 离开 seen: 先自旋, 再登记为等待者睡在 futex 上
+// 自旋上限跟着本线程最近实际需要的自旋次数走 (类似 glibc 的 adaptive mutex), 不超过 spin budget
+// deadline 是 CLOCK_MONOTONIC 的绝对时间, NULL = 一直等; 到期返回 -1
+static int _doorbell_wait(uint32_t *word, uint32_t *waiters, uint32_t seen, const struct timespec *deadline) {
+    unsigned int limit = 2 * spin_estimate + 16;
+    if (limit > _spin_budget()) limit = _spin_budget();
+
+    unsigned int i;
+    for (i = 0; i < limit; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen) break;
+        _cpu_relax();
+    }
+    spin_estimate += ((int)i - (int)spin_estimate) / 8;
+    if (i < limit) return 0;
+
+    int r = 0;
+    __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen) {
+        // FUTEX_WAIT_BITSET 的超时是绝对时间, 被信号打断或者假唤醒之后不用重算
+        if (syscall(SYS_futex, word, FUTEX_WAIT_BITSET, seen, deadline, NULL, FUTEX_BITSET_MATCH_ANY) < 0 && errno == ETIMEDOUT) {
+            r = -1;
+            break;
+        }
+    }
+    __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+    return r;
+}
+
+// 推进 *word; 只有对端登记了等待才进内核
+static void _doorbell_ring(uint32_t *word, uint32_t *waiters) {
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+shm_slot_t* shm_ring_begin_write_timed(shm_payload_t *payload, int timeout_ms) {
+    struct timespec ts;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        const struct timespec *deadline = _deadline(&ts, CLOCK_MONOTONIC, timeout_ms);
+        uint32_t consumed;
+        while (!__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE) &&
+               payload->produced - (consumed = __atomic_load_n(&payload->consumed, __ATOMIC_ACQUIRE)) >= payload->nslots) {
+            if (_doorbell_wait(&payload->consumed, &payload->consumed_waiters, consumed, deadline) < 0) return NULL;
+        }
+    } else if (_sem_wait_nointr(&payload->sem_cache_ready, _deadline(&ts, CLOCK_REALTIME, timeout_ms)) < 0) {
+        return NULL;
+    }
+    if (__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE)) return NULL;
+    return _ring_slot(payload, payload->head);
+}
+
+shm_slot_t* shm_ring_begin_write(shm_payload_t *payload) {
+    return shm_ring_begin_write_timed(payload, -1);
+}
+
+shm_slot_t* shm_ring_try_claim(shm_payload_t *payload, unsigned int claimed) {
+    if (__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE)) return NULL;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        if (payload->produced + claimed - __atomic_load_n(&payload->consumed, __ATOMIC_ACQUIRE) >= payload->nslots) return NULL;
+    } else if (sem_trywait(&payload->sem_cache_ready) < 0) {
+        return NULL;
+    }
+    return _ring_slot(payload, payload->head + claimed);
+}
+
+void shm_ring_unclaim(shm_payload_t *payload, unsigned int n) {
+    // futex 模式的认领只是本地记账, 信号量模式要把 trywait 拿走的还回去
+    if (payload->notify == SHM_NOTIFY_FUTEX) return;
+    while (n-- > 0) sem_post(&payload->sem_cache_ready);
+}
+
+void shm_ring_commit_write(shm_payload_t *payload) {
+    payload->head = (payload->head + 1) % payload->nslots;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        _doorbell_ring(&payload->produced, &payload->produced_waiters);
+    } else {
+        sem_post(&payload->sem_proxy_ready);
+    }
+}
+
+shm_slot_t* shm_ring_begin_read_timed(shm_payload_t *payload, int timeout_ms) {
+    struct timespec ts;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        const struct timespec *deadline = _deadline(&ts, CLOCK_MONOTONIC, timeout_ms);
+        uint32_t produced;
+        while (!__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE) &&
+               (produced = __atomic_load_n(&payload->produced, __ATOMIC_ACQUIRE)) == payload->consumed) {
+            if (_doorbell_wait(&payload->produced, &payload->produced_waiters, produced, deadline) < 0) return NULL;
+        }
+    } else if (_sem_wait_nointr(&payload->sem_proxy_ready, _deadline(&ts, CLOCK_REALTIME, timeout_ms)) < 0) {
+        return NULL;
+    }
+    if (__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE)) return NULL;
+    return _ring_slot(payload, payload->tail);
+}
+
+shm_slot_t* shm_ring_begin_read(shm_payload_t *payload) {
+    return shm_ring_begin_read_timed(payload, -1);
+}
+
+void shm_ring_end_read(shm_payload_t *payload) {
+    payload->tail = (payload->tail + 1) % payload->nslots;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        _doorbell_ring(&payload->consumed, &payload->consumed_waiters);
+    } else {
+        sem_post(&payload->sem_cache_ready);
+    }
+}
+
+// 写完最后一块之后调用; 读者每读完一块推进一次 consumed
+int shm_ring_wait_drained_timed(shm_payload_t *payload, int timeout_ms) {
+    struct timespec ts;
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        const struct timespec *deadline = _deadline(&ts, CLOCK_MONOTONIC, timeout_ms);
+        uint32_t consumed;
+        while (!__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE) &&
+               (consumed = __atomic_load_n(&payload->consumed, __ATOMIC_ACQUIRE)) != payload->produced) {
+            if (_doorbell_wait(&payload->consumed, &payload->consumed_waiters, consumed, deadline) < 0) return -1;
+        }
+        return 0;
+    }
+    // 信号量模式: 空闲槽数回到 nslots 就是读完了, 拿到的再还回去
+    const struct timespec *deadline = _deadline(&ts, CLOCK_REALTIME, timeout_ms);
+    unsigned int got = 0;
+    while (got < payload->nslots && _sem_wait_nointr(&payload->sem_cache_ready, deadline) == 0) got++;
+    for (unsigned int i = 0; i < got; i++) sem_post(&payload->sem_cache_ready);
+    return got == payload->nslots ? 0 : -1;
+}
+
+void shm_ring_wait_drained(shm_payload_t *payload) {
+    shm_ring_wait_drained_timed(payload, -1);
+}
+
+// 对端已经死了, 计数器乱掉也无所谓: 推进 consumed / produced 只是为了让等待的写者和读者醒来
+void shm_ring_abort(shm_payload_t *payload) {
+    __atomic_store_n(&payload->aborted, 1, __ATOMIC_SEQ_CST);
+    if (payload->notify == SHM_NOTIFY_FUTEX) {
+        __atomic_fetch_add(&payload->consumed, payload->nslots, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &payload->consumed, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        __atomic_fetch_add(&payload->produced, payload->nslots, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &payload->produced, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    } else {
+        for (unsigned int i = 0; i < payload->nslots; i++) {
+            sem_post(&payload->sem_cache_ready);
+            sem_post(&payload->sem_proxy_ready);
+        }
+    }
+}
+
+// 单槽 ring 上的 ping-pong: 子进程当 cache, 父进程当 proxy, 每次交接都要等对端
+static double _bench_one(int notify, unsigned int iterations) {
+    size_t size = sizeof(shm_payload_t) + 2 * SHM_SLOT_ALIGN;
+    shm_payload_t *payload = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (payload == MAP_FAILED) return -1;
+    _payload_init(payload, size, 1, notify);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        munmap(payload, size);
+        return -1;
+    }
+    if (pid == 0) {
+        for (unsigned int i = 0; i < iterations; i++) {
+            shm_slot_t *slot = shm_ring_begin_write(payload);
+            slot->datalen = i;
+            slot->is_last_chunk = (i + 1 == iterations);
+            shm_ring_commit_write(payload);
+        }
+        _exit(0);
+    }
+
+    double start = _now_ns();
+    for (unsigned int i = 0; i < iterations; i++) {
+        shm_ring_begin_read(payload);
+        shm_ring_end_read(payload);
+    }
+    double elapsed = _now_ns() - start;
+
+    waitpid(pid, NULL, 0);
+    sem_destroy(&payload->sem_proxy_ready);
+    sem_destroy(&payload->sem_cache_ready);
+    munmap(payload, size);
+    return elapsed / iterations;
+}
+
+void shm_doorbell_bench(unsigned int iterations) {
+    printf("[BENCH] %u single-slot handoffs per mode, spin budget %u\n", iterations, _spin_budget());
+    printf("[BENCH] sem:   %.0f ns/handoff\n", _bench_one(SHM_NOTIFY_SEM, iterations));
+    printf("[BENCH] futex: %.0f ns/handoff\n", _bench_one(SHM_NOTIFY_FUTEX, iterations));
+}
@@ -2,40 +2,169 @@
 #define __SHM_CHANNEL_H__
 
 #include <stddef.h>   // for size_t
+#include <stdint.h>
+#include <stdio.h>
 #include <semaphore.h>
+#include <pthread.h>
 #include "steque.h"
 
 #define SHM_NAME_LEN 64
 #define SHM_SEGMENT_SIZE 5712
+#define SHM_DEFAULT_SLOTS 4  // 1 = 旧的单缓冲 ping-pong 模式
+#define SHM_OBJECT_PREFIX "/simplecache_obj_"
 
+// 槽交接的通知方式
+#define SHM_NOTIFY_SEM 0     // 两个进程间共享的 POSIX 信号量
+#define SHM_NOTIFY_FUTEX 1   // 段里的序号计数器: 先自旋, 再 futex 等待
+#define SHM_DEFAULT_SPIN 200 // 进入 futex 之前最多自旋多少次
+
+// 对象的交付方式
+#define SHM_DELIVER_COPY 0   // 数据按块拷进 ring
+#define SHM_DELIVER_MAPPED 1 // cache 只回复只读对象的名字, proxy 打开后用 sendfile 发送
+
+
+typedef struct shm_pool_t shm_pool_t;
 
 typedef struct {
     char shm_name[SHM_NAME_LEN]; // e.g., "/proxy_shm_001"
     size_t size;
     void *addr;  // mmap address
     int fd;      // shm fd
+    shm_pool_t *pool; // 所属的池 (Proxy用)
 } shm_segment_t;
 
-// 共享内存中的布局
+// ring 中的一个槽
 typedef struct {
-    sem_t sem_proxy_ready;  // proxy waits here (reader)
-    sem_t sem_cache_ready;  // cache waits here (writer)
     size_t datalen;
     int is_last_chunk; // 1 = 最后一块
-    size_t total_file_size; // 文件总大小
     char data[]; // flexible array
+} shm_slot_t;
+
+// 共享内存中的布局: header + nslots 个槽组成的 SPSC ring
+// 平时 cache 是唯一的生产者 (只写 head), proxy 是唯一的消费者 (只写 tail);
+// CTL_FILL 时反过来, proxy 往里写从源站取回的对象, cache 读
+typedef struct {
+    sem_t sem_proxy_ready;  // 已填充的槽数, proxy waits here (reader)
+    sem_t sem_cache_ready;  // 空闲的槽数, cache waits here (writer)
+    unsigned int nslots;
+    size_t slot_size;       // 每个槽的字节数 (含 shm_slot_t 头)
+    int notify;             // SHM_NOTIFY_*, proxy 创建时定下
+    uint32_t generation;    // 每次创建都不同, cache 用它识别同名的新段
+    unsigned int head;      // cache 下一个要填的槽
+    unsigned int tail;      // proxy 下一个要读的槽
+    uint32_t produced;      // futex word: 累计填好的槽数 (只有 cache 写)
+    uint32_t consumed;      // futex word: 累计读完的槽数 (只有 proxy 写)
+    uint32_t produced_waiters; // 睡在 produced 上的 proxy 个数
+    uint32_t consumed_waiters; // 睡在 consumed 上的 cache 个数
+    size_t total_file_size; // 文件总大小
+    size_t fill_limit;      // miss 回复: >0 = cache 想要这个对象, proxy 可以填回来, 最多这么多字节
+    unsigned int req_id;    // cache 回显正在服务的请求号
+    int delivery;           // proxy 想要的交付方式; cache 改成实际用的方式
+    uint32_t aborted;       // 1 = proxy 已经退出, cache 不再读写这个 ring
+    char object_name[SHM_NAME_LEN]; // SHM_DELIVER_MAPPED 时的只读对象名
+    char data[]; // nslots * slot_size
 } shm_payload_t;
 
-// 创建 n 个共享内存段
-void create_n_segments(int nsegments, size_t segsize, steque_t* free_segments);
+// 空闲段池: 没有空闲段时请求按 FIFO 排队, 最多等 wait_ms 毫秒
+struct shm_pool_t {
+    steque_t free_segments;
+    size_t segsize;         // 池里每个段的大小
+    unsigned int nslots;    // 每个段的槽数
+    steque_t waiters;       // 排队的 shm_pool_waiter_t, 先来先得
+    pthread_mutex_t lock;
+    unsigned int wait_ms;   // 0 = 不等, 没有空闲段马上失败
+
+    // 统计, 受 lock 保护
+    unsigned long acquired;
+    unsigned long waited;   // 需要排队的次数
+    unsigned long timeouts;
+    unsigned long max_queue;
+    double total_wait_ns;
+    double max_wait_ns;
+};
+
+// 初始化一个空池
+void shm_pool_init(shm_pool_t *pool, unsigned int wait_ms);
+
+// 取一个段; 池空时排队等待, 超时返回 NULL
+shm_segment_t* shm_pool_acquire(shm_pool_t *pool);
+
+// 不等待: 有空闲段且没人排队才返回, 否则 NULL
+shm_segment_t* shm_pool_try_acquire(shm_pool_t *pool);
+
+// 还回一个段; 有人排队就直接交给队头
+void shm_pool_release(shm_pool_t *pool, shm_segment_t *seg);
+
+// 打印等待时间统计
+void shm_pool_print_stats(shm_pool_t *pool, FILE *out);
+
+// 之后创建的段用哪种通知方式 (Proxy用)
+void shm_channel_set_notify(int notify);
+
+// 等待时进入 futex 之前的自旋次数, 两端各自设置
+void shm_channel_set_spin(unsigned int spin);
+
+// 创建 n 个共享内存段 (名字是 "<prefix>_<i>"), 每段切成 nslots 个槽, 放进 pool
+void create_n_segments(int nsegments, size_t segsize, unsigned int nslots, const char *prefix, shm_pool_t *pool);
 
 // 创建并初始化共享内存段（Proxy用）
-int shm_segment_create(shm_segment_t *seg, const char *name, size_t size);
+int shm_segment_create(shm_segment_t *seg, const char *name, size_t size, unsigned int nslots);
 
 // 在Cache中 attach 已存在的共享内存
 int shm_segment_attach(shm_segment_t *seg, const char *name, size_t size);
 
+// Cache: 从映射表取一个段, 不在表里 (或者代号对不上) 才真正 attach; 用完 shm_attach_put
+// 重新 attach 之后代号还是对不上 (proxy 已经重建过这个段, 请求是旧的) 返回 NULL, errno = ESTALE
+shm_segment_t* shm_attach_get(const char *name, size_t size, uint32_t generation);
+void shm_attach_put(shm_segment_t *seg);
+
+// Cache: proxy 要销毁这个段了; 没人在用就立刻 munmap, 否则等最后一个 put
+void shm_attach_retire(const char *name);
+
+// Cache: 某个 proxy 退出了, 退役名字以 prefix 开头的所有段, 还在写的 ring 一并中止
+void shm_attach_retire_prefix(const char *prefix);
+
+// Proxy: 段上的等待失败过, 里面可能还有 cache 晚到的写入; 中止旧 ring, 换成同名 (新代号) 的新段, 失败返回 -1
+int shm_segment_recreate(shm_segment_t *seg);
+
 // 销毁共享内存段（Proxy清理用）
 int shm_segment_destroy(shm_segment_t *seg);
 
+// Cache: 把 fd 的内容拷进一个新的只读共享内存对象 (零拷贝交付用)
+int shm_object_export(const char *name, int fd, size_t size);
+
+// Proxy: 只读打开一个已导出的对象, 交给 gfs_sendfile; 失败返回 -1
+int shm_object_open(const char *name);
+
+// 段大小 size 切成 nslots 个槽后, 每个槽能装的数据字节数 (0 = 段太小)
+size_t shm_slot_capacity(size_t size, unsigned int nslots);
+
+// Cache: 等一个空闲槽 / 把填好的槽交给 proxy; ring 被中止时 begin 返回 NULL
+shm_slot_t* shm_ring_begin_write(shm_payload_t *payload);
+void shm_ring_commit_write(shm_payload_t *payload);
+
+// Proxy: 等一个填好的槽 / 把读完的槽还给 cache; ring 被中止时 begin 返回 NULL (只会发生在 cache 读 CTL_FILL 时)
+shm_slot_t* shm_ring_begin_read(shm_payload_t *payload);
+void shm_ring_end_read(shm_payload_t *payload);
+
+// 写的一方: 等读者把提交过的槽全部读完, 之后才能把段拿去做别的
+void shm_ring_wait_drained(shm_payload_t *payload);
+
+// 上面三种等待的限时版本, 最多等 timeout_ms 毫秒 (< 0 = 一直等); 超时或者 ring 被中止时 begin 返回 NULL, drained 返回 -1
+// 等待失败之后对端可能还会晚到地读写这个 ring, 段不能再原样放回池子 (见 shm_segment_recreate)
+shm_slot_t* shm_ring_begin_write_timed(shm_payload_t *payload, int timeout_ms);
+shm_slot_t* shm_ring_begin_read_timed(shm_payload_t *payload, int timeout_ms);
+int shm_ring_wait_drained_timed(shm_payload_t *payload, int timeout_ms);
+
+// Cache: 不等待地再认领一个空闲槽 (已经认领了 claimed 个还没提交); 没有空槽或者 ring 被中止返回 NULL
+// 认领的槽按顺序用 shm_ring_commit_write 提交, 用不上的用 shm_ring_unclaim 还回去
+shm_slot_t* shm_ring_try_claim(shm_payload_t *payload, unsigned int claimed);
+void shm_ring_unclaim(shm_payload_t *payload, unsigned int n);
+
+// Cache: proxy 已经不在了, 叫醒等空闲槽的写者和等数据的读者, 之后的 begin_write / begin_read 都失败
+void shm_ring_abort(shm_payload_t *payload);
+
+// 跨进程 ping-pong 对比信号量和 futex 两种通知方式, 结果打到 stdout
+void shm_doorbell_bench(unsigned int iterations);
+
 #endif // __SHM_CHANNEL_H__
@@ -8,11 +8,20 @@
 #include <getopt.h>
 #include <limits.h>
 #include <sys/signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <pthread.h>
 #include <printf.h>
 #include <curl/curl.h>
 
 #include "gfserver.h"
 #include "cache-student.h"
+#include "shm_channel.h"
+#include "simplecache.h"
+#include "keyindex.h"
+#include "evict.h"
 
 
 #define MAX_KEYLEN 1018 //KEYLEN definition
@@ -21,90 +30,901 @@
 #define CACHE_FAILURE (-1)
 #endif // CACHE_FAILURE
 
+#define HUGEPAGE_SIZE (2UL << 20)
+#define PARSE_CHUNK_MIN (1UL << 20)	/* 清单小于 1MB 就不开线程 */
+#define PARSE_MAX_THREADS 8
+#define FD_LIMIT_DEFAULT 512	/* RLIMIT_NOFILE 没有上限时 */
+#define READAHEAD_MIN (256UL << 10)	/* 这么大的对象打开时就发顺序预读 */
+#define READAHEAD_WINDOW (2UL << 20)
+#define FILL_GHOSTS 4096	/* 记住最近多少个 miss 过的 key */
+#define FILL_ADMIT_MISSES 2	/* 第几次 miss 时准许回填 */
+#define FILL_PENDING_SECS 10	/* 准许之后这么久内不再准许同一个 key */
+#define STORE_STRIPES 64	/* 内容存储的 body 指针按下标分到这么多把锁上 */
+
 typedef struct{
-	int fildes;
-	char key[MAX_KEYLEN];
+	int fildes;	/* -1 = 还没打开或者被 LRU 关掉了 */
+	int exported;	/* 1 = 内容已导出为只读共享内存对象 */
+	unsigned int export_gen;	/* 每导出一次加一, 写进对象名; 内容变了就换个名字重新导出 */
+	size_t export_size;	/* 导出时的大小, 和对象里的内容一致; size 可能已经是新文件的了 */
+	size_t size;	/* 第一次打开时 fstat 得到 */
+	simplecache_body_t *body;	/* 内容存储里的副本, NULL = 不在内存里 */
+	int loading;	/* 有线程正在把它读进内存 */
+	int resident;	/* 在淘汰策略里占着预算; 读的时候被淘汰了就不装进来 */
+	int missing;	/* 文件打不开, 以后都按 miss 处理 */
+	int lru_prev, lru_next;	/* 打开的 fd 按最近使用串起来 */
+	struct timespec mtime;	/* 上次看到的修改时间, 和 size 一起判断文件有没有被改 */
+	const char *key;	/* 指向 manifest; 回填进来的是自己的副本 */
+	const char *path;	/* 同上 */
 } item_t;
 //Item definition
 
-static int nitems;
-static item_t *items;
+static int nitems;	/* 回填时会增长, 没拿 fill_lock 的读要用 _nitems() */
+static item_t *items;	/* 初始化时按 清单 + 回填上限 一次分配好, 之后不再搬家 */
+static keyindex_t index_by_key;	/* key -> items 下标, 初始化之后只读 */
+static char *manifest;	/* 整个清单文件, key 和 path 都切在里面 */
 
-static int _itemcmp(const void *a, const void *b){
-	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
-}
+/* 回填: proxy 从源站取回的对象存成 fill_dir 下的文件, 之后和清单里的一样服务 */
+static pthread_mutex_t fill_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *fill_dir;	/* NULL = 不学新对象 */
+static int fill_max_objects;
+static size_t fill_max_size;
+static int nmanifest;	/* 清单里的条目数, 下标在这之后的都是回填的 */
+static int item_cap;
+static keyindex_t fill_index;	/* 回填的 key -> items 下标, 受 fill_lock 保护 */
+static unsigned long fill_admitted, fill_added, fill_rejected;
+
+/* 最近 miss 过的 key, 按哈希直接映射, 冲突就覆盖; 只 miss 一次的 key 不值得占地方 */
+typedef struct{
+	uint64_t hash;
+	unsigned int misses;
+	time_t admitted;	/* 上次准许回填的时间 */
+} fill_ghost_t;
+static fill_ghost_t fill_ghosts[FILL_GHOSTS];
+
+/* fd 缓存: 文件第一次访问时才打开, 最多 fd_limit 个, 超了关掉最久没用的 */
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd_limit;
+static int fd_open;
+static int lru_head = -1, lru_tail = -1;	/* head = 最近用过 */
+static unsigned long fd_opens, fd_evictions, fd_missing;
+static void (*change_hook)(const char *key);
+
+/* 内容存储: 预算内的热对象整块放在内存里, 放不下时由 store_evict 决定踢谁.
+ * body / loading / resident 由下标对应的那把锁保护, 命中时不会都挤在一把锁上 */
+static pthread_mutex_t store_locks[STORE_STRIPES];
+static size_t store_budget;
+static int store_hugepages;
+static int store_policy;
+static evict_t *store_evict;	/* NULL = 内容存储没开 */
 
 extern unsigned long int cache_delay;
 
+static void _store_drop(int i);
+static int _export_item(int i);
+static int _unexport(int i);
+
+
+static int _nitems(){
+	return __atomic_load_n(&nitems, __ATOMIC_ACQUIRE);
+}
+
+static void _item_init(int i, const char *key, const char *path){
+	items[i].fildes = -1;
+	items[i].exported = 0;
+	items[i].export_gen = 0;
+	items[i].export_size = 0;
+	items[i].size = 0;
+	items[i].body = NULL;
+	items[i].loading = 0;
+	items[i].resident = 0;
+	items[i].missing = 0;
+	items[i].lru_prev = items[i].lru_next = -1;
+	items[i].mtime.tv_sec = items[i].mtime.tv_nsec = 0;
+	items[i].key = key;
+	items[i].path = path;
+}
+
+/* 清单的一段: [start, end), 切成 key / path 并算好哈希 */
+typedef struct{
+	char *start, *end;
+	char **keys;
+	char **paths;
+	uint64_t *hashes;
+	int n;
+} parse_chunk_t;
+
+static void *_parse_chunk(void *arg){
+	parse_chunk_t *chunk = arg;
+	char *line = chunk->start, *eol, *key, *path, *ptr;
+	int capacity = 0;
+
+	chunk->n = 0;
+	while (line < chunk->end){
+		if (NULL == (eol = memchr(line, '\n', chunk->end - line)))
+			eol = chunk->end;
+		*eol = '\0';
+
+		/* Using space delimiter to sep key and path*/
+		ptr = line;
+		key = strsep(&ptr, " \t"); 	/* The key is first */
+		path = strsep(&ptr, " \t"); /* The path second */
+		line = eol + 1;
+		if (NULL == path || '\0' == key[0])
+			continue;
+
+		if (chunk->n == capacity){
+			capacity = capacity ? capacity * 2 : 1024;
+			chunk->keys = realloc(chunk->keys, capacity * sizeof(char*));
+			chunk->paths = realloc(chunk->paths, capacity * sizeof(char*));
+			chunk->hashes = realloc(chunk->hashes, capacity * sizeof(uint64_t));
+		}
+		chunk->keys[chunk->n] = key;
+		chunk->paths[chunk->n] = path;
+		chunk->hashes[chunk->n] = keyindex_hash(key);
+		chunk->n++;
+	}
+	return NULL;
+}
 
 int simplecache_init(char *filename){
 	FILE *filelist;
-	int capacity = 14;
-	char *path, *ptr;
+	struct stat statbuf;
+	parse_chunk_t chunks[PARSE_MAX_THREADS];
+	pthread_t threads[PARSE_MAX_THREADS];
+	int nchunks = 1, total = 0, rc, c, j;
+	size_t len;
 
-	if( NULL == (filelist = fopen(filename, "r"))){
+	if( NULL == (filelist = fopen(filename, "r")) || 0 > fstat(fileno(filelist), &statbuf)){
 		fprintf(stderr, "Unable to open file in simplecache_init.\n");
 		exit(CACHE_FAILURE);
 	}
 
-	items = (item_t*) malloc(capacity * sizeof(item_t));
+	/* 整个读进来, 不打开任何被缓存的文件 */
+	len = (size_t) statbuf.st_size;
+	manifest = malloc(len + 1);
+	if (len != fread(manifest, 1, len, filelist)){
+		fprintf(stderr, "Unable to read file in simplecache_init.\n");
+		exit(CACHE_FAILURE);
+	}
+	manifest[len] = '\0';
+	fclose(filelist);
+
+	/* 大清单按行边界切成几段, 每段一个线程去切分和算哈希 */
+	if (len >= 2 * PARSE_CHUNK_MIN){
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nchunks = len / PARSE_CHUNK_MIN;
+		if (nchunks > ncpus) nchunks = ncpus > 1 ? ncpus : 1;
+		if (nchunks > PARSE_MAX_THREADS) nchunks = PARSE_MAX_THREADS;
+	}
+	memset(chunks, 0, sizeof(chunks));
+	for (c = 0; c < nchunks; c++){
+		char *end = manifest + len * (c + 1) / nchunks;
+		chunks[c].start = c == 0 ? manifest : chunks[c - 1].end;
+		while (end < manifest + len && *end != '\n' && c < nchunks - 1)
+			end++;
+		if (end < manifest + len && c < nchunks - 1)
+			end++;
+		chunks[c].end = c == nchunks - 1 ? manifest + len : end;
+	}
+	for (c = 1; c < nchunks; c++)
+		pthread_create(&threads[c], NULL, _parse_chunk, &chunks[c]);
+	_parse_chunk(&chunks[0]);
+	for (c = 1; c < nchunks; c++)
+		pthread_join(threads[c], NULL);
+
+	/* 按清单顺序合并, 重复的 key 只保留第一条 */
+	for (c = 0; c < nchunks; c++)
+		total += chunks[c].n;
+	items = (item_t*) malloc((total + fill_max_objects ? total + fill_max_objects : 1) * sizeof(item_t));
 	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
-		/*Taking out EOL character*/
-		items[nitems].key[strlen(items[nitems].key)-1] = '\0';
+	keyindex_init(&index_by_key, total);
+	for (c = 0; c < nchunks; c++){
+		for (j = 0; j < chunks[c].n; j++){
+			if( 0 > (rc = keyindex_insert_hashed(&index_by_key, chunks[c].keys[j], chunks[c].hashes[j], nitems))){
+				fprintf(stderr, "Key arena is full at %s.\n", chunks[c].keys[j]);
+				exit(CACHE_FAILURE);
+			}
+			if (rc == 1)
+				continue;
 
-		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
-		strsep(&ptr, " \t"); 		/* The key is first */
-		path = strsep(&ptr, " \t"); /* The path second */
+			_item_init(nitems, chunks[c].keys[j], chunks[c].paths[j]);
+			nitems++;
+		}
+		free(chunks[c].keys);
+		free(chunks[c].paths);
+		free(chunks[c].hashes);
+	}
+	nmanifest = nitems;
+	item_cap = nitems + fill_max_objects;
+	if (NULL != fill_dir)
+		keyindex_init(&fill_index, fill_max_objects);
+
+	/* 默认用一半的 RLIMIT_NOFILE, 剩下的留给 socket 和调用者手里的 fd 副本 */
+	if (fd_limit <= 0){
+		struct rlimit rl;
+		fd_limit = FD_LIMIT_DEFAULT;
+		if (0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY)
+			fd_limit = rl.rlim_cur / 2 > 0 ? rl.rlim_cur / 2 : 1;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+void simplecache_set_fd_limit(int limit){
+	fd_limit = limit;
+}
+
+void simplecache_set_fill(char *dir, int max_objects, size_t max_size){
+	fill_dir = dir;
+	fill_max_objects = max_objects;
+	fill_max_size = max_size;
+}
+
+void simplecache_set_change_hook(void (*hook)(const char *key)){
+	change_hook = hook;
+}
+
+static void _lru_unlink(int i){
+	if (items[i].lru_prev >= 0) items[items[i].lru_prev].lru_next = items[i].lru_next;
+	else lru_head = items[i].lru_next;
+	if (items[i].lru_next >= 0) items[items[i].lru_next].lru_prev = items[i].lru_prev;
+	else lru_tail = items[i].lru_prev;
+	items[i].lru_prev = items[i].lru_next = -1;
+}
+
+static void _lru_push(int i){
+	items[i].lru_prev = -1;
+	items[i].lru_next = lru_head;
+	if (lru_head >= 0) items[lru_head].lru_prev = i;
+	else lru_tail = i;
+	lru_head = i;
+}
+
+/*
+ * 返回 items[i] 的一个 fd 副本, 由调用者关闭; 缓存里的 fd 随时可能被换出.
+ * 打开放在锁外, 冷启动时的并发打开互不阻塞.
+ */
+static int _item_fd(int i){
+	item_t *item = &items[i];
+	struct stat statbuf;
+	int fd, err = 0, newfd = -1, vanished = 0;	/* vanished: 送出去过的文件不见了或者变了 */
+
+	pthread_mutex_lock(&fd_lock);
+	if (item->missing){
+		pthread_mutex_unlock(&fd_lock);
+		return -1;
+	}
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
-			fprintf(stderr, "Unable to open file %s.\n", path);
-			exit(CACHE_FAILURE);
+	if (item->fildes < 0){
+		pthread_mutex_unlock(&fd_lock);
+		if (0 <= (newfd = open(item->path, O_RDONLY)) && 0 > fstat(newfd, &statbuf)){
+			err = errno;
+			close(newfd);
+			newfd = -1;
+		} else if (newfd < 0){
+			err = errno;
+		} else if (statbuf.st_size >= READAHEAD_MIN){
+			/* 大对象第一块被请求时就按顺序读, 让内核提前把后面的块读进来 */
+			posix_fadvise(newfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+			posix_fadvise(newfd, 0, READAHEAD_WINDOW, POSIX_FADV_WILLNEED);
 		}
-		nitems++;
+		pthread_mutex_lock(&fd_lock);
 
-		if(nitems == capacity){
-			capacity *= 2;
-			items = realloc(items, capacity * sizeof(item_t));
+		if (newfd < 0){
+			/* fd 用完了只是这一次失败, 其余的错误记下来以后直接按 miss 处理 */
+			if (err != EMFILE && err != ENFILE && !item->missing){
+				item->missing = 1;
+				fd_missing++;
+				vanished = item->mtime.tv_sec != 0 || item->mtime.tv_nsec != 0;	/* 以前送出去过 */
+				fprintf(stderr, "Unable to open file %s, serving it as a miss.\n", item->path);
+			}
+			pthread_mutex_unlock(&fd_lock);
+			if (vanished)
+				_unexport(i);
+			if (vanished && NULL != change_hook)
+				change_hook(item->key);
+			return -1;
 		}
 
+		/* 别的线程可能同时打开了它 */
+		if (item->fildes < 0){
+			item->fildes = newfd;
+			/* 换出后重新打开时文件已经变了: 和 simplecache_revalidate 一样通知 */
+			vanished = (item->mtime.tv_sec != 0 || item->mtime.tv_nsec != 0) &&
+				(item->size != (size_t) statbuf.st_size || item->mtime.tv_sec != statbuf.st_mtim.tv_sec ||
+				item->mtime.tv_nsec != statbuf.st_mtim.tv_nsec);
+			item->size = (size_t) statbuf.st_size;
+			item->mtime = statbuf.st_mtim;
+			newfd = -1;
+			fd_open++;
+			fd_opens++;
+			_lru_push(i);
+		}
 	}
 
-	fclose(filelist);
+	if (lru_head != i){
+		_lru_unlink(i);
+		_lru_push(i);
+	}
+	fd = dup(item->fildes);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
+	while (fd_open > fd_limit && lru_tail != i){
+		int victim = lru_tail;
+		_lru_unlink(victim);
+		close(items[victim].fildes);
+		items[victim].fildes = -1;
+		fd_open--;
+		fd_evictions++;
+	}
+	pthread_mutex_unlock(&fd_lock);
 
-	return EXIT_SUCCESS;
+	if (newfd >= 0)
+		close(newfd);
+	if (vanished && _unexport(i))
+		_export_item(i);
+	if (vanished && NULL != change_hook)
+		change_hook(item->key);
+	return fd;
+}
+
+/* 清单里的 key 不用拿锁; 找不到再看回填的 */
+static int _itemfind(char *key){
+	int i = (int) keyindex_find(&index_by_key, key);
+
+	if (i < 0 && NULL != fill_dir){
+		pthread_mutex_lock(&fill_lock);
+		i = (int) keyindex_find(&fill_index, key);
+		pthread_mutex_unlock(&fill_lock);
+	}
+	return i;
+}
+
+static void _export_name(int i, unsigned int gen, char *name, size_t namelen){
+	/* pid 区分每次启动, gen 区分同一个对象的每次导出, proxy 缓存的旧 fd 不会被新对象顶替 */
+	snprintf(name, namelen, SHM_OBJECT_PREFIX "%d_%d_%u", (int) getpid(), i, gen);
+}
+
+/* 按文件现在的内容换个新名字导出第 i 个对象; 失败的话它退回按拷贝服务 */
+static int _export_item(int i){
+	char name[SHM_NAME_LEN];
+	unsigned int gen;
+	size_t size;
+	int fd, rc;
+
+	if (0 > (fd = _item_fd(i)))
+		return -1;
+	pthread_mutex_lock(&fd_lock);
+	gen = ++items[i].export_gen;
+	size = items[i].size;
+	pthread_mutex_unlock(&fd_lock);
+
+	_export_name(i, gen, name, sizeof(name));
+	rc = shm_object_export(name, fd, size);
+	close(fd);
+	if (0 > rc){
+		fprintf(stderr, "Unable to export %s, it will be served by copy.\n", items[i].path);
+		return -1;
+	}
+	pthread_mutex_lock(&fd_lock);
+	items[i].exported = 1;
+	items[i].export_size = size;
+	pthread_mutex_unlock(&fd_lock);
+	return 0;
+}
+
+/*
+ * 文件变了: 旧对象不能再配上新的大小发出去, 撤掉它.  已经打开了它的 proxy
+ * 还能读完旧内容.  返回它之前是否导出过.
+ */
+static int _unexport(int i){
+	char name[SHM_NAME_LEN];
+	int exported;
+
+	pthread_mutex_lock(&fd_lock);
+	exported = items[i].exported;
+	items[i].exported = 0;
+	_export_name(i, items[i].export_gen, name, sizeof(name));
+	pthread_mutex_unlock(&fd_lock);
+	if (exported)
+		shm_unlink(name);
+	return exported;
 }
 
 int simplecache_get(char *key){
-	int lo = 0;
-	int hi = nitems - 1;
-	int mid, cmp;
+	int i, fd;
 
 	if (cache_delay > 0) {
 		usleep(cache_delay);
 	}
 
-	while (lo <= hi) {
-		// Key is in items[lo..hi] or not present.
-		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
-		if ( cmp < 0) hi = mid - 1;
-		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+	if (0 > (i = _itemfind(key)) || 0 > (fd = _item_fd(i)))
+		return -1;
+
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+/*
+ * 文件在 cache 背后被改了 (大小或修改时间和上次不同) 或者删掉了: 记下新值,
+ * 关掉缓存的 fd (改名替换的话它还指着旧文件), 再通知持有旧副本的一方.
+ * 只看送出去过的对象.
+ */
+int simplecache_revalidate(){
+	struct stat statbuf;
+	int i, n = _nitems(), fd, seen, gone, changed, nchanged = 0;
+
+	for (i = 0; i < n; i++){
+		item_t *item = &items[i];
+
+		pthread_mutex_lock(&fd_lock);
+		seen = !item->missing && (item->mtime.tv_sec != 0 || item->mtime.tv_nsec != 0);
+		pthread_mutex_unlock(&fd_lock);
+		if (!seen)
+			continue;
+
+		gone = 0 > stat(item->path, &statbuf);
+		fd = -1;
+		pthread_mutex_lock(&fd_lock);
+		changed = gone || item->size != (size_t) statbuf.st_size ||
+			item->mtime.tv_sec != statbuf.st_mtim.tv_sec || item->mtime.tv_nsec != statbuf.st_mtim.tv_nsec;
+		if (changed){
+			/* 删掉的话下次打开失败时记成 missing, 不再通知第二次 */
+			item->size = gone ? 0 : (size_t) statbuf.st_size;
+			item->mtime.tv_sec = gone ? 0 : statbuf.st_mtim.tv_sec;
+			item->mtime.tv_nsec = gone ? 0 : statbuf.st_mtim.tv_nsec;
+			if (item->fildes >= 0){
+				_lru_unlink(i);
+				fd = item->fildes;
+				item->fildes = -1;
+				fd_open--;
+			}
+		}
+		pthread_mutex_unlock(&fd_lock);
+
+		if (fd >= 0)
+			close(fd);
+		if (changed){
+			nchanged++;
+			if (NULL != store_evict)
+				_store_drop(i);
+			/* 先换好新对象再通知, proxy 丢掉旧 fd 之后问到的就是新的 */
+			if (_unexport(i) && !gone)
+				_export_item(i);
+			if (NULL != change_hook)
+				change_hook(item->key);
+		}
 	}
-	return -1;
+	return nchanged;
+}
+
+size_t simplecache_fill_admit(char *key){
+	uint64_t h;
+	fill_ghost_t *ghost;
+	size_t limit = 0;
+	time_t now;
+
+	/* 清单里有但是文件没了的 key 也不填, 它归清单管 */
+	if (NULL == fill_dir || 0 <= _itemfind(key))
+		return 0;
+
+	h = keyindex_hash(key);
+	ghost = &fill_ghosts[h % FILL_GHOSTS];
+	now = time(NULL);
+
+	pthread_mutex_lock(&fill_lock);
+	if (ghost->hash != h){
+		ghost->hash = h;
+		ghost->misses = 0;
+		ghost->admitted = 0;
+	}
+	ghost->misses++;
+	/* 准许过的先等那个 proxy 填回来; 它没填 (源站出错或者太大) 的话过一阵再给机会 */
+	if (ghost->misses >= FILL_ADMIT_MISSES && nitems < item_cap && now - ghost->admitted >= FILL_PENDING_SECS){
+		ghost->admitted = now;
+		limit = fill_max_size;
+		fill_admitted++;
+	}
+	pthread_mutex_unlock(&fill_lock);
+	return limit;
+}
+
+int simplecache_fill_open(char *path, size_t pathlen){
+	if (NULL == fill_dir || (size_t) snprintf(path, pathlen, "%s/fill_XXXXXX", fill_dir) >= pathlen)
+		return -1;
+	return mkstemp(path);
+}
+
+int simplecache_fill_add(char *key, char *path){
+	char *k, *p;
+	int i;
+
+	if (NULL == fill_dir)
+		return -1;
+	k = strdup(key);
+	p = strdup(path);
+
+	pthread_mutex_lock(&fill_lock);
+	if (nitems >= item_cap || 0 <= keyindex_find(&index_by_key, key) || 0 <= keyindex_find(&fill_index, key)){
+		fill_rejected++;
+		pthread_mutex_unlock(&fill_lock);
+		free(k);
+		free(p);
+		return -1;
+	}
+	/* 条目先准备好再进索引, 不拿锁的读者看到的 nitems 只会包含完整的条目 */
+	i = nitems;
+	_item_init(i, k, p);
+	if (0 > keyindex_insert(&fill_index, k, i)){
+		fill_rejected++;
+		pthread_mutex_unlock(&fill_lock);
+		free(k);
+		free(p);
+		return -1;
+	}
+	__atomic_store_n(&nitems, i + 1, __ATOMIC_RELEASE);
+	fill_added++;
+	pthread_mutex_unlock(&fill_lock);
+	return 0;
+}
+
+int simplecache_export(){
+	int i, nexported = 0;
+
+	for(i = 0; i < nitems; i++){
+		if (0 == _export_item(i))
+			nexported++;
+	}
+
+	return nexported;
+}
+
+int simplecache_get_export(char *key, char *name, size_t namelen, size_t *size){
+	int i;
+
+	if (cache_delay > 0) {
+		usleep(cache_delay);
+	}
+
+	if (0 > (i = _itemfind(key)))
+		return -1;
+
+	/* 名字和大小要是同一次导出的 */
+	pthread_mutex_lock(&fd_lock);
+	if (!items[i].exported){
+		pthread_mutex_unlock(&fd_lock);
+		return -1;
+	}
+	_export_name(i, items[i].export_gen, name, namelen);
+	*size = items[i].export_size;
+	pthread_mutex_unlock(&fd_lock);
+	return 0;
+}
+
+void simplecache_store_init(size_t budget, int hugepages, int policy){
+	int s;
+
+	store_budget = budget;
+	store_hugepages = hugepages;
+	store_policy = policy;
+	if (budget == 0)
+		return;
+	for (s = 0; s < STORE_STRIPES; s++)
+		pthread_mutex_init(&store_locks[s], NULL);
+	/* 回填进来的对象也能进内存, 所以按 item_cap 分配 */
+	store_evict = evict_create(policy, budget, item_cap);
+}
+
+static pthread_mutex_t *_store_lock(int i){
+	return &store_locks[i % STORE_STRIPES];
+}
+
+/* 大对象优先用 2MB 大页, 拿不到就用普通页并建议内核合并成透明大页 */
+static char *_body_alloc(size_t len, size_t *maplen){
+	char *data;
+
+	*maplen = len;
+	if (store_hugepages && len >= HUGEPAGE_SIZE){
+		*maplen = (len + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+		data = mmap(NULL, *maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+		*maplen = len;
+	}
+
+	data = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	if (store_hugepages)
+		madvise(data, len, MADV_HUGEPAGE);
+	return data;
+}
+
+static void _body_free(simplecache_body_t *body){
+	if (body->len > 0)
+		munmap(body->data, body->maplen);
+	free(body);
+}
+
+/* 把 item 的文件整个读进内存; 失败返回 NULL */
+static simplecache_body_t *_body_load(int fd, size_t len){
+	simplecache_body_t *body = malloc(sizeof(simplecache_body_t));
+	size_t done = 0;
+	ssize_t n;
+
+	body->len = len;
+	body->refs = 0;
+	body->data = NULL;
+	body->maplen = 0;
+	if (len > 0 && NULL == (body->data = _body_alloc(len, &body->maplen))){
+		free(body);
+		return NULL;
+	}
+
+	while (done < len){
+		if (0 >= (n = pread(fd, body->data + done, len - done, done))){
+			_body_free(body);
+			return NULL;
+		}
+		done += n;
+	}
+	return body;
+}
+
+/* 淘汰策略踢掉了 items[i]; 正在发送它的读者手里还有引用, 最后一个放手的释放 */
+static void _store_evicted(int i, void *arg){
+	simplecache_body_t *body;
+
+	pthread_mutex_lock(_store_lock(i));
+	body = items[i].body;
+	items[i].body = NULL;
+	items[i].resident = 0;
+	pthread_mutex_unlock(_store_lock(i));
+
+	if (NULL != body)
+		simplecache_store_put(body);
+}
+
+/*
+ * 把 items[i] 读进内容存储, 返回带引用的副本; 策略不收, 别人正在读或者读失败返回 NULL.
+ * demand = 这是一次请求 (算一次 miss), 不是预热
+ */
+static simplecache_body_t *_store_load(int i, int demand){
+	simplecache_body_t *body;
+	item_t *item = &items[i];
+	pthread_mutex_t *lock = _store_lock(i);
+	size_t len;
+	int fd, installed;
+
+	/* 大小在第一次打开时就知道了 */
+	if (0 > (fd = _item_fd(i)))
+		return NULL;
+	len = item->size;
+	if (demand)
+		evict_miss(store_evict, i, len);
+
+	/* 只有一个线程去读; 别人正在读就走 fd 路径 */
+	pthread_mutex_lock(lock);
+	if (item->loading || NULL != item->body){
+		pthread_mutex_unlock(lock);
+		close(fd);
+		return NULL;
+	}
+	item->loading = 1;
+	item->resident = 1;
+	pthread_mutex_unlock(lock);
+
+	/* 先让策略腾出地方; 它不收的就不读了, 这次也走 fd 路径 */
+	if (0 > evict_insert(store_evict, i, len, _store_evicted, NULL)){
+		pthread_mutex_lock(lock);
+		item->loading = 0;
+		item->resident = 0;
+		pthread_mutex_unlock(lock);
+		close(fd);
+		return NULL;
+	}
+
+	body = _body_load(fd, len);
+	close(fd);
+
+	/* 存储自己拿一个引用, 调用者拿一个 */
+	pthread_mutex_lock(lock);
+	installed = NULL != body && item->resident;
+	if (installed){
+		body->refs = 2;
+		item->body = body;
+		item->loading = 0;
+	}
+	pthread_mutex_unlock(lock);
+
+	if (!installed){
+		/* 读失败了, 或者读的时候被淘汰/作废了; loading 还占着, 不会有别人在这期间重新插入 */
+		evict_remove(store_evict, i);
+		pthread_mutex_lock(lock);
+		item->loading = 0;
+		item->resident = 0;
+		pthread_mutex_unlock(lock);
+		if (NULL != body)
+			body->refs = 1;
+	}
+	return body;
+}
+
+/* 文件变了: 内存里的旧副本作废 */
+static void _store_drop(int i){
+	evict_remove(store_evict, i);
+	_store_evicted(i, NULL);
+}
+
+simplecache_body_t *simplecache_store_get(char *key){
+	simplecache_body_t *body;
+	item_t *item;
+	int i, loading;
+
+	if (NULL == store_evict || 0 > (i = _itemfind(key)))
+		return NULL;
+	item = &items[i];
+
+	pthread_mutex_lock(_store_lock(i));
+	if (NULL != (body = item->body)){
+		__atomic_add_fetch(&body->refs, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(_store_lock(i));
+		evict_hit(store_evict, i, body->len);
+
+		if (cache_delay > 0) {
+			usleep(cache_delay);
+		}
+		return body;
+	}
+	loading = item->loading;
+	pthread_mutex_unlock(_store_lock(i));
+	if (loading){
+		evict_miss(store_evict, i, item->size);
+		return NULL;
+	}
+
+	/* 这次请求本身还是按 miss 算, 由调用者从刚读进来的副本发送 */
+	return _store_load(i, 1);
+}
+
+/* 从一行里取出 key: 第一个以 '/' 开头的词, workload.txt 和 cache 自己的访问日志都能用 */
+static char *_warm_key(char *line){
+	char *tok, *ptr = line;
+
+	while (NULL != (tok = strsep(&ptr, " \t\r\n")))
+		if ('/' == tok[0])
+			return tok;
+	return NULL;
+}
+
+static int *warm_counts;	/* 排序时用: 每个 item 在清单里出现的次数 */
+static int *warm_first;		/* 第一次出现的行号, 次数一样时先出现的先热 */
+
+static int _warmcmp(const void *a, const void *b){
+	int i = *(const int*) a, j = *(const int*) b;
+	if (warm_counts[i] != warm_counts[j])
+		return warm_counts[j] - warm_counts[i];
+	return warm_first[i] - warm_first[j];
+}
+
+int simplecache_prewarm(const char *filename, size_t budget, size_t *bytes){
+	static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+	FILE *list;
+	char *line = NULL, *key;
+	size_t linecap = 0, used = 0;
+	int *order, norder = 0, nwarmed = 0, lineno = 0, i, j, fd, n = _nitems();
+
+	*bytes = 0;
+	if (NULL == (list = fopen(filename, "r")))
+		return -1;
+
+	pthread_mutex_lock(&warm_lock);
+	warm_counts = calloc(n ? n : 1, sizeof(int));
+	warm_first = calloc(n ? n : 1, sizeof(int));
+	order = malloc((n ? n : 1) * sizeof(int));
+
+	/* 同一个 key 出现得越多越热 */
+	while (0 < getline(&line, &linecap, list)){
+		lineno++;
+		/* 这一轮开始之后才回填进来的不管 */
+		if (NULL == (key = _warm_key(line)) || 0 > (i = _itemfind(key)) || i >= n)
+			continue;
+		if (0 == warm_counts[i]++){
+			warm_first[i] = lineno;
+			order[norder++] = i;
+		}
+	}
+	free(line);
+	fclose(list);
+	qsort(order, norder, sizeof(int), _warmcmp);
+
+	for (j = 0; j < norder; j++){
+		simplecache_body_t *body;
+		i = order[j];
+
+		/* 先打开, 才知道多大; 超出预算的跳过, 后面小的还能放进来 */
+		if (0 > (fd = _item_fd(i)))
+			continue;
+		if (budget > 0 && used + items[i].size > budget){
+			close(fd);
+			continue;
+		}
+
+		/* 开了内容存储就直接读进内存 (只填到它的预算, 再多就会挤掉刚读进来的热对象),
+		 * 否则只让内核把它读进页缓存 */
+		if (NULL != store_evict && used + items[i].size <= store_budget && NULL != (body = _store_load(i, 0))){
+			simplecache_store_put(body);
+		} else if (0 != posix_fadvise(fd, 0, items[i].size, POSIX_FADV_WILLNEED)){
+			close(fd);
+			continue;
+		}
+		close(fd);
+		used += items[i].size;
+		nwarmed++;
+	}
+
+	free(order);
+	free(warm_counts);
+	free(warm_first);
+	pthread_mutex_unlock(&warm_lock);
+
+	*bytes = used;
+	return nwarmed;
+}
+
+void simplecache_store_put(simplecache_body_t *body){
+	if (0 == __atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL))
+		_body_free(body);
+}
+
+void simplecache_store_print_stats(FILE *out){
+	if (NULL != store_evict){
+		evict_stats_t st;
+		evict_get_stats(store_evict, &st);
+		fprintf(out, "[STORE] policy=%s budget=%zu used=%zu hits=%lu misses=%lu hit_ratio=%.3f bytes_saved=%llu "
+			"inserts=%lu rejected=%lu evictions=%lu skipped=%lu\n",
+			evict_policy_name(store_policy), st.budget, st.used, st.hits, st.misses,
+			st.hits + st.misses ? (double) st.hits / (st.hits + st.misses) : 0.0, st.bytes_hit,
+			st.inserts, st.rejects, st.evictions, st.skipped);
+	}
+
+	pthread_mutex_lock(&fd_lock);
+	fprintf(out, "[FDS] open=%d limit=%d opens=%lu evictions=%lu missing=%lu\n",
+		fd_open, fd_limit, fd_opens, fd_evictions, fd_missing);
+	pthread_mutex_unlock(&fd_lock);
+
+	if (NULL == fill_dir)
+		return;
+	pthread_mutex_lock(&fill_lock);
+	fprintf(out, "[FILL] objects=%d limit=%d max_size=%zu admitted=%lu added=%lu rejected=%lu\n",
+		nitems - nmanifest, fill_max_objects, fill_max_size, fill_admitted, fill_added, fill_rejected);
+	pthread_mutex_unlock(&fill_lock);
 }
 
 void simplecache_destroy(){
 	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
+	char name[SHM_NAME_LEN];
+	for(i = 0; i < nitems; i++){
+		if (items[i].fildes >= 0)
+			close(items[i].fildes);
+		if (items[i].body)
+			_body_free(items[i].body);
+		if (items[i].exported){
+			_export_name(i, items[i].export_gen, name, sizeof(name));
+			shm_unlink(name);
+		}
+		/* 回填的文件不在任何清单里, 下次启动也找不回来 */
+		if (i >= nmanifest){
+			unlink(items[i].path);
+			free((char*) items[i].key);
+			free((char*) items[i].path);
+		}
+	}
 	
 	free(items);
+	free(manifest);
+	if (NULL != store_evict)
+		evict_destroy(store_evict);
+	keyindex_destroy(&index_by_key);
+	if (NULL != fill_dir)
+		keyindex_destroy(&fill_index);
 }
@@ -1,23 +1,145 @@
 #ifndef _SIMPLECACHE_H_
 #define _SIMPLECACHE_H_
 
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * An object body held in the in-memory content store.  data stays
+ * valid while the caller holds a reference from simplecache_store_get,
+ * even if the body is evicted in the meantime.
+ */
+typedef struct {
+	char *data;
+	size_t len;
+	size_t maplen;
+	int refs;
+} simplecache_body_t;
+
 /* 
  * Initializes the input cache given the information from
  * the provided file.  Each row of the file is assumed
  * to contain a key and a file path separated by a space.
- * Subsequent calls to simplecache_get with a key value
- * as an argument will return the file descriptor for the 
- * given file path.
+ * Files are not opened here; each one is opened the first
+ * time its key is requested.  Large files are parsed by
+ * several threads.
  */
 int simplecache_init(char *filename);
 
+/*
+ * Caps how many cached files are kept open at once; the least
+ * recently used one is closed when the cap is exceeded.  The
+ * default is half of RLIMIT_NOFILE.  Call before simplecache_init.
+ */
+void simplecache_set_fd_limit(int limit);
+
+/*
+ * Lets the cache learn objects it misses on: up to max_objects keys
+ * admitted by simplecache_fill_admit can be added afterwards with
+ * simplecache_fill_add, each with a body of at most max_size bytes
+ * kept as a file under dir.  Call before simplecache_init.
+ */
+void simplecache_set_fill(char *dir, int max_objects, size_t max_size);
+
+/*
+ * Records a miss on key and decides whether it should be filled.  A
+ * key is admitted on its second miss while there is room, and not
+ * again for a while after that so only one proxy fetches it.  Returns
+ * the largest body the cache will take, or 0 to leave key alone.
+ */
+size_t simplecache_fill_admit(char *key);
+
+/*
+ * Creates an empty file under the fill directory for a new body.
+ * Returns a descriptor open for writing and writes the file's path to
+ * path, or returns -1.
+ */
+int simplecache_fill_open(char *path, size_t pathlen);
+
+/*
+ * Publishes the complete file at path as the body of key.  Returns 0,
+ * or -1 if key is already known or the cache is full; the caller then
+ * removes the file.
+ */
+int simplecache_fill_add(char *key, char *path);
+
+/*
+ * Registers a function called with a key whose file changed size or
+ * modification time since it was last served, or disappeared after
+ * having been served.
+ */
+void simplecache_set_change_hook(void (*hook)(const char *key));
+
+/*
+ * Stats the file of every key served so far and reports the ones that
+ * changed to the change hook; their cached descriptors are closed so
+ * the next request opens the new file, and an exported object is
+ * exported again under a new name.  Returns the number changed.
+ */
+int simplecache_revalidate();
+
 /* 
- * Returns the file descriptor associated with the input key.
+ * Returns a new file descriptor for the file associated with the
+ * input key, or -1 if the key is unknown or its file cannot be
+ * opened.  The caller owns the descriptor and must close it.
  */
 int simplecache_get(char *key);
 
+/*
+ * Copies every cached file into its own read-only shared memory
+ * object so that proxies can map it and send straight from the
+ * mapping.  Returns the number of objects exported.
+ */
+int simplecache_export();
+
+/*
+ * Looks up the exported object for the input key.  On success the
+ * object name is written to name, its length to size, and 0 is
+ * returned; -1 if the key is unknown or was not exported.  A changed
+ * file gets a new name, so a name always goes with the same bytes.
+ */
+int simplecache_get_export(char *key, char *name, size_t namelen, size_t *size);
+
+/*
+ * Enables the in-memory content store with a budget of budget bytes
+ * (0 = off), evicting with policy, one of the evict.h policies, once
+ * it is full.  With hugepages set, bodies of 2MB or more are placed on
+ * huge pages when the system has them reserved, and on transparent
+ * huge pages otherwise.  Call after simplecache_init.
+ */
+void simplecache_store_init(size_t budget, int hugepages, int policy);
+
+/*
+ * Returns a referenced in-memory copy of the body for the input key,
+ * loading it first if the eviction policy admits it.  Returns NULL
+ * when the caller should read from the file descriptor instead.
+ * Every non-NULL result must be handed back to simplecache_store_put.
+ */
+simplecache_body_t *simplecache_store_get(char *key);
+
+void simplecache_store_put(simplecache_body_t *body);
+
+/*
+ * Prefetches the objects named in filename, hottest first.  Each line
+ * contributes the first word that starts with '/', so both
+ * workload.txt and a recorded access log work; a key listed more often
+ * is hotter.  Objects go into the content store when it is enabled and
+ * into the page cache otherwise, until budget bytes (0 = no limit)
+ * have been read.  Returns the number of objects warmed and stores
+ * their total size in bytes, or -1 if filename cannot be opened.
+ */
+int simplecache_prewarm(const char *filename, size_t budget, size_t *bytes);
+
+/*
+ * Prints the policy, hit ratio and bytes saved of the content store, the
+ * open, eviction and missing-file counters of the fd cache and the
+ * admission counters of the fill path.
+ */
+void simplecache_store_print_stats(FILE *out);
+
 /* 
- * Frees all memory and closes all file descriptors that are associated with the cache
+ * Frees all memory and closes all file descriptors that are associated with the cache,
+ * and unlinks any exported objects and filled files
  */
 void simplecache_destroy();
 
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "keyindex.h"
+
+/*
+ * 比较 simplecache 原来的查找 (1018 字节内联 key 的有序数组 + strcmp 二分)
+ * 和 keyindex (开放寻址 + 预算哈希 + key arena).  key 是合成的 URL 路径.
+ */
+
+#define MAX_KEYLEN 1018
+#define KEY_FMT "/courses/ud923/filecorpus/%lu/object-%lu.bin"
+#define KEY_STRIDE 80	/* 预先生成的查找 key 每个占的字节数 */
+
+#define USAGE                                                                 \
+"usage:\n"                                                                    \
+"  simplecache_bench [options]\n"                                             \
+"options:\n"                                                                  \
+"  -n [nkeys]          Run a single size instead of 10K, 1M and 10M\n"         \
+"  -l [lookups]        Lookups per run (Default: 1000000)\n"                  \
+"  -h                  Show this help message\n"
+
+static struct option gLongOptions[] = {
+  {"nkeys",        required_argument,      NULL,           'n'},
+  {"lookups",      required_argument,      NULL,           'l'},
+  {"help",         no_argument,            NULL,           'h'},
+  {NULL,           0,                      NULL,             0}
+};
+
+/* 原来 simplecache.c 里的条目布局 */
+typedef struct{
+	int fildes;
+	int exported;
+	size_t size;
+	void *body;
+	int loading;
+	char key[MAX_KEYLEN];
+} old_item_t;
+
+static int _itemcmp(const void *a, const void *b){
+	return strcmp(((old_item_t*) a)->key,((old_item_t*) b)->key);
+}
+
+static int _itemfind(old_item_t *items, int nitems, char *key){
+	int lo = 0;
+	int hi = nitems - 1;
+	int mid, cmp;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(key,items[mid].key);
+		if ( cmp < 0) hi = mid - 1;
+		else if (cmp > 0) lo = mid + 1;
+		else return mid;
+	}
+	return -1;
+}
+
+static double _now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 把 n 打散, 免得 key 的顺序和插入顺序一样 */
+static unsigned long _mix(unsigned long n){
+	n ^= n >> 31;
+	n *= 0x7fb5d329728ea185UL;
+	n ^= n >> 27;
+	return n;
+}
+
+static void _make_key(char *buf, unsigned long n){
+	unsigned long m = _mix(n);
+	snprintf(buf, KEY_STRIDE, KEY_FMT, m % 997, m);
+}
+
+/* 查找用的 key 先生成好, 计时里只剩查找本身 */
+static char *_make_lookups(unsigned long lookups, unsigned long nkeys, int hits){
+	char *keys = malloc(lookups * KEY_STRIDE);
+	unsigned long i;
+
+	for (i = 0; i < lookups; i++)
+		_make_key(keys + i * KEY_STRIDE, hits ? _mix(i + 1) % nkeys : nkeys + i);
+	return keys;
+}
+
+static void _bench_old(unsigned long nkeys, unsigned long lookups, char *hit_keys){
+	size_t bytes = nkeys * sizeof(old_item_t);
+	long pages = sysconf(_SC_PHYS_PAGES);
+	unsigned long i, found = 0;
+	double t0, t1, t2;
+
+	if (pages > 0 && bytes > (size_t) pages * sysconf(_SC_PAGESIZE) / 2){
+		printf("  sorted array: skipped, needs %zu MB\n", bytes >> 20);
+		return;
+	}
+
+	old_item_t *items = malloc(bytes);
+	if (NULL == items){
+		printf("  sorted array: skipped, out of memory\n");
+		return;
+	}
+
+	t0 = _now();
+	for (i = 0; i < nkeys; i++){
+		memset(&items[i], 0, offsetof(old_item_t, key));
+		_make_key(items[i].key, i);
+	}
+	qsort(items, nkeys, sizeof(old_item_t), _itemcmp);
+	t1 = _now();
+	for (i = 0; i < lookups; i++)
+		found += _itemfind(items, (int) nkeys, hit_keys + i * KEY_STRIDE) >= 0;
+	t2 = _now();
+
+	printf("  sorted array: build %8.1f ms  lookup %7.1f ns  (%lu/%lu found, %zu MB)\n",
+		(t1 - t0) * 1e3, (t2 - t1) * 1e9 / lookups, found, lookups, bytes >> 20);
+	free(items);
+}
+
+static void _bench_index(unsigned long nkeys, unsigned long lookups, char *hit_keys, char *miss_keys){
+	keyindex_t index;
+	char key[KEY_STRIDE];
+	unsigned long i, found = 0, missed = 0;
+	double t0, t1, t2, t3;
+
+	t0 = _now();
+	keyindex_init(&index, nkeys);
+	for (i = 0; i < nkeys; i++){
+		_make_key(key, i);
+		if (0 > keyindex_insert(&index, key, (uint32_t) i)){
+			printf("  keyindex: arena full after %lu keys\n", i);
+			keyindex_destroy(&index);
+			return;
+		}
+	}
+	t1 = _now();
+	for (i = 0; i < lookups; i++)
+		found += keyindex_find(&index, hit_keys + i * KEY_STRIDE) >= 0;
+	t2 = _now();
+	for (i = 0; i < lookups; i++)
+		missed += keyindex_find(&index, miss_keys + i * KEY_STRIDE) < 0;
+	t3 = _now();
+
+	printf("  keyindex:     build %8.1f ms  lookup %7.1f ns  (%lu/%lu found, %zu MB)\n",
+		(t1 - t0) * 1e3, (t2 - t1) * 1e9 / lookups, found, lookups,
+		((index.mask + 1) * sizeof(keyindex_slot_t) + index.arena_cap) >> 20);
+	printf("  keyindex:     miss lookup %7.1f ns  (%lu/%lu missed)\n",
+		(t3 - t2) * 1e9 / lookups, missed, lookups);
+	keyindex_destroy(&index);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+	unsigned long sizes[] = {10000, 1000000, 10000000};
+	int nsizes = 3;
+	unsigned long lookups = 1000000;
+	int option_char, i;
+	char *hit_keys, *miss_keys;
+
+	while ((option_char = getopt_long(argc, argv, "n:l:h", gLongOptions, NULL)) != -1) {
+		switch (option_char) {
+			case 'n':
+				sizes[0] = strtoul(optarg, NULL, 10);
+				nsizes = 1;
+				break;
+			case 'l':
+				lookups = strtoul(optarg, NULL, 10);
+				break;
+			case 'h': // help
+				printf(USAGE);
+				exit(0);
+				break;
+			default:
+				fprintf(stderr, "%s", USAGE);
+				exit(__LINE__);
+		}
+	}
+
+	if (lookups == 0 || sizes[0] == 0 || sizes[0] > UINT32_MAX) {
+		fprintf(stderr, "Invalid number of keys or lookups\n");
+		exit(__LINE__);
+	}
+
+	for (i = 0; i < nsizes; i++){
+		hit_keys = _make_lookups(lookups, sizes[i], 1);
+		miss_keys = _make_lookups(lookups, sizes[i], 0);
+		printf("%lu keys:\n", sizes[i]);
+		_bench_old(sizes[i], lookups, hit_keys);
+		_bench_index(sizes[i], lookups, hit_keys, miss_keys);
+		free(hit_keys);
+		free(miss_keys);
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simplecache.h"
+#include "shm_channel.h"
+
+/*
+ * simplecache 导出 (-e) 的回归测试: 文件在 cache 背后被改了之后,
+ * simplecache_revalidate 要换个名字重新导出, simplecache_get_export
+ * 给出的名字和大小必须对得上对象里的内容.
+ */
+
+unsigned long int cache_delay;
+
+static int failures;
+static int changes;
+
+#define CHECK(cond) do { \
+	if (!(cond)){ \
+		fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void _on_change(const char *key){
+	(void) key;
+	changes++;
+}
+
+static void _write_file(const char *path, int flags, char c, size_t len){
+	char buf[4096];
+	int fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+	size_t done = 0;
+
+	memset(buf, c, sizeof(buf));
+	while (fd >= 0 && done < len){
+		size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+		if (write(fd, buf, n) != (ssize_t) n)
+			break;
+		done += n;
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+/* 对象 name 的内容是不是正好等于文件 path */
+static int _same_bytes(const char *name, const char *path, size_t size){
+	int objfd = shm_object_open(name), fd = open(path, O_RDONLY), same = 0;
+	char *a = malloc(size + 1), *b = malloc(size + 1);
+
+	if (objfd >= 0 && fd >= 0 && a != NULL && b != NULL &&
+	    pread(objfd, a, size + 1, 0) == (ssize_t) size && pread(fd, b, size + 1, 0) == (ssize_t) size)
+		same = memcmp(a, b, size) == 0;
+	if (objfd >= 0)
+		close(objfd);
+	if (fd >= 0)
+		close(fd);
+	free(a);
+	free(b);
+	return same;
+}
+
+int main(int argc, char **argv){
+	char dir[] = "/tmp/simplecache_test_XXXXXX";
+	char path[PATH_MAX], manifest[PATH_MAX];
+	char name[SHM_NAME_LEN], old_name[SHM_NAME_LEN];
+	size_t size;
+	int fd, oldfd;
+	FILE *f;
+
+	(void) argc;
+	(void) argv;
+	if (NULL == mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/road.jpg", dir);
+	snprintf(manifest, sizeof(manifest), "%s/locals.txt", dir);
+	_write_file(path, O_TRUNC, 'a', 138177);
+	if (NULL == (f = fopen(manifest, "w"))){
+		perror("fopen");
+		return 1;
+	}
+	fprintf(f, "/road.jpg %s\n", path);
+	fclose(f);
+
+	simplecache_set_change_hook(_on_change);
+	CHECK(0 == simplecache_init(manifest));
+	CHECK(1 == simplecache_export());
+	CHECK(0 == simplecache_get_export("/road.jpg", name, sizeof(name), &size));
+	CHECK(138177 == size);
+	CHECK(_same_bytes(name, path, size));
+	if (0 <= (fd = simplecache_get("/road.jpg")))
+		close(fd);
+
+	/* proxy 手里还开着旧对象 */
+	strncpy(old_name, name, sizeof(old_name));
+	oldfd = shm_object_open(old_name);
+	CHECK(oldfd >= 0);
+
+	/* 追加 5000 字节: 大小变了, 要换新对象 */
+	_write_file(path, O_APPEND, 'b', 5000);
+	CHECK(1 == simplecache_revalidate());
+	CHECK(1 == changes);
+	CHECK(0 == simplecache_get_export("/road.jpg", name, sizeof(name), &size));
+	CHECK(143177 == size);
+	CHECK(0 != strcmp(name, old_name));
+	CHECK(_same_bytes(name, path, size));
+	CHECK(0 > shm_object_open(old_name) && ENOENT == errno);
+
+	/* 打开着的旧对象照样能读完旧内容 */
+	if (oldfd >= 0){
+		struct stat statbuf;
+		CHECK(0 == fstat(oldfd, &statbuf) && 138177 == statbuf.st_size);
+		close(oldfd);
+	}
+
+	/* 没变就不换 */
+	strncpy(old_name, name, sizeof(old_name));
+	CHECK(0 == simplecache_revalidate());
+	CHECK(0 == simplecache_get_export("/road.jpg", name, sizeof(name), &size));
+	CHECK(0 == strcmp(name, old_name));
+
+	/* 删掉之后不再导出 */
+	unlink(path);
+	CHECK(1 == simplecache_revalidate());
+	CHECK(0 > simplecache_get_export("/road.jpg", name, sizeof(name), &size));
+	CHECK(0 > shm_object_open(old_name));
+
+	simplecache_destroy();
+	unlink(manifest);
+	rmdir(dir);
+
+	printf("simplecache_test: %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
@@ -3,6 +3,7 @@
 #include <printf.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <limits.h>
 #include <sys/signal.h>
 #include <stdlib.h>
@@ -13,131 +14,674 @@
 #include "cache-student.h"
 #include "shm_channel.h"
 #include "simplecache.h"
+#include "evict.h"
 #include "gfserver.h"
 #include "steque.h"
+#include "cache_ctl.h"
+#include "uring_engine.h"
 #include <sys/un.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <dirent.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
 // CACHE_FAILURE
 #if !defined(CACHE_FAILURE)
     #define CACHE_FAILURE (-1)
 #endif 
 
-#define MAX_CACHE_REQUEST_LEN 6100
+#define MAX_EPOLL_EVENTS 64
+#define PROXY_GRACE_MS 2000	// 连接全断之后至少等这么久, 进程也不在了才清理这个 proxy
 #define MAX_SIMPLE_CACHE_QUEUE_SIZE 782  
 
-#define SOCKET_PATH "/tmp/cache_socket"
-
 unsigned long int cache_delay;
+static int export_objects;
+static size_t fill_max_size;	// 0 = 不学 proxy 回源取到的对象
+
+// 预热: 启动时跑一次, 之后每收到一个 SIGUSR1 再跑一次
+static char *warm_list;
+static size_t warm_budget;
+static sem_t warm_requested;
 
 static int server_fd;
-static steque_t request_queue;
 static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static int job_efd = -1;		// io_uring 模式: ready_jobs 非空时可读
+static int job_efd_signaled;	// 受 queue_lock 保护
+static steque_t ready_jobs;		// io_uring 模式: 查好了来源, 等引擎线程开始传输的 uring_job_t; 受 queue_lock 保护
+
+// 一个报到过的 proxy 进程; 它的所有连接共用一个请求队列
+typedef struct cache_proxy_t {
+	int pid;
+	char ns[SHM_NAME_LEN];	// 段名前缀, 这个 proxy 的段都叫 "<ns>_..."
+	int nconns;
+	int inflight;			// 已经被 worker 取走还没做完的请求
+	int gone;				// 进程已经不在了, 不再服务; 最后一个 inflight 负责释放
+	long long orphaned_ms;	// 连接全断的时刻 (CLOCK_MONOTONIC), 0 = 还有连接
+	unsigned long served;
+	unsigned long notified;	// boss 线程用: 最近一次收到作废通知的轮次
+	steque_t tasks;
+	struct cache_proxy_t *next;
+} cache_proxy_t;
+
+// 以下都受 queue_lock 保护
+static cache_proxy_t *proxies;
+static steque_t ready_proxies;	// tasks 非空的 proxy, worker 轮流各取一个请求
 
 typedef struct {
-    char shm_name[64];
-    char key[1024];
+	uint16_t type;			// CTL_GET 或 CTL_FILL
+    char shm_name[SHM_NAME_LEN];
+    char key[CTL_MAX_KEYLEN];
 	size_t segment_size;
+	unsigned int req_id;
+	uint32_t generation;
+	cache_proxy_t *proxy;
 } cache_task_t;
 
+// 一条 proxy 长连接上还没凑成完整帧的字节
+typedef struct ctl_client_t {
+	int fd;
+	cache_proxy_t *proxy;	// NULL = 还没报到
+	size_t len;
+	char buf[CTL_MAX_FRAME_LEN];
+	struct ctl_client_t *next;	// boss 线程的连接表
+} ctl_client_t;
+
+// 文件被改过的 key 和 attach 不上段的请求, 等 boss 线程转告各个 proxy; 受 queue_lock 保护
+static steque_t changed_keys;
+static steque_t failed_tasks;
+static int boss_efd = -1;	// 上面两个队列有东西时可读
+static volatile sig_atomic_t stop_signal;	// SIGINT/SIGTERM 置上, boss 线程退出循环后做清理
+static int orphans;			// 连接全断但还没清理的 proxy 数
+
+// 段名必须在 proxy 自己的前缀下, 不能碰别的 proxy 的段
+static int _owns_segment(const cache_proxy_t *proxy, const char *shm_name) {
+	size_t len = strlen(proxy->ns);
+	return strncmp(shm_name, proxy->ns, len) == 0 && shm_name[len] == '_';
+}
+
+static void _enqueue_request(cache_proxy_t *proxy, const ctl_request_t *req) {
+	cache_task_t *task = malloc(sizeof(cache_task_t));
+	task->type = req->type;
+	strncpy(task->shm_name, req->shm_name, sizeof(task->shm_name));
+	strncpy(task->key, req->key, sizeof(task->key));
+	task->segment_size = req->segsize;
+	task->req_id = req->req_id;
+	task->generation = req->generation;
+	task->proxy = proxy;
+
+	pthread_mutex_lock(&queue_lock);
+	if (steque_isempty(&proxy->tasks)) {
+		steque_enqueue(&ready_proxies, proxy);
+	}
+	steque_enqueue(&proxy->tasks, task);
+	pthread_cond_signal(&queue_not_empty);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// CTL_REGISTER: 同一个 proxy 的连接挂到同一个条目上; 前缀被别的进程占着就拒绝
+static cache_proxy_t* _register_proxy(const ctl_request_t *req) {
+	cache_proxy_t *proxy;
+
+	if (req->shm_name[0] != '/') return NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	for (proxy = proxies; proxy != NULL; proxy = proxy->next) {
+		if (strcmp(proxy->ns, req->shm_name) == 0) break;
+	}
+	if (proxy != NULL && proxy->pid != (int)req->req_id) {
+		pthread_mutex_unlock(&queue_lock);
+		return NULL;
+	}
+	if (proxy != NULL && proxy->orphaned_ms != 0) {
+		// 只是连接断过, 进程一直在; 段照常用, proxy 自己会换掉被它中止过的段
+		proxy->orphaned_ms = 0;
+		orphans--;
+		printf("[CACHE] proxy %d reconnected (%s)\n", proxy->pid, proxy->ns);
+	}
+	if (proxy == NULL) {
+		proxy = calloc(1, sizeof(cache_proxy_t));
+		proxy->pid = req->req_id;
+		strncpy(proxy->ns, req->shm_name, sizeof(proxy->ns) - 1);
+		steque_init(&proxy->tasks);
+		proxy->next = proxies;
+		proxies = proxy;
+		printf("[CACHE] proxy %d registered (%s)\n", proxy->pid, proxy->ns);
+	}
+	proxy->nconns++;
+	pthread_mutex_unlock(&queue_lock);
+	return proxy;
+}
+
+// 把 proxy 已经不在了的段从 /dev/shm 里删掉 (被 kill -9 的 proxy 来不及自己删)
+static void _unlink_proxy_segments(const char *prefix) {
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *ent;
+	char name[sizeof(ent->d_name) + 1];
+
+	if (dir == NULL) return;
+	while ((ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, prefix + 1, strlen(prefix + 1)) != 0) continue;
+		snprintf(name, sizeof(name), "/%s", ent->d_name);
+		shm_unlink(name);
+	}
+	closedir(dir);
+}
+
+static long long _now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// 一条连接断了. 最后一条断了也不等于 proxy 退出了 (可能只是 cache 这边把连接关了, 它正在重连),
+// 先记下时刻, 由 _reap_proxies 在宽限期过后确认进程不在了再清理
+static void _proxy_disconnect(cache_proxy_t *proxy) {
+	pthread_mutex_lock(&queue_lock);
+	if (--proxy->nconns == 0) {
+		proxy->orphaned_ms = _now_ms();
+		orphans++;
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// proxy 进程已经不在了: 清掉它的队列和段; 调用者持有 queue_lock, 返回时已经释放
+static void _proxy_teardown(cache_proxy_t *proxy) {
+	char prefix[SHM_NAME_LEN + 1];
+	int pid, dropped = 0, release;
+	unsigned long served;
+
+	proxy->gone = 1;
+	for (cache_proxy_t **link = &proxies; *link != NULL; link = &(*link)->next) {
+		if (*link == proxy) {
+			*link = proxy->next;
+			break;
+		}
+	}
+	if (!steque_isempty(&proxy->tasks)) {
+		int n = steque_size(&ready_proxies);
+		for (int i = 0; i < n; i++) {
+			if (steque_front(&ready_proxies) == proxy) steque_pop(&ready_proxies);
+			else steque_cycle(&ready_proxies);
+		}
+	}
+	while (!steque_isempty(&proxy->tasks)) {
+		free(steque_pop(&proxy->tasks));
+		dropped++;
+	}
+	steque_destroy(&proxy->tasks);
+
+	snprintf(prefix, sizeof(prefix), "%s_", proxy->ns);
+	pid = proxy->pid;
+	served = proxy->served;
+	release = (proxy->inflight == 0);
+	pthread_mutex_unlock(&queue_lock);
+
+	// 正在给它写的 worker 被叫醒后放弃, 不会卡在没人读的 ring 上
+	shm_attach_retire_prefix(prefix);
+	_unlink_proxy_segments(prefix);
+	printf("[CACHE] proxy %d gone: served %lu, dropped %d queued requests\n", pid, served, dropped);
+	if (release) free(proxy);
+}
+
+// boss 线程定期调用: 宽限期已过并且进程确实不在了 (kill 报 ESRCH) 的 proxy 清理掉; 还活着的接着等它重连
+static void _reap_proxies(void) {
+	long long now = _now_ms();
+
+restart:
+	pthread_mutex_lock(&queue_lock);
+	for (cache_proxy_t *proxy = proxies; proxy != NULL; proxy = proxy->next) {
+		if (proxy->orphaned_ms == 0 || now - proxy->orphaned_ms < PROXY_GRACE_MS) continue;
+		if (kill(proxy->pid, 0) == 0 || errno != ESRCH) {
+			proxy->orphaned_ms = now;
+			continue;
+		}
+		orphans--;
+		_proxy_teardown(proxy); // 会改链表并释放锁, 从头再来
+		goto restart;
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// worker 做完 (或放弃) 一个请求
+static void _task_done(cache_task_t *task) {
+	cache_proxy_t *proxy = task->proxy;
+
+	pthread_mutex_lock(&queue_lock);
+	proxy->served++;
+	if (--proxy->inflight == 0 && proxy->gone) {
+		free(proxy);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	free(task);
+}
+
+// simplecache 发现文件变了 (在 worker 线程里); 连接归 boss 管, 交给它去发
+static void _object_changed(const char *key) {
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&queue_lock);
+	steque_enqueue(&changed_keys, strdup(key));
+	pthread_mutex_unlock(&queue_lock);
+	ssize_t w = write(boss_efd, &one, sizeof(one));
+	(void)w;
+}
+
+// 段 attach 不上, 没法在 ring 里回复: 交给 boss 线程发 CTL_ABORT, 等在这个段上的 proxy worker 马上失败.
+// task 留到发完才结束, 这期间 proxy 条目不会被释放
+static void _task_failed(cache_task_t *task) {
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&queue_lock);
+	steque_enqueue(&failed_tasks, task);
+	pthread_mutex_unlock(&queue_lock);
+	ssize_t w = write(boss_efd, &one, sizeof(one));
+	(void)w;
+}
+
+// boss 线程: 在请求来源的 proxy 的任意一条连接上发 CTL_ABORT; 不阻塞, 发不出去就算了,
+// 只发出半帧的话 proxy 会断开重连, 等待的 worker 一样会因为连接断过而失败
+static void _send_abort(ctl_client_t *clients, cache_task_t *task) {
+	ctl_request_t req;
+	char frame[CTL_MAX_FRAME_LEN];
+
+	memset(&req, 0, sizeof(req));
+	req.type = CTL_ABORT;
+	req.req_id = task->req_id;
+	req.segsize = task->segment_size;
+	req.generation = task->generation;
+	strncpy(req.shm_name, task->shm_name, sizeof(req.shm_name) - 1);
+	int len = ctl_encode(&req, frame, sizeof(frame));
+	if (len < 0) return;
+
+	for (ctl_client_t *client = clients; client != NULL; client = client->next) {
+		if (client->proxy != task->proxy) continue;
+		if (send(client->fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len) return;
+	}
+}
+
+// 给每个 proxy 的某一条连接发一帧 CTL_INVALIDATE. 不阻塞: 发不出去就换它的下一条连接;
+// 只发出去半帧的话 proxy 会当坏帧断开重连, 重连时它会清空整个 L1
+static void _notify_proxies(ctl_client_t *clients, const char *key, unsigned long round) {
+	ctl_request_t req;
+	char frame[CTL_MAX_FRAME_LEN];
+
+	memset(&req, 0, sizeof(req));
+	req.type = CTL_INVALIDATE;
+	strncpy(req.key, key, sizeof(req.key) - 1);
+	int len = ctl_encode(&req, frame, sizeof(frame));
+	if (len < 0) return;
+
+	for (ctl_client_t *client = clients; client != NULL; client = client->next) {
+		if (client->proxy == NULL || client->proxy->notified == round) continue;
+		if (send(client->fd, frame, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len) client->proxy->notified = round;
+	}
+}
+
 static void _sig_handler(int signo){
+	if (signo == SIGUSR1){
+		sem_post(&warm_requested); // 信号处理函数里只能做这种事, 真正的预热在后台线程
+		return;
+	}
 	if (signo == SIGTERM || signo == SIGINT){
-		// This is where your IPC clean up should occur
-		unlink(SOCKET_PATH);
-        if (server_fd > 0) close(server_fd);
-		simplecache_destroy();
-		exit(signo);
+		// 和 SIGUSR1 一样只留个记号, 统计和清理由 boss 线程在 main 里做
+		uint64_t one = 1;
+		stop_signal = signo;
+		if (boss_efd >= 0) {
+			ssize_t r = write(boss_efd, &one, sizeof(one));
+			(void)r;
+		}
 	}
 }
 
-static void* _worker_thread(void *arg) {
-	printf("[DEBUG] Cache worker thread started\n");
+static void* _warm_thread(void *arg) {
+	(void)arg;
+	while (1) {
+		size_t bytes;
+		int n = simplecache_prewarm(warm_list, warm_budget, &bytes);
+		if (n < 0) fprintf(stderr, "[CACHE] unable to read warm list %s\n", warm_list);
+		else printf("[CACHE] prewarmed %d objects, %zu bytes\n", n, bytes);
 
-    (void)arg;
-    while (1) {
-        pthread_mutex_lock(&queue_lock);
-        while (steque_isempty(&request_queue)) {
-            pthread_cond_wait(&queue_not_empty, &queue_lock);
-        }
+		while (sem_wait(&warm_requested) < 0 && errno == EINTR)
+			;
+	}
+	return NULL;
+}
 
-        cache_task_t *task = steque_pop(&request_queue);
-        pthread_mutex_unlock(&queue_lock);
+// 定期检查送出去过的文件有没有被改; 改了的由 _object_changed 转告 proxy
+static void* _revalidate_thread(void *arg) {
+	unsigned int secs = (unsigned int)(long) arg;
+	while (1) {
+		sleep(secs);
+		simplecache_revalidate();
+	}
+	return NULL;
+}
 
-		printf("[CACHE-WORKER] Handling %s (shm: %s, size: %zu)\n", task->key, task->shm_name, task->segment_size);
+// 一个空的最后一块: miss, 或者零拷贝交付只需要段头里的对象名
+static void _post_empty(shm_payload_t* payload) {
+    shm_slot_t* slot = shm_ring_begin_write(payload);
+    if (slot == NULL) return;
+    slot->datalen = 0;
+    slot->is_last_chunk = 1;
+    shm_ring_commit_write(payload);
+}
 
-        shm_segment_t seg;
-        if (shm_segment_attach(&seg, task->shm_name, task->segment_size) < 0) {
-            fprintf(stderr, "[CACHE] failed to attach shm: %s\n", task->shm_name);
-            free(task);
-            continue;
-        }
+// 决定 task->key 从哪里送, 填好 req_id 和 total_file_size (零拷贝时还有对象名).
+// 返回后 *body != NULL = 从内存拷, *fd >= 0 = 从文件读 (调用者关闭), 都没有 = 只送一个空的最后一块
+static void _task_source(cache_task_t *task, shm_payload_t *payload, int *fd, simplecache_body_t **body) {
+        *fd = -1;
+        *body = NULL;
+        payload->req_id = task->req_id;
+        payload->total_file_size = 0;
+        payload->fill_limit = 0;
 
-        shm_payload_t* payload = (shm_payload_t*)seg.addr;
-        size_t max_chunk_size = task->segment_size - sizeof(*payload);
+        // 零拷贝: 只回复对象名和大小, proxy 自己打开后用 sendfile 直接发送
+        if (payload->delivery == SHM_DELIVER_MAPPED) {
+            size_t objsize;
+            if (export_objects &&
+                simplecache_get_export(task->key, payload->object_name, sizeof(payload->object_name), &objsize) == 0) {
+                payload->total_file_size = objsize;
+                return;
+            }
+            payload->delivery = SHM_DELIVER_COPY;
+        }
 
-        int fd = simplecache_get(task->key);
-        if (fd < 0) {
-            fprintf(stderr, "[CACHE] miss: %s\n", task->key);
-            payload->datalen = 0;
-            payload->is_last_chunk = 1;
-            sem_post(&payload->sem_proxy_ready);
-            free(task);
-            continue;
+        // 热对象直接从内存拷进槽里, 不走系统调用
+        if (NULL != (*body = simplecache_store_get(task->key))) {
+            payload->total_file_size = (*body)->len;
+            return;
         }
 
-		int my_fd = dup(fd);  // 线程独立使用自己的副本 fd
-		if (my_fd < 0) {
-			perror("dup failed");
-			free(task);
-            continue;
-		}
+        // 拿到的是自己的 fd 副本, cache 的 fd LRU 换出它也不影响这次读
+        if (0 > (*fd = simplecache_get(task->key))) {
+            // 值得学的话告诉 proxy 回源之后把它填回来
+            payload->fill_limit = simplecache_fill_admit(task->key);
+            fprintf(stderr, "[CACHE] miss: %s%s\n", task->key, payload->fill_limit ? ", asking for a fill" : "");
+            return;
+        }
 
 		struct stat st;
-		if (fstat(my_fd, &st) < 0) {
+		if (fstat(*fd, &st) < 0) {
 			perror("[CACHE] fstat failed");
-			close(my_fd);
-			free(task);
-			continue;
+			close(*fd);
+			*fd = -1;
+			return;
 		}
 		payload->total_file_size = st.st_size;
+}
 
+// 把 task->key 的内容送进已经 attach 好的段
+static void _serve_task(cache_task_t *task, shm_payload_t *payload) {
+        size_t max_chunk_size = payload->slot_size - sizeof(shm_slot_t);
+        simplecache_body_t *body;
+        int my_fd;
+
+        _task_source(task, payload, &my_fd, &body);
+
+        if (body != NULL) {
+            size_t offset = 0;
+            int last;
+            do {
+                shm_slot_t* slot = shm_ring_begin_write(payload);
+                if (slot == NULL) break;
+                size_t n = body->len - offset < max_chunk_size ? body->len - offset : max_chunk_size;
+                memcpy(slot->data, body->data + offset, n);
+                offset += n;
+                slot->datalen = n;
+                last = (offset >= body->len);
+                slot->is_last_chunk = last;
+                shm_ring_commit_write(payload);
+            } while (!last);
+            simplecache_store_put(body);
+            return;
+        }
+
+        if (my_fd < 0) {
+            _post_empty(payload);
+            return;
+        }
+        size_t size = payload->total_file_size;
+
+		// 一直往空闲槽里填, proxy 同时在另一端消费; 提交最后一块后不再碰这个段
         ssize_t n;
 		off_t offset = 0;
-        while (1) {
-
-			n = pread(my_fd, payload->data, max_chunk_size, offset);
+		int last;
+        do {
+            shm_slot_t* slot = shm_ring_begin_write(payload);
+            if (slot == NULL) {
+                fprintf(stderr, "[CACHE] proxy stopped reading %s\n", task->key);
+                close(my_fd);
+                return;
+            }
 
+			n = pread(my_fd, slot->data, max_chunk_size, offset);
             if (n < 0) {
                 perror("[CACHE] read error");
-                break;
+                n = 0;
             }
+			offset += n;
 
-			if (n == 0) {
-                payload->datalen = 0;
-                payload->is_last_chunk = 1;
-                sem_post(&payload->sem_proxy_ready);
+            slot->datalen = n;
+            last = (n == 0 || (size_t)offset >= size); // 最后一块判断
+            slot->is_last_chunk = last;
+
+            shm_ring_commit_write(payload);
+        } while (!last);
+
+		printf("[CACHE] sent %lld bytes from file: %s\n", (long long)offset, task->key);
+		close(my_fd);
+}
+
+// CTL_FILL: proxy 把回源取到的整个对象写进段里, 这里读出来存成文件再加进 simplecache.
+// 收不收都要把 ring 读完, proxy 要等它排空才能把段拿去用
+static void _fill_task(cache_task_t *task, shm_payload_t *payload) {
+        size_t max_chunk_size = payload->slot_size - sizeof(shm_slot_t);
+        size_t size = payload->total_file_size, got = 0;
+        char path[PATH_MAX];
+        shm_slot_t *slot;
+        int fd = -1, last;
+
+        if (payload->req_id == task->req_id && size > 0 && size <= fill_max_size) {
+            fd = simplecache_fill_open(path, sizeof(path));
+        }
+
+        do {
+            if (NULL == (slot = shm_ring_begin_read(payload))) {
+                fprintf(stderr, "[CACHE] proxy went away during fill of %s\n", task->key);
                 break;
             }
-			offset += n;
+            if (slot->datalen > max_chunk_size || got + slot->datalen > size) {
+                // 坏块: 不再写, 只管读完
+                if (fd >= 0) {
+                    close(fd);
+                    unlink(path);
+                    fd = -1;
+                }
+            } else if (fd >= 0 && pwrite(fd, slot->data, slot->datalen, got) != (ssize_t)slot->datalen) {
+                perror("[CACHE] fill write failed");
+                close(fd);
+                unlink(path);
+                fd = -1;
+            }
+            got += slot->datalen;
+            last = slot->is_last_chunk;
+            shm_ring_end_read(payload);
+        } while (!last);
 
-            payload->datalen = n;
-			printf("[CACHE] read %zd bytes from file: %s\n", n, task->key);
+        if (fd < 0) return;
+        close(fd);
+        if (slot == NULL || got != size || simplecache_fill_add(task->key, path) < 0) {
+            unlink(path);
+            return;
+        }
+        printf("[CACHE] learned %s (%zu bytes)\n", task->key, size);
+}
 
-            payload->is_last_chunk = (n < (ssize_t)max_chunk_size); // 最后一块判断
+// 按轮转取一个请求: 每个 proxy 每轮只取一个, 请求多的 proxy 不会饿死别人
+static cache_task_t* _pop_task(void) {
+        pthread_mutex_lock(&queue_lock);
+        while (steque_isempty(&ready_proxies)) {
+            pthread_cond_wait(&queue_not_empty, &queue_lock);
+        }
 
-            sem_post(&payload->sem_proxy_ready);
-			printf("[CACHE] posted sem_proxy_ready for %s\n", task->key);
-            sem_wait(&payload->sem_cache_ready);
+        cache_proxy_t *proxy = steque_pop(&ready_proxies);
+        cache_task_t *task = steque_pop(&proxy->tasks);
+        if (!steque_isempty(&proxy->tasks)) {
+            steque_enqueue(&ready_proxies, proxy);
+        }
+        proxy->inflight++;
+        pthread_mutex_unlock(&queue_lock);
+        return task;
+}
 
-            if (payload->is_last_chunk) break;
+// attach 任务的段; 失败或者 proxy 已经走了就结束任务并返回 NULL. 能回复的都回复, 不让 proxy 干等
+static shm_segment_t* _attach_task(cache_task_t *task) {
+        // 段映射在请求之间复用, 直到 proxy 把它退役
+        shm_segment_t *seg = shm_attach_get(task->shm_name, task->segment_size, task->generation);
+        if (seg == NULL && errno == ESTALE) {
+            // proxy 已经放弃这个请求并重建了段, 新段不归这个请求, 不能往里写
+            fprintf(stderr, "[CACHE] dropping stale request for %s\n", task->shm_name);
+            _task_done(task);
+            return NULL;
         }
-		close(my_fd);
-        free(task);
+        if (seg == NULL) {
+            fprintf(stderr, "[CACHE] failed to attach shm: %s\n", task->shm_name);
+            _task_failed(task);
+            return NULL;
+        }
+
+        // attach 之后再看一次: 在这之后退出的 proxy 会把这个段的 ring 中止掉
+        pthread_mutex_lock(&queue_lock);
+        int gone = task->proxy->gone;
+        pthread_mutex_unlock(&queue_lock);
+        if (gone) {
+            shm_ring_abort((shm_payload_t*)seg->addr);
+            shm_attach_put(seg);
+            _task_done(task);
+            return NULL;
+        }
+        return seg;
+}
+
+static void* _worker_thread(void *arg) {
+	printf("[DEBUG] Cache worker thread started\n");
+
+    (void)arg;
+    while (1) {
+        cache_task_t *task = _pop_task();
+
+		printf("[CACHE-WORKER] Handling %s (shm: %s, size: %zu)\n", task->key, task->shm_name, task->segment_size);
+
+        shm_segment_t *seg = _attach_task(task);
+        if (seg == NULL) continue;
+
+        if (task->type == CTL_FILL) _fill_task(task, (shm_payload_t*)seg->addr);
+        else _serve_task(task, (shm_payload_t*)seg->addr);
+        shm_attach_put(seg);
+        _task_done(task);
+    }
+    return NULL;
+}
+
+// 交给 io_uring 引擎的一个传输, 结束后要释放的东西也在这里
+typedef struct {
+	cache_task_t *task;
+	shm_segment_t *seg;
+	simplecache_body_t *body;
+	int fd;
+	size_t size;
+} uring_job_t;
+
+static void _uring_job_done(void *cookie) {
+	uring_job_t *job = cookie;
+
+	if (job->body != NULL) simplecache_store_put(job->body);
+	shm_attach_put(job->seg);
+	_task_done(job->task);
+	free(job);
+}
+
+static void _push_job(uring_job_t *job) {
+	pthread_mutex_lock(&queue_lock);
+	steque_enqueue(&ready_jobs, job);
+	if (!job_efd_signaled) {
+		uint64_t one = 1;
+		ssize_t w = write(job_efd, &one, sizeof(one));
+		(void)w;
+		job_efd_signaled = 1;
+	}
+	pthread_mutex_unlock(&queue_lock);
+}
+
+// 引擎线程取一个准备好的传输, 没有就返回 NULL
+static uring_job_t* _pop_job(void) {
+	uring_job_t *job = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	if (!steque_isempty(&ready_jobs)) {
+		job = steque_pop(&ready_jobs);
+	} else if (job_efd_signaled) {
+		// 队列空了才清 eventfd, 否则引擎线程的 poll 会一直醒
+		uint64_t v;
+		ssize_t r = read(job_efd, &v, sizeof(v));
+		(void)r;
+		job_efd_signaled = 0;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return job;
+}
+
+// io_uring 模式下的查找线程: 查 key 可能要睡 cache_delay, 同步 open 文件或者从内容仓库载入,
+// 这些都在这里做完, 引擎线程只管推进传输, 不会因为一次查找卡住手上所有的传输
+static void* _lookup_thread(void *arg) {
+	(void)arg;
+	printf("[DEBUG] Cache lookup thread started\n");
+
+    while (1) {
+        cache_task_t *task = _pop_task();
+        shm_segment_t *seg = _attach_task(task);
+        if (seg == NULL) continue;
+
+        shm_payload_t *payload = (shm_payload_t*)seg->addr;
+        // 回填是内存拷贝, proxy 已经拿到整个对象了, 就地读完
+        if (task->type == CTL_FILL) {
+            _fill_task(task, payload);
+            shm_attach_put(seg);
+            _task_done(task);
+            continue;
+        }
+        uring_job_t *job = malloc(sizeof(uring_job_t));
+        job->task = task;
+        job->seg = seg;
+        _task_source(task, payload, &job->fd, &job->body);
+        job->size = job->fd >= 0 || job->body ? payload->total_file_size : 0;
+        _push_job(job);
     }
     return NULL;
 }
 
+// 每个线程一个引擎, 同时推进很多个传输; 等槽和等读都不占线程
+static void* _uring_worker_thread(void *arg) {
+    uring_engine_t *engine = arg;
+	printf("[DEBUG] Cache io_uring worker thread started\n");
+
+    while (1) {
+        uring_job_t *job;
+        while (uring_engine_has_room(engine) && NULL != (job = _pop_job())) {
+            uring_engine_start(engine, (shm_payload_t*)job->seg->addr, job->fd, job->body ? job->body->data : NULL,
+                               job->size, _uring_job_done, job);
+        }
+
+        // 有空位才听新传输; 满了就只等手上的传输
+        if (uring_engine_has_room(engine)) {
+            uring_engine_watch(engine, job_efd);
+        }
+        uring_engine_run(engine);
+    }
+    return NULL;
+}
 
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
@@ -146,6 +690,19 @@ static void* _worker_thread(void *arg) {
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
 "  -t [thread_count]   Thread count for work queue (Default is 8, Range is 1-100)\n"      \
 "  -d [delay]          Delay in simplecache_get (Default is 0, Range is 0-2500000 (microseconds)\n "	\
+"  -f [fds]            Max cached files kept open at once (Default: half of RLIMIT_NOFILE)\n"	\
+"  -m [megabytes]      Memory budget for keeping object bodies in RAM (Default: 0 = off)\n"	\
+"  -P [policy]         Eviction policy once the memory budget is full: lru, clock, s3fifo or tinylfu (Default: lru)\n"	\
+"  -H                  Back large in-memory bodies with huge pages\n"	\
+"  -S [spins]          Max spins before blocking on a futex (Default: 200, 0 on one CPU)\n"	\
+"  -e                  Export cached files as read-only shared memory for zero-copy delivery\n"	\
+"  -W [warmlist]      Prefetch the keys in this file (workload.txt format or an access log), hottest first; again on SIGUSR1\n"	\
+"  -B [megabytes]      I/O budget for each prefetch pass (Default: 0 = no limit)\n"	\
+"  -R [seconds]        Check served files for changes and tell the proxies (Default: 1, 0 = off)\n"	\
+"  -u [depth]          Serve with io_uring, up to depth transfers in flight per thread; lookups run on -t more threads (Default: off)\n"	\
+"  -F [filldir]        Learn objects the proxies fetch on a miss, storing them under filldir (Default: off)\n"	\
+"  -N [objects]        Max objects learned this way (Default: 10000)\n"	\
+"  -Z [kilobytes]      Largest object learned this way (Default: 8192)\n"	\
 "  -h                  Show this help message\n"
 
 //OPTIONS
@@ -155,6 +712,19 @@ static struct option gLongOptions[] = {
   {"help",               no_argument,            NULL,           'h'},
   {"hidden",			 no_argument,			 NULL,			 'i'}, /* server side */
   {"delay", 			 required_argument,		 NULL, 			 'd'}, // delay.
+  {"export",			 no_argument,			 NULL,			 'e'},
+  {"spin",				 required_argument,		 NULL,			 'S'},
+  {"memory",			 required_argument,		 NULL,			 'm'},
+  {"fds",				 required_argument,		 NULL,			 'f'},
+  {"hugepages",			 no_argument,			 NULL,			 'H'},
+  {"policy",			 required_argument,		 NULL,			 'P'},
+  {"uring",				 required_argument,		 NULL,			 'u'},
+  {"warm",				 required_argument,		 NULL,			 'W'},
+  {"warm-budget",		 required_argument,		 NULL,			 'B'},
+  {"revalidate",		 required_argument,		 NULL,			 'R'},
+  {"fill-dir",			 required_argument,		 NULL,			 'F'},
+  {"fill-objects",		 required_argument,		 NULL,			 'N'},
+  {"fill-max-size",		 required_argument,		 NULL,			 'Z'},
   {NULL,                 0,                      NULL,             0}
 };
 
@@ -163,16 +733,24 @@ void Usage() {
 }
 
 int main(int argc, char **argv) {
-	printf("[CACHE] started and listening on %s\n", SOCKET_PATH);
+	printf("[CACHE] started and listening on %s\n", CACHE_SOCKET_PATH);
 	fflush(stdout);
 	int nthreads = 8;
+	int uring_depth = 0;
+	int revalidate_secs = 1;
 	char *cachedir = "locals.txt";
+	size_t store_budget = 0;
+	int store_hugepages = 0;
+	int store_policy = EVICT_LRU;
+	char *fill_dir = NULL;
+	int fill_objects = 10000;
+	size_t fill_kb = 8192;
 	char option_char;
 
 	/* disable buffering to stdout */
 	setbuf(stdout, NULL);
 
-	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:x", gLongOptions, NULL)) != -1) {
+	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:xeS:m:Hf:u:W:B:R:F:N:Z:P:", gLongOptions, NULL)) != -1) {
 		switch (option_char) {
 			default:
 				Usage();
@@ -190,6 +768,48 @@ int main(int argc, char **argv) {
             case 'd':
 				cache_delay = (unsigned long int) atoi(optarg);
 				break;
+			case 'm': // content store budget
+				store_budget = (size_t) atol(optarg) << 20;
+				break;
+			case 'f': // fd cache size
+				simplecache_set_fd_limit(atoi(optarg));
+				break;
+			case 'H': // huge pages for the content store
+				store_hugepages = 1;
+				break;
+			case 'P': // eviction policy
+				if (0 > (store_policy = evict_policy_parse(optarg))) {
+					fprintf(stderr, "Unknown eviction policy %s\n", optarg);
+					exit(__LINE__);
+				}
+				break;
+			case 'S': // spin budget
+				shm_channel_set_spin(atoi(optarg));
+				break;
+			case 'W': // warm list
+				warm_list = optarg;
+				break;
+			case 'B': // warm-up I/O budget
+				warm_budget = (size_t) atol(optarg) << 20;
+				break;
+			case 'R': // change check period
+				revalidate_secs = atoi(optarg);
+				break;
+			case 'F': // fill directory
+				fill_dir = optarg;
+				break;
+			case 'N': // max learned objects
+				fill_objects = atoi(optarg);
+				break;
+			case 'Z': // largest learned object
+				fill_kb = (size_t) atol(optarg);
+				break;
+			case 'u': // io_uring engine
+				uring_depth = atoi(optarg);
+				break;
+			case 'e': // zero-copy export
+				export_objects = 1;
+				break;
 			case 'i': // server side usage
 			case 'o': // do not modify
 			case 'a': // experimental
@@ -206,6 +826,25 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "Invalid number of threads must be in between 1-100\n");
 		exit(__LINE__);
 	}
+
+	if ((uring_depth > 4096) || (uring_depth < 0)) {
+		fprintf(stderr, "Invalid io_uring depth must be in between 1-4096\n");
+		exit(__LINE__);
+	}
+	if (fill_dir != NULL) {
+		struct stat st;
+		if (fill_objects < 1 || fill_kb < 1) {
+			fprintf(stderr, "Invalid fill limits\n");
+			exit(__LINE__);
+		}
+		if ((mkdir(fill_dir, 0755) < 0 && errno != EEXIST) || stat(fill_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "Fill directory %s is not usable\n", fill_dir);
+			exit(__LINE__);
+		}
+		fill_max_size = fill_kb << 10;
+		simplecache_set_fill(fill_dir, fill_objects, fill_max_size);
+	}
+
 	if (SIG_ERR == signal(SIGINT, _sig_handler)){
 		fprintf(stderr,"Unable to catch SIGINT...exiting.\n");
 		exit(CACHE_FAILURE);
@@ -215,26 +854,77 @@ int main(int argc, char **argv) {
 		exit(CACHE_FAILURE);
 	}
 	/*Initialize cache*/
+	steque_init(&changed_keys);
+	steque_init(&failed_tasks);
+	boss_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	simplecache_set_change_hook(_object_changed);
 	simplecache_init(cachedir);
+	simplecache_store_init(store_budget, store_hugepages, store_policy);
+	if (export_objects) {
+		printf("[CACHE] exported %d objects for zero-copy delivery\n", simplecache_export());
+	}
+
+	// 预热在后台做, 不耽误开始接请求
+	if (warm_list != NULL) {
+		pthread_t tid;
+		sem_init(&warm_requested, 0, 0);
+		if (SIG_ERR == signal(SIGUSR1, _sig_handler)){
+			fprintf(stderr,"Unable to catch SIGUSR1...exiting.\n");
+			exit(CACHE_FAILURE);
+		}
+		pthread_create(&tid, NULL, _warm_thread, NULL);
+		pthread_detach(tid);
+	}
+
+	if (revalidate_secs > 0) {
+		pthread_t tid;
+		pthread_create(&tid, NULL, _revalidate_thread, (void*)(long) revalidate_secs);
+		pthread_detach(tid);
+	}
+
+	steque_init(&ready_proxies);
+	steque_init(&ready_jobs);
 
-	steque_init(&request_queue);
+	// 先试着给每个线程建一个 io_uring 引擎; 内核不支持就退回普通线程池
+	uring_engine_t **engines = NULL;
+	if (uring_depth > 0) {
+		engines = calloc(nthreads, sizeof(uring_engine_t*));
+		job_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		for (int i = 0; i < nthreads && job_efd >= 0; i++) {
+			if (NULL == (engines[i] = uring_engine_create(uring_depth))) {
+				perror("[CACHE] io_uring unavailable, using the thread pool");
+				while (i-- > 0) uring_engine_destroy(engines[i]);
+				close(job_efd);
+				job_efd = -1;
+			}
+		}
+		if (job_efd >= 0) {
+			printf("[CACHE] io_uring engine: %d threads x %d transfers, %d lookup threads\n", nthreads, uring_depth, nthreads);
+		}
+	}
 
 	// Cache should go here
-	// 创建工作线程池
+	// 创建工作线程池; io_uring 模式下再加同样多的查找线程
 	for (int i = 0; i < nthreads; i++) {
 		pthread_t tid;
-		pthread_create(&tid, NULL, _worker_thread, NULL);
+		if (job_efd >= 0) {
+			pthread_create(&tid, NULL, _uring_worker_thread, engines[i]);
+			pthread_detach(tid);
+			pthread_create(&tid, NULL, _lookup_thread, NULL);
+		} else {
+			pthread_create(&tid, NULL, _worker_thread, NULL);
+		}
 		pthread_detach(tid);
 	}
 
 	// Boss thread: 接收 proxy 的请求
-	unlink(SOCKET_PATH);
+	unlink(CACHE_SOCKET_PATH);
 	server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
 	struct sockaddr_un addr;
 	memset(&addr, 0, sizeof(addr));
 	addr.sun_family = AF_UNIX;
-	strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+	strncpy(addr.sun_path, CACHE_SOCKET_PATH, sizeof(addr.sun_path) - 1);
 
 	if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
 		perror("bind");
@@ -245,39 +935,116 @@ int main(int argc, char **argv) {
 		exit(CACHE_FAILURE);
 	}
 
-	while (1) {
-		int client_fd = accept(server_fd, NULL, NULL);
-		if (client_fd < 0) continue;
-
-		char buf[MAX_CACHE_REQUEST_LEN];
-		ssize_t len = read(client_fd, buf, sizeof(buf) - 1);
-		close(client_fd);
-		if (len <= 0) continue;
-
-		buf[len] = '\0';
-		char *shm_name = strtok(buf, " ");
-		char *key = strtok(NULL, " ");
-		char *size_str = strtok(NULL, " \n");
-		printf("[CACHE-BOSS] Received shm_name=%s, key=%s, size=%s\n", shm_name, key, size_str);
-		size_t segment_size = SHM_SEGMENT_SIZE;  // 默认 fallback
-		if (size_str != NULL) {
-			segment_size = (size_t) atol(size_str);
+	// 每个 proxy worker 一条长连接, 用 epoll 一起收帧
+	int epfd = epoll_create1(0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // NULL = 监听 socket
+	epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev);
+	ev.data.ptr = &boss_efd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, boss_efd, &ev);
+
+	ctl_client_t *clients = NULL;
+	unsigned long notify_round = 0;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	while (!stop_signal) {
+		// 有断了线的 proxy 时定期醒来, 看它的进程还在不在
+		int nready = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, orphans > 0 ? PROXY_GRACE_MS : -1);
+		if (orphans > 0) _reap_proxies();
+		for (int i = 0; i < nready; i++) {
+			ctl_client_t *client = events[i].data.ptr;
+
+			if (events[i].data.ptr == &boss_efd) {
+				uint64_t count;
+				ssize_t r = read(boss_efd, &count, sizeof(count));
+				(void)r;
+				pthread_mutex_lock(&queue_lock);
+				while (!steque_isempty(&changed_keys)) {
+					char *key = steque_pop(&changed_keys);
+					pthread_mutex_unlock(&queue_lock);
+					printf("[CACHE] %s changed, invalidating proxy copies\n", key);
+					_notify_proxies(clients, key, ++notify_round);
+					free(key);
+					pthread_mutex_lock(&queue_lock);
+				}
+				while (!steque_isempty(&failed_tasks)) {
+					cache_task_t *task = steque_pop(&failed_tasks);
+					pthread_mutex_unlock(&queue_lock);
+					_send_abort(clients, task);
+					_task_done(task);
+					pthread_mutex_lock(&queue_lock);
+				}
+				pthread_mutex_unlock(&queue_lock);
+				continue;
+			}
+
+			if (client == NULL) {
+				int client_fd = accept(server_fd, NULL, NULL);
+				if (client_fd < 0) continue;
+				client = malloc(sizeof(ctl_client_t));
+				client->fd = client_fd;
+				client->proxy = NULL;
+				client->len = 0;
+				client->next = clients;
+				clients = client;
+				ev.events = EPOLLIN;
+				ev.data.ptr = client;
+				epoll_ctl(epfd, EPOLL_CTL_ADD, client_fd, &ev);
+				continue;
+			}
+
+			ssize_t len = read(client->fd, client->buf + client->len, sizeof(client->buf) - client->len);
+			if (len < 0 && errno == EINTR) continue;
+
+			int consumed = 0;
+			if (len > 0) {
+				client->len += len;
+
+				ctl_request_t req;
+				int n;
+				while ((n = ctl_decode(client->buf + consumed, client->len - consumed, &req)) > 0) {
+					consumed += n;
+					if (client->proxy == NULL) {
+						// 第一帧必须是报到, 确认帧原样发回去
+						char ack[CTL_MAX_FRAME_LEN];
+						int acklen = ctl_encode(&req, ack, sizeof(ack));
+						if (req.type != CTL_REGISTER || NULL == (client->proxy = _register_proxy(&req)) ||
+							send(client->fd, ack, acklen, MSG_NOSIGNAL) != acklen) {
+							n = -1;
+							break;
+						}
+					} else if (req.type != CTL_REGISTER && !_owns_segment(client->proxy, req.shm_name)) {
+						n = -1;
+						break;
+					} else if (req.type == CTL_GET || req.type == CTL_FILL) _enqueue_request(client->proxy, &req);
+					else if (req.type == CTL_RETIRE) shm_attach_retire(req.shm_name);
+				}
+				if (n == 0) {
+					memmove(client->buf, client->buf + consumed, client->len - consumed);
+					client->len -= consumed;
+					continue;
+				}
+				fprintf(stderr, "[CACHE-BOSS] malformed or unauthorized frame, dropping connection\n");
+			}
+
+			// EOF, 出错或者坏帧: 关掉这条连接, proxy 会重连
+			epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+			close(client->fd);
+			if (client->proxy != NULL) _proxy_disconnect(client->proxy);
+			for (ctl_client_t **link = &clients; *link != NULL; link = &(*link)->next) {
+				if (*link == client) {
+					*link = client->next;
+					break;
+				}
+			}
+			free(client);
 		}
-		key[strcspn(key, "\n")] = '\0'; // remove trailing newline
-		if (!shm_name || !key) continue;
-
-		cache_task_t *task = malloc(sizeof(cache_task_t));
-		strncpy(task->shm_name, shm_name, sizeof(task->shm_name));
-		strncpy(task->key, key, sizeof(task->key));
-		task->segment_size = segment_size;
-
-		pthread_mutex_lock(&queue_lock);
-		steque_enqueue(&request_queue, task);
-		pthread_cond_signal(&queue_not_empty);
-		printf("[DEBUG] Boss enqueue: %s\n", task->key);
-		pthread_mutex_unlock(&queue_lock);
 	}
 
-	// Line never reached
-	return -1;
+	// This is where your IPC clean up should occur
+	unlink(CACHE_SOCKET_PATH);
+	close(server_fd);
+	simplecache_store_print_stats(stdout);
+	simplecache_destroy();
+	return stop_signal;
 }
@@ -0,0 +1,345 @@
+#include "uring_engine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
+
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_POLL_NS 1000000        // 没法异步等的段 (信号量模式) 每 1ms 看一次
+#define URING_OP_FUTEX_WAIT 51       // 内核 6.7 起才有, 老的 linux/io_uring.h 里还没有
+#define URING_FUTEX2_SIZE_U32 0x02
+
+#define WAIT_FUTEX (-1)
+#define WAIT_TIMEOUT (-2)
+
+typedef struct uring_xfer_t uring_xfer_t;
+
+// 一个 SQE 的上下文, 地址就是 user_data
+typedef struct {
+    uring_xfer_t *xfer;       // NULL = 在监听 efd
+    int kind;                 // ops[] 里是槽号; wait_op 里是 WAIT_*, 0 = 没在等
+    shm_slot_t *slot;
+    unsigned int seq;         // 本次传输认领的第几个槽
+    size_t off;               // 这个槽对应的文件偏移
+    size_t want;
+    size_t got;
+    int ready;                // 数据齐了, 轮到它就能提交
+} uring_op_t;
+
+struct uring_xfer_t {
+    shm_payload_t *payload;
+    int fd;
+    const char *data;
+    size_t size;
+    size_t next_off;          // 下一个认领的槽从哪里开始
+    unsigned int claimed;     // 认领了还没提交的槽
+    unsigned int nclaims;     // 认领过的槽数, 也是下一个 seq
+    unsigned int last_seq;    // 带 is_last_chunk 的那个槽; UINT_MAX = 还没认领到
+    unsigned int inflight;    // 还没完成的 SQE
+    int stopped;              // 最后一块已提交, 或者 ring 被中止
+    uring_done_fn done;
+    void *cookie;
+    uring_op_t wait_op;
+    uring_op_t *ops;          // 按槽号
+};
+
+struct uring_engine_t {
+    int ring_fd;
+    unsigned int depth;
+    unsigned int active;
+    unsigned int to_submit;
+    int no_futex;             // 内核不认 IORING_OP_FUTEX_WAIT, 都改成定时查看
+
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+
+    uring_op_t watch_op;
+    int watching;
+    int woken;
+    struct __kernel_timespec poll_ts;
+};
+
+static int _enter(uring_engine_t *engine, unsigned int min_complete) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, engine->ring_fd, engine->to_submit, min_complete,
+                      min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0) engine->to_submit -= ret;
+    return ret;
+}
+
+static struct io_uring_sqe* _get_sqe(uring_engine_t *engine) {
+    unsigned int tail = *engine->sq_tail;
+    while (tail - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE) >= engine->sq_entries) {
+        _enter(engine, 0);
+    }
+
+    unsigned int idx = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    engine->sq_array[idx] = idx;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    engine->to_submit++;
+    return sqe;
+}
+
+uring_engine_t* uring_engine_create(unsigned int depth) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    int fd = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    if (fd < 0) return NULL;
+
+    uring_engine_t *engine = calloc(1, sizeof(uring_engine_t));
+    engine->ring_fd = fd;
+    engine->depth = depth;
+    engine->sq_entries = p.sq_entries;
+    engine->poll_ts.tv_nsec = URING_POLL_NS;
+
+    engine->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    engine->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    engine->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sq_ptr = mmap(NULL, engine->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    engine->cq_ptr = mmap(NULL, engine->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    engine->sqes = mmap(NULL, engine->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (engine->sq_ptr == MAP_FAILED || engine->cq_ptr == MAP_FAILED || engine->sqes == MAP_FAILED) {
+        uring_engine_destroy(engine);
+        return NULL;
+    }
+
+    char *sq = engine->sq_ptr, *cq = engine->cq_ptr;
+    engine->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    engine->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    engine->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+    engine->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    engine->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    engine->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    engine->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return engine;
+}
+
+void uring_engine_destroy(uring_engine_t *engine) {
+    if (engine->sq_ptr && engine->sq_ptr != MAP_FAILED) munmap(engine->sq_ptr, engine->sq_len);
+    if (engine->cq_ptr && engine->cq_ptr != MAP_FAILED) munmap(engine->cq_ptr, engine->cq_len);
+    if (engine->sqes && engine->sqes != MAP_FAILED) munmap(engine->sqes, engine->sqes_len);
+    close(engine->ring_fd);
+    free(engine);
+}
+
+int uring_engine_has_room(uring_engine_t *engine) {
+    return engine->active < engine->depth;
+}
+
+void uring_engine_watch(uring_engine_t *engine, int efd) {
+    if (engine->watching) return;
+    struct io_uring_sqe *sqe = _get_sqe(engine);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = efd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = (uintptr_t)&engine->watch_op;
+    engine->watching = 1;
+}
+
+static void _submit_read(uring_engine_t *engine, uring_xfer_t *xfer, uring_op_t *op) {
+    struct io_uring_sqe *sqe = _get_sqe(engine);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = xfer->fd;
+    sqe->addr = (uintptr_t)(op->slot->data + op->got);
+    sqe->len = op->want - op->got;
+    sqe->off = op->off + op->got;
+    sqe->user_data = (uintptr_t)op;
+    xfer->inflight++;
+}
+
+// ring 满了: 在 consumed 上挂一个 futex 等待, 对端还槽时完成; seen 是认领前读到的值
+static void _submit_wait(uring_engine_t *engine, uring_xfer_t *xfer, uint32_t seen) {
+    shm_payload_t *payload = xfer->payload;
+    struct io_uring_sqe *sqe = _get_sqe(engine);
+
+    if (payload->notify == SHM_NOTIFY_FUTEX && !engine->no_futex) {
+        __atomic_fetch_add(&payload->consumed_waiters, 1, __ATOMIC_SEQ_CST);
+        sqe->opcode = URING_OP_FUTEX_WAIT;
+        sqe->fd = URING_FUTEX2_SIZE_U32;
+        sqe->addr = (uintptr_t)&payload->consumed;
+        sqe->addr2 = seen;
+        sqe->addr3 = FUTEX_BITSET_MATCH_ANY;
+        xfer->wait_op.kind = WAIT_FUTEX;
+    } else {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uintptr_t)&engine->poll_ts;
+        sqe->len = 1;
+        xfer->wait_op.kind = WAIT_TIMEOUT;
+    }
+    sqe->user_data = (uintptr_t)&xfer->wait_op;
+    xfer->inflight++;
+}
+
+// 按槽的顺序提交数据已经齐了的槽
+static void _xfer_commit(uring_xfer_t *xfer) {
+    shm_payload_t *payload = xfer->payload;
+
+    while (!xfer->stopped && xfer->claimed > 0) {
+        uring_op_t *op = &xfer->ops[payload->head];
+        if (!op->ready) break;
+
+        int last = (op->seq == xfer->last_seq);
+        if (last && xfer->claimed > 1) {
+            // 出错提前结束: 后面认领的槽要在提交最后一块之前还掉, 之后 proxy 随时会重用这个段
+            shm_ring_unclaim(payload, xfer->claimed - 1);
+            xfer->claimed = 1;
+        }
+        op->slot->datalen = op->got;
+        op->slot->is_last_chunk = last;
+        shm_ring_commit_write(payload);
+        xfer->claimed--;
+        if (last) xfer->stopped = 1;
+    }
+}
+
+// 认领所有空闲槽: 文件就发读请求, 内存就直接拷; 槽不够就挂等待
+static void _xfer_claim(uring_engine_t *engine, uring_xfer_t *xfer) {
+    shm_payload_t *payload = xfer->payload;
+    size_t max_chunk_size = payload->slot_size - sizeof(shm_slot_t);
+    uint32_t seen = __atomic_load_n(&payload->consumed, __ATOMIC_ACQUIRE);
+
+    while (!xfer->stopped && xfer->last_seq == UINT_MAX) {
+        shm_slot_t *slot = shm_ring_try_claim(payload, xfer->claimed);
+        if (slot == NULL) {
+            if (__atomic_load_n(&payload->aborted, __ATOMIC_ACQUIRE)) {
+                xfer->stopped = 1;
+            } else if (xfer->wait_op.kind == 0) {
+                _submit_wait(engine, xfer, seen);
+            }
+            return;
+        }
+
+        uring_op_t *op = &xfer->ops[(payload->head + xfer->claimed) % payload->nslots];
+        op->slot = slot;
+        op->seq = xfer->nclaims++;
+        op->off = xfer->next_off;
+        op->want = xfer->size - xfer->next_off < max_chunk_size ? xfer->size - xfer->next_off : max_chunk_size;
+        op->got = 0;
+        op->ready = 0;
+        xfer->next_off += op->want;
+        xfer->claimed++;
+        if (xfer->next_off >= xfer->size) xfer->last_seq = op->seq;
+
+        if (xfer->fd >= 0 && op->want > 0) {
+            _submit_read(engine, xfer, op);
+        } else {
+            if (op->want > 0) memcpy(slot->data, xfer->data + op->off, op->want);
+            op->got = op->want;
+            op->ready = 1;
+        }
+    }
+}
+
+static void _xfer_pump(uring_engine_t *engine, uring_xfer_t *xfer) {
+    _xfer_commit(xfer);
+    _xfer_claim(engine, xfer);
+    _xfer_commit(xfer);
+
+    if (!xfer->stopped || xfer->inflight > 0) return;
+
+    if (xfer->fd >= 0) close(xfer->fd);
+    engine->active--;
+    xfer->done(xfer->cookie);
+    free(xfer->ops);
+    free(xfer);
+}
+
+void uring_engine_start(uring_engine_t *engine, shm_payload_t *payload, int fd, const char *data, size_t size,
+                        uring_done_fn done, void *cookie) {
+    uring_xfer_t *xfer = calloc(1, sizeof(uring_xfer_t));
+    xfer->payload = payload;
+    xfer->fd = fd;
+    xfer->data = data;
+    xfer->size = size;
+    xfer->last_seq = UINT_MAX;
+    xfer->done = done;
+    xfer->cookie = cookie;
+    xfer->wait_op.xfer = xfer;
+    xfer->ops = calloc(payload->nslots, sizeof(uring_op_t));
+    for (unsigned int i = 0; i < payload->nslots; i++) {
+        xfer->ops[i].xfer = xfer;
+        xfer->ops[i].kind = i;
+    }
+
+    engine->active++;
+    _xfer_pump(engine, xfer);
+}
+
+static void _complete(uring_engine_t *engine, uring_op_t *op, int res) {
+    if (op == &engine->watch_op) {
+        engine->watching = 0;
+        engine->woken = 1;
+        return;
+    }
+
+    uring_xfer_t *xfer = op->xfer;
+    xfer->inflight--;
+
+    if (op == &xfer->wait_op) {
+        if (op->kind == WAIT_FUTEX) {
+            __atomic_fetch_sub(&xfer->payload->consumed_waiters, 1, __ATOMIC_SEQ_CST);
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                fprintf(stderr, "[URING] kernel has no futex wait op, polling segments every %dus\n", URING_POLL_NS / 1000);
+                engine->no_futex = 1;
+            }
+        }
+        op->kind = 0;
+    } else if (res == -EINTR || res == -EAGAIN) {
+        _submit_read(engine, xfer, op);
+    } else if (res > 0 && op->got + res < op->want) {
+        op->got += res; // 短读: 接着读剩下的
+        _submit_read(engine, xfer, op);
+    } else {
+        if (res > 0) {
+            op->got += res;
+        } else {
+            // 读错或者文件变短了: 这一块就是最后一块, 后面认领的不再提交
+            if (res < 0) fprintf(stderr, "[URING] read error: %s\n", strerror(-res));
+            if (op->seq < xfer->last_seq) xfer->last_seq = op->seq;
+        }
+        op->ready = 1;
+    }
+
+    _xfer_pump(engine, xfer);
+}
+
+int uring_engine_run(uring_engine_t *engine) {
+    engine->woken = 0;
+    if (_enter(engine, engine->active > 0 || engine->watching ? 1 : 0) < 0) {
+        perror("[URING] io_uring_enter");
+    }
+
+    unsigned int head = *engine->cq_head;
+    while (head != __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+        uring_op_t *op = (uring_op_t*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(engine->cq_head, ++head, __ATOMIC_RELEASE);
+        _complete(engine, op, res);
+        head = *engine->cq_head;
+    }
+    return engine->woken;
+}
@@ -0,0 +1,33 @@
+#ifndef __URING_ENGINE_H__
+#define __URING_ENGINE_H__
+
+#include <stddef.h>
+#include "shm_channel.h"
+
+#define URING_DEFAULT_DEPTH 64
+
+// 一个线程一个引擎: 同时推进最多 depth 个传输, 读请求直接落进段里的槽
+typedef struct uring_engine_t uring_engine_t;
+
+// 传输结束 (送完, 出错或者 ring 被中止) 时调用, 在 uring_engine_run 或 uring_engine_start 里
+typedef void (*uring_done_fn)(void *cookie);
+
+// 建一个引擎; 内核不支持 io_uring 返回 NULL
+uring_engine_t* uring_engine_create(unsigned int depth);
+void uring_engine_destroy(uring_engine_t *engine);
+
+// 还能不能再接一个传输
+int uring_engine_has_room(uring_engine_t *engine);
+
+// 开始往 payload 的 ring 里送 size 字节: fd >= 0 时从文件读 (结束时引擎关掉它), 否则从 data 拷;
+// size 为 0 时只送一个空的最后一块. req_id 和 total_file_size 由调用者先填好
+void uring_engine_start(uring_engine_t *engine, shm_payload_t *payload, int fd, const char *data, size_t size,
+                        uring_done_fn done, void *cookie);
+
+// 让下一次 uring_engine_run 在 efd 可读时返回 1 (只挂一次, 返回后要重新挂)
+void uring_engine_watch(uring_engine_t *engine, int efd);
+
+// 提交攒下的请求, 至少等到一个完成事件并处理掉所有完成事件; efd 可读过返回 1
+int uring_engine_run(uring_engine_t *engine);
+
+#endif // __URING_ENGINE_H__
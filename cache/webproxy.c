@@ -13,6 +13,8 @@
 #include "cache-student.h"
 #include "gfserver.h"
 #include "shm_channel.h"
+#include "l1cache.h"
+#include "readthrough.h"
 
 // Note that the -n and -z parameters are NOT used for Part 1 
                         
@@ -20,10 +22,21 @@
 "usage:\n"                                                                            \
 "  webproxy [options]\n"                                                              \
 "options:\n"                                                                          \
+"  -F [max_fills]      Fetch misses from the server and stream them to the client; up to\n" \
+"                      max_fills of them at a time are written back into the cache (Default: off)\n" \
+"  -c [classes]        Segment size classes as size:count,... (e.g. 8K:32,64K:8,512K:2)\n" \
+"                      Overrides -n/-z; requests pick a class from the object size\n" \
+"  -b [doorbell]       Segment handoff: futex or sem (Default: futex)\n"              \
+"  -B                  Benchmark futex vs semaphore handoff and exit\n"               \
+"  -L [budget[:max]]   In-process cache for objects up to max bytes (Default: 4M:16K, 0 = off)\n" \
+"  -m                  Zero-copy: sendfile objects from the cache's read-only exports\n"   \
 "  -n [segment_count]  Number of segments to use (Default: 8)\n"                      \
 "  -p [listen_port]    Listen port (Default: 25462)\n"                                 \
+"  -r [ring_slots]     Slots per segment ring (Default: 4, 1 = single-buffer mode)\n"  \
 "  -s [server]         The server to connect to (Default: GitHub test data)\n"     \
+"  -S [spins]          Max spins before blocking on a futex (Default: 200, 0 on one CPU)\n"   \
 "  -t [thread_count]   Num worker threads (Default: 8 Range: 200)\n"              \
+"  -w [wait_ms]        Max queueing time for a free segment (Default: 5000, 0 = fail fast)\n" \
 "  -z [segment_size]   The segment size (in bytes, Default: 5712).\n"                  \
 "  -h                  Show this help message\n"
 
@@ -32,8 +45,17 @@
 static struct option gLongOptions[] = {
   {"server",        required_argument,      NULL,           's'},
   {"segment-count", required_argument,      NULL,           'n'},
+  {"mapped",        no_argument,            NULL,           'm'},
+  {"size-classes",  required_argument,      NULL,           'c'},
+  {"read-through",  required_argument,      NULL,           'F'},
+  {"doorbell",      required_argument,      NULL,           'b'},
+  {"doorbell-bench", no_argument,           NULL,           'B'},
+  {"l1-cache",      required_argument,      NULL,           'L'},
+  {"spin",          required_argument,      NULL,           'S'},
   {"listen-port",   required_argument,      NULL,           'p'},
+  {"ring-slots",    required_argument,      NULL,           'r'},
   {"thread-count",  required_argument,      NULL,           't'},
+  {"segment-wait",  required_argument,      NULL,           'w'},
   {"segment-size",  required_argument,      NULL,           'z'},         
   {"help",          no_argument,            NULL,           'h'},
 
@@ -47,24 +69,92 @@ static gfserver_t gfs;
 //handles cache
 extern ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg);
 
-steque_t shm_pool;
-pthread_mutex_t shm_pool_lock = PTHREAD_MUTEX_INITIALIZER;
-size_t shm_segment_size;
+shm_pool_t shm_pools[MAX_SIZE_CLASSES];
+int nshm_pools;
+int mapped_delivery;
+static ctl_conn_t *ctl_conns;
+static int nctl_conns;
 
 
+static volatile sig_atomic_t stop_signal;
+
 static void _sig_handler(int signo){
   if (signo == SIGTERM || signo == SIGINT){
-    //cleanup could go here
+    // 只做 async-signal-safe 的事, 统计和清理在 gfserver_serve 返回之后由 main 做
+    stop_signal = signo;
     gfserver_stop(&gfs);
-    while (!steque_isempty(&shm_pool)) {
-      shm_segment_t *seg = steque_pop(&shm_pool);
+  }
+}
+
+// worker 都已经退出, 段不会再被借走
+static void _destroy_pools(void) {
+  for (int c = 0; c < nshm_pools; c++) {
+    shm_pool_print_stats(&shm_pools[c], stdout);
+    while (!steque_isempty(&shm_pools[c].free_segments)) {
+      shm_segment_t *seg = steque_pop(&shm_pools[c].free_segments);
+      // 先让 cache 放掉它的映射
+      ctl_request_t req;
+      memset(&req, 0, sizeof(req));
+      req.type = CTL_RETIRE;
+      strncpy(req.shm_name, seg->shm_name, sizeof(req.shm_name) - 1);
+      ctl_conns_send_any(ctl_conns, nctl_conns, &req);
       shm_segment_destroy(seg);
       free(seg);
     }
-    exit(signo);
   }
 }
 
+// 段都退还给 cache 之后再断开, 后台线程也一起停掉
+static void _close_ctl_conns(void) {
+  ctl_conns_close(ctl_conns, nctl_conns);
+  free(ctl_conns);
+}
+
+// "64K" -> 65536; *end 指向数字和单位之后
+static size_t _parse_size(const char *s, char **end) {
+  size_t size = strtoul(s, end, 10);
+  if (**end == 'K' || **end == 'k') { size <<= 10; (*end)++; }
+  else if (**end == 'M' || **end == 'm') { size <<= 20; (*end)++; }
+  return size;
+}
+
+// "8K:32,64K:8,512K:2" -> 按段大小从小到大排好的 size class; 格式不对返回 -1
+static int _parse_size_classes(char *spec, size_t *sizes, unsigned int *counts) {
+  int n = 0;
+  char *tok, *save = NULL;
+
+  for (tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    char *end;
+    if (n == MAX_SIZE_CLASSES) return -1;
+
+    size_t size = _parse_size(tok, &end);
+    if (*end != ':') return -1;
+
+    long count = strtol(end + 1, &end, 10);
+    if (*end != '\0' || count < 1) return -1;
+
+    // 插入排序, 保持从小到大
+    int i = n++;
+    while (i > 0 && sizes[i - 1] > size) {
+      sizes[i] = sizes[i - 1];
+      counts[i] = counts[i - 1];
+      i--;
+    }
+    sizes[i] = size;
+    counts[i] = count;
+  }
+  return n;
+}
+
+// "4M:16K" 或者 "4M" (单个对象上限用默认值); 格式不对返回 -1
+static int _parse_l1(const char *spec, size_t *budget, size_t *max_object) {
+  char *end;
+
+  *budget = _parse_size(spec, &end);
+  if (*end == ':') *max_object = _parse_size(end + 1, &end);
+  return *end == '\0' ? 0 : -1;
+}
+
 int main(int argc, char **argv) {
   printf("[WEBPROXY] Started.");
 
@@ -75,6 +165,15 @@ int main(int argc, char **argv) {
   unsigned short port = 25462;
   unsigned short nworkerthreads = 8;
   size_t segsize = 5712;
+  unsigned int nslots = SHM_DEFAULT_SLOTS;
+  int doorbell_bench = 0;
+  unsigned int segment_wait_ms = 5000;
+  char *size_classes = NULL;
+  size_t l1_budget = L1_DEFAULT_BUDGET;
+  size_t l1_max_object = L1_DEFAULT_MAX_OBJECT;
+  int max_fills = -1; // -1 = miss 直接报错, 不回源
+  size_t class_sizes[MAX_SIZE_CLASSES];
+  unsigned int class_counts[MAX_SIZE_CLASSES];
 
   //disable buffering on stdout so it prints immediately */
   setbuf(stdout, NULL);
@@ -89,8 +188,14 @@ int main(int argc, char **argv) {
     exit(SERVER_FAILURE);
   }
 
+  // 回源时客户端中途断开只应让那次 send 失败, 不能把 proxy 打死
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    fprintf(stderr,"Can't ignore SIGPIPE...exiting.\n");
+    exit(SERVER_FAILURE);
+  }
+
   // Parse and set command line arguments */
-  while ((option_char = getopt_long(argc, argv, "s:qht:xn:p:lz:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "s:qht:xn:p:lz:r:mb:BS:w:c:L:F:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       default:
         fprintf(stderr, "%s", USAGE);
@@ -111,9 +216,50 @@ int main(int argc, char **argv) {
       case 'z': // segment size
         segsize = atoi(optarg);
         break;
+      case 'b': // doorbell kind
+        if (strcmp(optarg, "sem") == 0) {
+          shm_channel_set_notify(SHM_NOTIFY_SEM);
+        } else if (strcmp(optarg, "futex") == 0) {
+          shm_channel_set_notify(SHM_NOTIFY_FUTEX);
+        } else {
+          fprintf(stderr, "%s", USAGE);
+          exit(__LINE__);
+        }
+        break;
+      case 'B': // doorbell benchmark
+        doorbell_bench = 1;
+        break;
+      case 'S': // spin budget
+        shm_channel_set_spin(atoi(optarg));
+        break;
+      case 'L': // in-process object cache
+        if (_parse_l1(optarg, &l1_budget, &l1_max_object) < 0) {
+          fprintf(stderr, "%s", USAGE);
+          exit(__LINE__);
+        }
+        break;
+      case 'F': // read-through
+        max_fills = atoi(optarg);
+        if (max_fills < 0) {
+          fprintf(stderr, "%s", USAGE);
+          exit(__LINE__);
+        }
+        break;
+      case 'c': // size classes
+        size_classes = optarg;
+        break;
+      case 'm': // zero-copy delivery
+        mapped_delivery = 1;
+        break;
+      case 'r': // ring slots per segment
+        nslots = atoi(optarg);
+        break;
       case 't': // thread-count
         nworkerthreads = atoi(optarg);
         break;
+      case 'w': // segment wait deadline
+        segment_wait_ms = atoi(optarg);
+        break;
       case 'i':
       //do not modify
       case 'O':
@@ -126,14 +272,37 @@ int main(int argc, char **argv) {
   }
 
 
+  if (doorbell_bench) {
+    shm_doorbell_bench(100000);
+    exit(0);
+  }
+
   if (server == NULL) {
     fprintf(stderr, "Invalid (null) server name\n");
     exit(__LINE__);
   }
 
-  if (segsize < 824) {
-    fprintf(stderr, "Invalid segment size\n");
-    exit(__LINE__);
+  if (size_classes != NULL) {
+    if ((nshm_pools = _parse_size_classes(size_classes, class_sizes, class_counts)) < 1) {
+      fprintf(stderr, "Invalid size classes\n");
+      exit(__LINE__);
+    }
+  } else {
+    nshm_pools = 1;
+    class_sizes[0] = segsize;
+    class_counts[0] = nsegments;
+  }
+
+  for (int c = 0; c < nshm_pools; c++) {
+    if (class_sizes[c] < 824) {
+      fprintf(stderr, "Invalid segment size\n");
+      exit(__LINE__);
+    }
+
+    if ((nslots < 1) || (shm_slot_capacity(class_sizes[c], nslots) == 0)) {
+      fprintf(stderr, "Invalid number of ring slots for segment size %zu\n", class_sizes[c]);
+      exit(__LINE__);
+    }
   }
 
   if (port > 65332) {
@@ -157,26 +326,63 @@ int main(int argc, char **argv) {
   */
   gfserver_init(&gfs, nworkerthreads);
 
-  shm_segment_size = segsize;
-  steque_init(&shm_pool);
-  create_n_segments(nsegments, segsize, &shm_pool);
+  // 段名带上 pid, 同一台机器上的多个 proxy 可以共用一个 cache
+  char shm_ns[32];
+  snprintf(shm_ns, sizeof(shm_ns), "/proxy_shm_%d", (int)getpid());
+
+  size_t shm_total = 0;
+  for (int c = 0; c < nshm_pools; c++) {
+    char prefix[SHM_NAME_LEN];
+    snprintf(prefix, sizeof(prefix), "%s_%d", shm_ns, c);
+    shm_pool_init(&shm_pools[c], segment_wait_ms);
+    create_n_segments(class_counts[c], class_sizes[c], nslots, prefix, &shm_pools[c]);
+    shm_total += class_sizes[c] * class_counts[c];
+    printf("[WEBPROXY] size class %d: %u x %zu bytes\n", c, class_counts[c], class_sizes[c]);
+  }
+  printf("[WEBPROXY] %zu bytes of shared memory in %d size classes\n", shm_total, nshm_pools);
 
   // Set server options here
   gfserver_setopt(&gfs, GFS_PORT, port);
   gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
   gfserver_setopt(&gfs, GFS_MAXNPENDING, 187);
 
-  // 把参数打包传进去
-  void* proxy_args[3] = { &shm_pool, &shm_segment_size, &shm_pool_lock };
+  l1cache_init(l1_budget, l1_max_object);
+  if (l1_budget > 0) {
+    printf("[WEBPROXY] L1 cache: %zu bytes for objects up to %zu bytes\n", l1_budget, l1_max_object);
+  }
 
+  // 每个 worker 一条到 cache 的长连接, 断了由后台线程重连; cache 的作废通知落到 L1 和只读对象表
+  ctl_conns_on_invalidate(handle_with_cache_invalidate);
+  nctl_conns = nworkerthreads;
+  ctl_conns = calloc(nworkerthreads, sizeof(ctl_conn_t));
+  ctl_conns_start(ctl_conns, nworkerthreads, shm_ns);
+
+  if (max_fills >= 0) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    printf("[WEBPROXY] misses go to %s, up to %d filled back at a time\n", server, max_fills);
+  }
+
+  // 把参数打包传进去
+  proxy_worker_arg_t *proxy_args = calloc(nworkerthreads, sizeof(proxy_worker_arg_t));
   for (int i = 0; i < nworkerthreads; i++) {
-      gfserver_setopt(&gfs, GFS_WORKER_ARG, i, proxy_args);
+      proxy_args[i].pools = shm_pools;
+      proxy_args[i].npools = nshm_pools;
+      proxy_args[i].mapped_delivery = mapped_delivery;
+      proxy_args[i].conn = &ctl_conns[i];
+      proxy_args[i].server = server;
+      proxy_args[i].max_fills = max_fills;
+      if (max_fills >= 0 && NULL == (proxy_args[i].curl = readthrough_handle())) {
+        fprintf(stderr, "Unable to set up curl handles\n");
+        exit(__LINE__);
+      }
+      gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &proxy_args[i]);
   }
   
-  // Invokethe framework - this is an infinite loop and will not return
+  // Invokethe framework - returns after a SIGINT/SIGTERM once the workers are done
   gfserver_serve(&gfs);
-
-  // line never reached
-  return -1;
+  l1cache_print_stats(stdout);
+  _destroy_pools();
+  _close_ctl_conns();
+  return stop_signal;
 
 }
@@ -0,0 +1,291 @@
+#include "curl_engine.h"
+#include "steque.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#define MAX_EPOLL_EVENTS 64
+#define WATCH_TIMEOUT_MS 30000  // same as gfs_send gives a client that takes no data
+
+// One queued or running transfer, or a queued call when easy is NULL
+typedef struct {
+    CURL *easy;
+    curl_engine_done_fn done;
+    curl_engine_call_fn call;
+    void *cookie;
+} curl_job_t;
+
+// A pending curl_engine_watch
+typedef struct curl_watch_t {
+    int fd;
+    long deadline_ms;
+    curl_engine_watch_fn fn;
+    void *cookie;
+    struct curl_watch_t *prev, *next;
+} curl_watch_t;
+
+struct curl_engine_t {
+    CURLM *multi;
+    int epfd;
+    int efd;                 // readable when jobs are waiting in incoming
+    int wepfd;               // epoll set of the watched fds; readable in epfd when one fires
+    long deadline_ms;        // when curl wants CURL_SOCKET_TIMEOUT; -1 = no timer
+    pthread_mutex_t lock;
+    steque_t incoming;       // curl_job_t* handed over by workers
+    // Pending watches, oldest (and so first to time out) first
+    curl_watch_t *watches, *watches_tail;
+};
+
+// curl tells us which sockets to watch and for what
+static int socket_callback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp) {
+    curl_engine_t *engine = (curl_engine_t *)userp;
+    struct epoll_event ev;
+    (void)easy;
+
+    if (what == CURL_POLL_REMOVE) {
+        epoll_ctl(engine->epfd, EPOLL_CTL_DEL, s, NULL);
+        curl_multi_assign(engine->multi, s, NULL);
+        return 0;
+    }
+
+    ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+    ev.data.fd = s;
+    // socketp is non-NULL once the socket is registered with epoll
+    if (socketp == NULL) {
+        epoll_ctl(engine->epfd, EPOLL_CTL_ADD, s, &ev);
+        curl_multi_assign(engine->multi, s, engine);
+    } else {
+        epoll_ctl(engine->epfd, EPOLL_CTL_MOD, s, &ev);
+    }
+    return 0;
+}
+
+static long _now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+    (void)multi;
+    ((curl_engine_t *)userp)->deadline_ms = timeout_ms < 0 ? -1 : _now_ms() + timeout_ms;
+    return 0;
+}
+
+// Hands finished transfers back to their owners
+static void _reap(curl_engine_t *engine) {
+    CURLMsg *msg;
+    int left;
+
+    while ((msg = curl_multi_info_read(engine->multi, &left)) != NULL) {
+        if (msg->msg != CURLMSG_DONE) continue;
+
+        CURL *easy = msg->easy_handle;
+        CURLcode result = msg->data.result;
+        curl_job_t *job;
+        curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&job);
+        curl_multi_remove_handle(engine->multi, easy);
+        job->done(easy, result, job->cookie);
+        free(job);
+    }
+}
+
+static void _take_incoming(curl_engine_t *engine) {
+    uint64_t count;
+    ssize_t r = read(engine->efd, &count, sizeof(count));
+    (void)r;
+
+    pthread_mutex_lock(&engine->lock);
+    while (!steque_isempty(&engine->incoming)) {
+        curl_job_t *job = steque_pop(&engine->incoming);
+        if (job->easy == NULL) {
+            pthread_mutex_unlock(&engine->lock);
+            job->call(job->cookie);
+            free(job);
+            pthread_mutex_lock(&engine->lock);
+            continue;
+        }
+        curl_easy_setopt(job->easy, CURLOPT_PRIVATE, job);
+        if (curl_multi_add_handle(engine->multi, job->easy) != CURLM_OK) {
+            pthread_mutex_unlock(&engine->lock);
+            job->done(job->easy, CURLE_FAILED_INIT, job->cookie);
+            free(job);
+            pthread_mutex_lock(&engine->lock);
+        }
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+// Takes watch out of the engine and runs it; it is gone when fn runs
+static void _fire(curl_engine_t *engine, curl_watch_t *watch, int ready) {
+    epoll_ctl(engine->wepfd, EPOLL_CTL_DEL, watch->fd, NULL);
+    if (watch->prev != NULL) watch->prev->next = watch->next;
+    else engine->watches = watch->next;
+    if (watch->next != NULL) watch->next->prev = watch->prev;
+    else engine->watches_tail = watch->prev;
+
+    watch->fn(watch->cookie, ready);
+    free(watch);
+}
+
+static void _take_writable(curl_engine_t *engine) {
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nready = epoll_wait(engine->wepfd, events, MAX_EPOLL_EVENTS, 0);
+
+    // Errors and hangups count as writable: the next write reports them
+    for (int i = 0; i < nready; i++) _fire(engine, events[i].data.ptr, 1);
+}
+
+static void _expire_watches(curl_engine_t *engine) {
+    long now = _now_ms();
+    while (engine->watches != NULL && engine->watches->deadline_ms <= now) {
+        _fire(engine, engine->watches, 0);
+    }
+}
+
+static void* _engine_thread(void *arg) {
+    curl_engine_t *engine = (curl_engine_t *)arg;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int running;
+
+    while (1) {
+        long wait_ms = -1;
+        if (engine->deadline_ms >= 0) {
+            wait_ms = engine->deadline_ms - _now_ms();
+            if (wait_ms < 0) wait_ms = 0;
+        }
+        if (engine->watches != NULL) {
+            long watch_ms = engine->watches->deadline_ms - _now_ms();
+            if (watch_ms < 0) watch_ms = 0;
+            if (wait_ms < 0 || watch_ms < wait_ms) wait_ms = watch_ms;
+        }
+        int nready = epoll_wait(engine->epfd, events, MAX_EPOLL_EVENTS, (int)wait_ms);
+        if (nready < 0) {
+            if (errno != EINTR) perror("[ENGINE] epoll_wait");
+            nready = 0;
+        }
+
+        // A busy socket must not starve the timers: new transfers are
+        // started and connects retried from CURL_SOCKET_TIMEOUT
+        if (engine->deadline_ms >= 0 && _now_ms() >= engine->deadline_ms) {
+            engine->deadline_ms = -1;
+            curl_multi_socket_action(engine->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+        }
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.fd == engine->efd) {
+                // Adding a handle makes curl set a timer, which starts it
+                _take_incoming(engine);
+                continue;
+            }
+            if (events[i].data.fd == engine->wepfd) {
+                _take_writable(engine);
+                continue;
+            }
+            int flags = ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+                        ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+                        ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+            curl_multi_socket_action(engine->multi, events[i].data.fd, flags, &running);
+        }
+        _reap(engine);
+        _expire_watches(engine);
+    }
+    return NULL;
+}
+
+curl_engine_t* curl_engine_create(void) {
+    curl_engine_t *engine = calloc(1, sizeof(curl_engine_t));
+    struct epoll_event ev;
+    pthread_t tid;
+
+    engine->deadline_ms = -1;
+    pthread_mutex_init(&engine->lock, NULL);
+    steque_init(&engine->incoming);
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    engine->wepfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->multi = curl_multi_init();
+    if (engine->epfd < 0 || engine->efd < 0 || engine->wepfd < 0 || engine->multi == NULL) {
+        if (engine->epfd >= 0) close(engine->epfd);
+        if (engine->efd >= 0) close(engine->efd);
+        if (engine->wepfd >= 0) close(engine->wepfd);
+        if (engine->multi != NULL) curl_multi_cleanup(engine->multi);
+        free(engine);
+        return NULL;
+    }
+
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETFUNCTION, socket_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_SOCKETDATA, engine);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERFUNCTION, timer_callback);
+    curl_multi_setopt(engine->multi, CURLMOPT_TIMERDATA, engine);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = engine->efd;
+    epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->efd, &ev);
+    ev.data.fd = engine->wepfd;
+    epoll_ctl(engine->epfd, EPOLL_CTL_ADD, engine->wepfd, &ev);
+
+    pthread_create(&tid, NULL, _engine_thread, engine);
+    pthread_detach(tid);
+    return engine;
+}
+
+static void _enqueue(curl_engine_t *engine, curl_job_t *job) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&engine->lock);
+    steque_enqueue(&engine->incoming, job);
+    pthread_mutex_unlock(&engine->lock);
+
+    ssize_t w = write(engine->efd, &one, sizeof(one));
+    (void)w;
+}
+
+void curl_engine_add(curl_engine_t *engine, CURL *easy, curl_engine_done_fn done, void *cookie) {
+    curl_job_t *job = calloc(1, sizeof(curl_job_t));
+
+    job->easy = easy;
+    job->done = done;
+    job->cookie = cookie;
+    _enqueue(engine, job);
+}
+
+void curl_engine_call(curl_engine_t *engine, curl_engine_call_fn fn, void *cookie) {
+    curl_job_t *job = calloc(1, sizeof(curl_job_t));
+
+    job->call = fn;
+    job->cookie = cookie;
+    _enqueue(engine, job);
+}
+
+void curl_engine_watch(curl_engine_t *engine, int fd, curl_engine_watch_fn fn, void *cookie) {
+    curl_watch_t *watch = calloc(1, sizeof(curl_watch_t));
+    struct epoll_event ev;
+
+    watch->fd = fd;
+    watch->deadline_ms = _now_ms() + WATCH_TIMEOUT_MS;
+    watch->fn = fn;
+    watch->cookie = cookie;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = watch;
+    if (epoll_ctl(engine->wepfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        // Nothing will ever wake it up: give up on it right away
+        perror("[ENGINE] epoll_ctl");
+        fn(cookie, 0);
+        free(watch);
+        return;
+    }
+
+    // Every watch has the same timeout, so appending keeps the list in deadline order
+    watch->prev = engine->watches_tail;
+    if (engine->watches_tail != NULL) engine->watches_tail->next = watch;
+    else engine->watches = watch;
+    engine->watches_tail = watch;
+}
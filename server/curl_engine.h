@@ -0,0 +1,47 @@
+#ifndef __CURL_ENGINE_H__
+#define __CURL_ENGINE_H__
+
+#include <curl/curl.h>
+
+/*
+ * An event loop thread that drives many upstream transfers at once on one
+ * curl_multi handle, using curl's socket and timer callbacks on top of
+ * epoll.  Worker threads hand easy handles to it instead of blocking in
+ * curl_easy_perform.
+ */
+typedef struct curl_engine_t curl_engine_t;
+
+// Called on the engine thread once the transfer on easy has finished
+typedef void (*curl_engine_done_fn)(CURL *easy, CURLcode result, void *cookie);
+
+// Starts an engine thread; NULL if epoll or curl_multi cannot be set up
+curl_engine_t* curl_engine_create(void);
+
+/*
+ * Queues easy, with all its options already set, on the engine.  The
+ * caller must not touch easy until done has been called.  Callbacks on
+ * easy run on the engine thread and must not block.
+ */
+void curl_engine_add(curl_engine_t *engine, CURL *easy, curl_engine_done_fn done, void *cookie);
+
+// Runs fn(cookie) on the engine thread
+typedef void (*curl_engine_call_fn)(void *cookie);
+
+/*
+ * Queues a call to fn on the engine thread, behind the transfers and
+ * calls queued before it.  Lets other threads hand over work that has to
+ * run where the transfers' callbacks run.  fn must not block.
+ */
+void curl_engine_call(curl_engine_t *engine, curl_engine_call_fn fn, void *cookie);
+
+// Called on the engine thread: ready = 1 when fd can take data, 0 on timeout
+typedef void (*curl_engine_watch_fn)(void *cookie, int ready);
+
+/*
+ * Engine thread only: calls fn once, when fd can take more data or after
+ * 30 seconds without that.  One watch per fd at a time, and fd must stay
+ * open until fn has run.
+ */
+void curl_engine_watch(curl_engine_t *engine, int fd, curl_engine_watch_fn fn, void *cookie);
+
+#endif // __CURL_ENGINE_H__
@@ -1,83 +1,423 @@
 #include "proxy-student.h"
 #include "gfserver.h"
+#include "singleflight.h"
 
 
 
 #define MAX_REQUEST_N 512
 #define BUFSIZE (6226)
 
-// Structure to store downloaded data in chunks
-struct memory_chunk {
-    char *memory;
-    size_t size;
+#define CURL_BUFSIZE (64 * 1024) // largest piece curl hands the write callback
+
+// State of one upstream fetch run by the flight leader
+struct fetch_state {
+    CURL *curl;
+    flight_t *flight;
+    gfcontext_t *ctx;      // the leader's own client; NULL = everyone reads the flight
+    long length;           // Content-Length of the current response, -1 = none
+    int redirect;          // current response has a Location header
+    int started;           // headers done: status and length are known
+    int rejected;          // non-200 response, body is discarded
+    int streaming;         // nobody joined: header sent, body goes to ctx as it arrives
+    int client_failed;     // ctx is gone
+    size_t sent;
 };
 
-// Callback function for libcurl, writes data to memory
+// A client an engine thread streams a flight to, with no worker behind it
+typedef struct async_client {
+    gfcontext_t *ctx;          // detached
+    flight_t *flight;          // holds a reference
+    curl_engine_t *engine;     // the flight's runner; the client only lives on its thread
+    size_t length;             // body length in the header, once that is out
+    size_t sent;
+    int header_sent;
+    int watching;              // waiting for the socket to take more
+    struct async_client *next; // in flight->clients
+} async_client_t;
+
+static void client_pump(async_client_t *client);
+
+// Ends the client's response and drops it from the flight
+static void client_done(async_client_t *client, ssize_t rc) {
+    async_client_t **link = (async_client_t **)&client->flight->clients;
+
+    while (*link != client) link = &(*link)->next;
+    *link = client->next;
+    gfs_finish(client->ctx, rc);
+    flight_release(client->flight);
+    free(client);
+}
+
+static void client_writable(void *cookie, int ready) {
+    async_client_t *client = (async_client_t *)cookie;
+
+    client->watching = 0;
+    if (!ready) client_done(client, SERVER_FAILURE); // took no data for too long
+    else client_pump(client);
+}
+
+// Sends the client whatever the flight has for it now, without waiting on it
+static void client_pump(async_client_t *client) {
+    flight_t *flight = client->flight;
+
+    pthread_mutex_lock(&flight->lock);
+    int state = flight->state;
+    long length = flight->length;
+    size_t avail = flight->size;
+    gfstatus_t status = flight->status;
+    pthread_mutex_unlock(&flight->lock);
+
+    if (!client->header_sent) {
+        if (state == FLIGHT_RUNNING && length < 0) return; // the header waits for the length
+        if (state == FLIGHT_FAILED) {
+            client_done(client, gfs_sendheader(client->ctx, status, 0));
+            return;
+        }
+        client->length = length >= 0 ? (size_t)length : avail;
+        client->header_sent = 1;
+        if (gfs_sendheader(client->ctx, GF_OK, client->length) < 0) {
+            client_done(client, SERVER_FAILURE);
+            return;
+        }
+    }
+
+    // Only this thread appends, so the bytes below avail stay where they are
+    ssize_t n = gfs_send_nowait(client->ctx, flight->data + client->sent, avail - client->sent);
+    if (n < 0) {
+        client_done(client, SERVER_FAILURE);
+        return;
+    }
+    client->sent += n;
+    if (client->sent == client->length) {
+        client_done(client, client->sent);
+    } else if (client->sent < avail) {
+        // Socket full: carry on once the client has read some
+        client->watching = 1;
+        curl_engine_watch(client->engine, gfs_socket(client->ctx), client_writable, client);
+    } else if (state != FLIGHT_RUNNING) {
+        // The header is out; a fetch that died midway can only be reported by
+        // dropping the connection
+        client_done(client, SERVER_FAILURE);
+    }
+}
+
+static void client_attach(void *cookie) {
+    async_client_t *client = (async_client_t *)cookie;
+
+    client->next = client->flight->clients;
+    client->flight->clients = client;
+    client_pump(client);
+}
+
+// The flight grew or ended: move every client along that is not waiting on its socket
+static void clients_pump(flight_t *flight) {
+    async_client_t *client, *next;
+
+    for (client = flight->clients; client != NULL; client = next) {
+        next = client->next;
+        if (!client->watching) client_pump(client);
+    }
+}
+
+// The final response's headers are in: pick buffering or streaming
+static void begin_body(struct fetch_state *fetch) {
+    long http_code = 0;
+
+    fetch->started = 1;
+    curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code != 200) {
+        fetch->rejected = 1;
+        return;
+    }
+
+    // Without a length the Getfile header has to wait for the whole body
+    if (fetch->length < 0) return;
+
+    // An engine-run fetch has no client of its own: all of them read the flight
+    if (fetch->ctx == NULL) {
+        flight_set_length(fetch->flight, fetch->length);
+        clients_pump(fetch->flight);
+        return;
+    }
+
+    // Others joined: only fill the flight and stream our client from it
+    // afterwards like theirs, so a client of ours that stops reading cannot
+    // hold up the download for everyone
+    if (!flight_close(fetch->flight)) {
+        flight_set_length(fetch->flight, fetch->length);
+        return;
+    }
+
+    // Nobody to share with: pass bytes straight through and keep none of them
+    fetch->streaming = 1;
+    if (gfs_sendheader(fetch->ctx, GF_OK, fetch->length) < 0) fetch->client_failed = 1;
+}
+
+// Callback function for libcurl, picks Content-Length out of the headers
+static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t total_size = size * nitems;
+    struct fetch_state *fetch = (struct fetch_state *)userp;
+    static const char content_length[] = "Content-Length:";
+
+    // Every response (redirects, 100 Continue) starts with a status line
+    if (total_size >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        fetch->length = -1;
+        fetch->redirect = 0;
+    } else if (total_size >= 9 && strncasecmp(buffer, "Location:", 9) == 0) {
+        fetch->redirect = 1;
+    } else if (total_size > sizeof(content_length) - 1 &&
+               strncasecmp(buffer, content_length, sizeof(content_length) - 1) == 0) {
+        char *end;
+        long length = strtol(buffer + sizeof(content_length) - 1, &end, 10);
+        if (end != buffer + sizeof(content_length) - 1 && length >= 0) fetch->length = length;
+    } else if (!fetch->started && (total_size == 2 || total_size == 1) && (buffer[0] == '\r' || buffer[0] == '\n')) {
+        // Blank line: headers of this response are done.  Skip interim and
+        // redirect responses; curl follows those and never hands us their bodies
+        long http_code = 0;
+        curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &http_code);
+        if (http_code >= 200 && !(http_code / 100 == 3 && fetch->redirect)) begin_body(fetch);
+    }
+    return total_size;
+}
+
+// Callback function for libcurl, forwards or keeps received data
 static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t total_size = size * nmemb;
-    struct memory_chunk *mem = (struct memory_chunk *)userp;
+    struct fetch_state *fetch = (struct fetch_state *)userp;
 
-    // Allocate or expand buffer
-    char *ptr = realloc(mem->memory, mem->size + total_size);
-    if (ptr == NULL) return 0; // Out of memory
+    if (!fetch->started) begin_body(fetch); // protocols without headers
+    if (fetch->rejected) return total_size;
 
-    memcpy(ptr + mem->size, contents, total_size);
-    mem->memory = ptr;
-    mem->size += total_size;
+    if (!fetch->streaming) {
+        if (flight_append(fetch->flight, contents, total_size) < 0) return 0; // aborts the transfer
+        clients_pump(fetch->flight);
+        return total_size;
+    }
 
+    if (fetch->sent + total_size > (size_t)fetch->length) return 0;
+    ssize_t n = gfs_send(fetch->ctx, contents, total_size);
+    if (n < 0) {
+        // Alone and our client is gone: no reason to keep downloading
+        fetch->client_failed = 1;
+        return 0;
+    }
+    fetch->sent += n;
     return total_size;
 }
 
-ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg) {
+static void fetch_setup(struct fetch_state *fetch, CURL *curl, flight_t *flight, const char *url, gfcontext_t *ctx) {
+    memset(fetch, 0, sizeof(*fetch));
+    fetch->curl = curl;
+    fetch->flight = flight;
+    fetch->ctx = ctx;
+    fetch->length = -1;
+
+    // Per-request options; the rest were set once in curl_workers_init
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)fetch);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)fetch);
+}
+
+// Ends the flight according to how the transfer went; -1 if it failed
+static int fetch_finish(struct fetch_state *fetch, CURLcode res) {
+    long http_code = 0;
+
+    // Handle HTTP response codes
+    curl_easy_getinfo(fetch->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (res != CURLE_OK || http_code != 200 ||
+        (fetch->streaming && fetch->sent != (size_t)fetch->length && !fetch->client_failed)) {
+        flight_finish(fetch->flight, FLIGHT_FAILED, GF_FILE_NOT_FOUND);
+        return -1;
+    }
+    if (!fetch->started) flight_set_length(fetch->flight, 0); // empty body, no callbacks at all
+    flight_finish(fetch->flight, FLIGHT_DONE, GF_OK);
+    return 0;
+}
+
+// Fetches url into the flight on curl and ends it; returns what handle_with_curl returns
+static ssize_t fetch_and_stream(CURL *curl, flight_t *flight, const char *url, gfcontext_t *ctx) {
+    struct fetch_state fetch;
+
+    fetch_setup(&fetch, curl, flight, url, ctx);
+
+    // Perform the request; the connection stays open for the next one
+    if (fetch_finish(&fetch, curl_easy_perform(curl)) < 0) {
+        // Once the header is out the only way to report it is to drop the connection
+        return fetch.streaming ? SERVER_FAILURE : flight_stream(flight, ctx);
+    }
+    if (!fetch.streaming) return flight_stream(flight, ctx);
+    return fetch.client_failed ? SERVER_FAILURE : (ssize_t)fetch.sent;
+}
+
+// Handles for engine-run fetches, which outlive the worker that started them
+static CURL *prototype;      // set up like the workers' handles; copied when the spares run out
+static steque_t spares;
+static int handles_out;      // handles on engines right now
+static pthread_mutex_t spares_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handles_back = PTHREAD_COND_INITIALIZER;
+
+static CURL *handle_get(void) {
     CURL *curl;
-    CURLcode res;
-    struct memory_chunk chunk;
-    chunk.memory = NULL;
-    chunk.size = 0;
 
-    // Construct full URL
-    const char *base_url = (const char *)arg;
-    char url[1024];  // Ensure enough space
-    snprintf(url, sizeof(url), "%s%s", base_url, path);
+    pthread_mutex_lock(&spares_lock);
+    curl = steque_isempty(&spares) ? curl_easy_duphandle(prototype) : steque_pop(&spares);
+    if (curl != NULL) handles_out++;
+    pthread_mutex_unlock(&spares_lock);
+    return curl;
+}
 
-    // Initialize CURL
-    curl = curl_easy_init();
-    if (!curl) return SERVER_FAILURE;
+static void handle_put(CURL *curl) {
+    pthread_mutex_lock(&spares_lock);
+    steque_push(&spares, curl);
+    if (--handles_out == 0) pthread_cond_broadcast(&handles_back);
+    pthread_mutex_unlock(&spares_lock);
+}
 
-    // Set up CURL options
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+static void engine_done(CURL *easy, CURLcode result, void *cookie) {
+    struct fetch_state *fetch = (struct fetch_state *)cookie;
+
+    fetch_finish(fetch, result);
+    clients_pump(fetch->flight);
+    flight_release(fetch->flight);
+    handle_put(easy);
+    free(fetch);
+}
+
+// Starts the flight's fetch on engine; the engine ends the flight when it is done
+static void fetch_on_engine(curl_engine_t *engine, flight_t *flight, const char *url) {
+    struct fetch_state *fetch = malloc(sizeof(struct fetch_state));
+    CURL *curl = handle_get();
+
+    if (fetch == NULL || curl == NULL) {
+        if (curl != NULL) handle_put(curl);
+        free(fetch);
+        flight_finish(flight, FLIGHT_FAILED, GF_ERROR);
+        return;
+    }
+    fetch_setup(fetch, curl, flight, url, NULL);
+    flight_hold(flight);
+    curl_engine_add(engine, curl, engine_done, fetch);
+}
+
+// Hands ctx and the caller's reference to flight over to the flight's engine
+static ssize_t stream_on_engine(flight_t *flight, gfcontext_t *ctx) {
+    async_client_t *client = calloc(1, sizeof(async_client_t));
+
+    if (client == NULL || gfs_detach(ctx) < 0) {
+        free(client);
+        flight_release(flight);
+        return SERVER_FAILURE;
+    }
+    client->ctx = ctx;
+    client->flight = flight;
+    client->engine = (curl_engine_t *)flight->runner;
+    curl_engine_call(client->engine, client_attach, client);
+    return GFS_DETACHED;
+}
+
+// Set by curl_workers_stop; curl polls it through progress_callback
+static volatile sig_atomic_t stopping;
+
+// Callback function for libcurl, runs at least once a second per transfer
+static int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)clientp; (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    return stopping; // nonzero aborts the transfer
+}
+
+// One share object for all workers; curl calls back to serialize access
+static CURLSH *share;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userp) {
+    (void)handle; (void)access; (void)userp;
+    pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *handle, curl_lock_data data, void *userp) {
+    (void)handle; (void)userp;
+    pthread_mutex_unlock(&share_locks[data]);
+}
+
+// Options that stay the same for every request on the handle
+static void setup_handle(CURL *curl, long maxconnects, const char *cafile) {
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, maxconnects);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // many threads, no SIGALRM
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, (long)CURL_BUFSIZE);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);  // Handle redirects
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    if (cafile != NULL) curl_easy_setopt(curl, CURLOPT_CAINFO, cafile);
+}
 
-    // Perform the request
-    res = curl_easy_perform(curl);
-    long http_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-    curl_easy_cleanup(curl);
+int curl_workers_init(proxy_worker_arg_t *workers, int n, const char *server, const char *cafile) {
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&share_locks[i], NULL);
 
-    // Handle HTTP response codes
-    if (res != CURLE_OK || http_code != 200) {
-        free(chunk.memory);
-        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    if ((share = curl_share_init()) == NULL) return -1;
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    for (int i = 0; i < n; i++) {
+        workers[i].server = server;
+        if ((workers[i].curl = curl_easy_init()) == NULL) return -1;
+        setup_handle(workers[i].curl, n, cafile); // an idle connection per worker
     }
 
-    // Send header to client
-    gfs_sendheader(ctx, GF_OK, chunk.size);
+    steque_init(&spares);
+    if ((prototype = curl_easy_init()) == NULL) return -1;
+    setup_handle(prototype, n, cafile);
+    return 0;
+}
 
-    // Send data in chunks
-    ssize_t total_sent = 0;
-    while (total_sent < chunk.size) {
-        ssize_t sent = gfs_send(ctx, chunk.memory + total_sent, chunk.size - total_sent);
-        if (sent < 0) {
-            free(chunk.memory);
-            return SERVER_FAILURE;
-        }
-        total_sent += sent;
+void curl_workers_stop(void) {
+    stopping = 1;
+}
+
+void curl_workers_cleanup(proxy_worker_arg_t *workers, int n) {
+    // Engine-run fetches keep going without a worker; after curl_workers_stop
+    // they end within a second
+    pthread_mutex_lock(&spares_lock);
+    while (handles_out > 0) pthread_cond_wait(&handles_back, &spares_lock);
+    while (!steque_isempty(&spares)) curl_easy_cleanup(steque_pop(&spares));
+    pthread_mutex_unlock(&spares_lock);
+    if (prototype != NULL) curl_easy_cleanup(prototype);
+    prototype = NULL;
+
+    for (int i = 0; i < n; i++) {
+        if (workers[i].curl != NULL) curl_easy_cleanup(workers[i].curl);
+        workers[i].curl = NULL;
     }
+    if (share != NULL) curl_share_cleanup(share);
+    share = NULL;
+}
 
-    // Cleanup
-    free(chunk.memory);
+ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg) {
+    proxy_worker_arg_t *worker = (proxy_worker_arg_t *)arg;
+
+    // Construct full URL
+    char url[1024];  // Ensure enough space
+    snprintf(url, sizeof(url), "%s%s", worker->server, path);
+
+    // Concurrent requests for the same URL share one upstream fetch.  A
+    // leader nobody joined streams to its client while downloading; otherwise
+    // every client, the leader's too, streams the shared body as it grows.
+    // With event loops the engine does all of it and the worker moves on
+    int leader;
+    ssize_t total_sent;
+    flight_t *flight = flight_join(url, worker->engine, &leader);
+    if (flight->runner != NULL) {
+        if (leader) fetch_on_engine((curl_engine_t *)flight->runner, flight, url);
+        return stream_on_engine(flight, ctx);
+    }
+    if (leader) total_sent = fetch_and_stream(worker->curl, flight, url, ctx);
+    else total_sent = flight_stream(flight, ctx);
+    flight_release(flight);
     return total_sent;
 }
 
@@ -9,14 +9,13 @@
  */
 ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg){
 	int fildes;
-	size_t file_len, bytes_transferred;
-	ssize_t read_len, write_len;
+	size_t file_len;
+	ssize_t sent;
 	char buffer[BUFSIZE];
 	char *data_dir = arg;
 	struct stat statbuf;
 
-	strncpy(buffer,data_dir, BUFSIZE);
-	strncat(buffer,path, BUFSIZE);
+	snprintf(buffer, BUFSIZE, "%s%s", data_dir, path);
 
 	if( 0 > (fildes = open(buffer, O_RDONLY))){
 		if (errno == ENOENT)
@@ -29,6 +28,7 @@ ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg){
 
 	/* Calculating the file size */
 	if (0 > fstat(fildes, &statbuf)) {
+		close(fildes);
 		return SERVER_FAILURE;
 	}
 
@@ -36,22 +36,13 @@ ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg){
 
 	gfs_sendheader(ctx, GF_OK, file_len);
 
-	/* Sending the file contents chunk by chunk. */
-	bytes_transferred = 0;
-	while(bytes_transferred < file_len){
-		read_len = read(fildes, buffer, BUFSIZE);
-		if (read_len <= 0){
-			fprintf(stderr, "handle_with_file read error, %zd, %zu, %zu", read_len, bytes_transferred, file_len );
-			return SERVER_FAILURE;
-		}
-		write_len = gfs_send(ctx, buffer, read_len);
-		if (write_len != read_len){
-			fprintf(stderr, "handle_with_file write error");
-			return SERVER_FAILURE;
-		}
-		bytes_transferred += write_len;
+	/* Sending the file contents from the page cache, without a copy through buffer. */
+	sent = gfs_sendfile(ctx, fildes, 0, file_len);
+	close(fildes);
+	if (sent < 0 || (size_t) sent != file_len){
+		fprintf(stderr, "handle_with_file send error, %zd, %zu\n", sent, file_len);
+		return SERVER_FAILURE;
 	}
 
-	return bytes_transferred;
+	return sent;
 }
-
@@ -3,5 +3,25 @@
  */
  #ifndef __SERVER_STUDENT_H__846
  #define __SERVER_STUDENT_H__846
- 
+
+ #include <curl/curl.h>
+ #include "curl_engine.h"
+
+ // GFS_WORKER_ARG of each proxy worker thread
+ typedef struct {
+     const char *server;   // base URL the request path is appended to
+     CURL *curl;           // long-lived handle, only ever used by this worker
+     curl_engine_t *engine; // runs the transfers this worker starts and streams their responses; NULL = curl_easy_perform
+ } proxy_worker_arg_t;
+
+ // Gives each of the n workers its own handle; all of them share one DNS
+ // cache, TLS session cache and connection pool.  cafile may be NULL
+ int curl_workers_init(proxy_worker_arg_t *workers, int n, const char *server, const char *cafile);
+
+ // Makes running and later transfers fail fast so a stopping server is not
+ // held up by slow origins.  Async-signal-safe
+ void curl_workers_stop(void);
+
+ void curl_workers_cleanup(proxy_worker_arg_t *workers, int n);
+
  #endif // __SERVER_STUDENT_H__846
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include "singleflight.h"
+
+#define FLIGHT_BUCKETS 256
+
+// Running flights by key; finished flights are unlinked and live on only
+// while requests still hold references to them
+static flight_t *flights[FLIGHT_BUCKETS];
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int _key_hash(const char *key) {
+    unsigned int h = 2166136261u;
+    while (*key) h = (h ^ (unsigned char)*key++) * 16777619u;
+    return h % FLIGHT_BUCKETS;
+}
+
+flight_t* flight_join(const char *key, void *runner, int *leader) {
+    unsigned int b = _key_hash(key);
+    flight_t *flight;
+
+    pthread_mutex_lock(&flights_lock);
+    for (flight = flights[b]; flight != NULL; flight = flight->next) {
+        if (strcmp(flight->key, key) == 0) {
+            // refs only changes under flights_lock while the flight is in the table
+            __sync_add_and_fetch(&flight->refs, 1);
+            pthread_mutex_unlock(&flights_lock);
+            *leader = 0;
+            return flight;
+        }
+    }
+
+    flight = calloc(1, sizeof(flight_t));
+    flight->key = strdup(key);
+    flight->refs = 1;
+    flight->length = -1;
+    flight->state = FLIGHT_RUNNING;
+    flight->runner = runner;
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->progress, NULL);
+    flight->next = flights[b];
+    flights[b] = flight;
+    pthread_mutex_unlock(&flights_lock);
+
+    *leader = 1;
+    return flight;
+}
+
+void flight_hold(flight_t *flight) {
+    pthread_mutex_lock(&flights_lock);
+    __sync_add_and_fetch(&flight->refs, 1);
+    pthread_mutex_unlock(&flights_lock);
+}
+
+void flight_set_length(flight_t *flight, long length) {
+    pthread_mutex_lock(&flight->lock);
+    if (length >= 0 && (flight->data = malloc(length > 0 ? length : 1)) != NULL) {
+        flight->cap = length;
+        flight->length = length;
+    }
+    pthread_cond_broadcast(&flight->progress);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+static void _unlink(flight_t *flight) {
+    for (flight_t **link = &flights[_key_hash(flight->key)]; *link != NULL; link = &(*link)->next) {
+        if (*link == flight) {
+            *link = flight->next;
+            break;
+        }
+    }
+}
+
+int flight_close(flight_t *flight) {
+    int closed;
+
+    pthread_mutex_lock(&flights_lock);
+    if ((closed = (flight->refs == 1))) _unlink(flight);
+    pthread_mutex_unlock(&flights_lock);
+    return closed;
+}
+
+int flight_append(flight_t *flight, const void *data, size_t size) {
+    pthread_mutex_lock(&flight->lock);
+    if (flight->size + size > flight->cap) {
+        // Followers only read an unknown-length body after the flight is done,
+        // so growing it here cannot move bytes out from under them
+        if (flight->length >= 0) {
+            pthread_mutex_unlock(&flight->lock);
+            return -1;
+        }
+        size_t cap = flight->cap ? flight->cap : 16384;
+        while (cap < flight->size + size) cap *= 2;
+        char *grown = realloc(flight->data, cap);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&flight->lock);
+            return -1;
+        }
+        flight->data = grown;
+        flight->cap = cap;
+    }
+    size_t offset = flight->size;
+    pthread_mutex_unlock(&flight->lock);
+
+    // Only the leader writes, and followers never read past size
+    memcpy(flight->data + offset, data, size);
+
+    pthread_mutex_lock(&flight->lock);
+    flight->size += size;
+    pthread_cond_broadcast(&flight->progress);
+    pthread_mutex_unlock(&flight->lock);
+    return 0;
+}
+
+void flight_finish(flight_t *flight, int state, gfstatus_t status) {
+    pthread_mutex_lock(&flights_lock);
+    _unlink(flight);
+    pthread_mutex_unlock(&flights_lock);
+
+    pthread_mutex_lock(&flight->lock);
+    if (state == FLIGHT_DONE && flight->length >= 0 && flight->size != (size_t)flight->length) {
+        state = FLIGHT_FAILED; // origin closed early
+    }
+    flight->state = state;
+    flight->status = status;
+    pthread_cond_broadcast(&flight->progress);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+ssize_t flight_stream(flight_t *flight, gfcontext_t *ctx) {
+    size_t length, sent = 0;
+
+    pthread_mutex_lock(&flight->lock);
+    while (flight->state == FLIGHT_RUNNING && flight->length < 0) {
+        pthread_cond_wait(&flight->progress, &flight->lock);
+    }
+    if (flight->state == FLIGHT_FAILED) {
+        gfstatus_t status = flight->status;
+        pthread_mutex_unlock(&flight->lock);
+        return gfs_sendheader(ctx, status, 0);
+    }
+    length = flight->length >= 0 ? (size_t)flight->length : flight->size;
+    pthread_mutex_unlock(&flight->lock);
+
+    if (gfs_sendheader(ctx, GF_OK, length) < 0) return SERVER_FAILURE;
+
+    while (sent < length) {
+        pthread_mutex_lock(&flight->lock);
+        while (flight->size == sent && flight->state == FLIGHT_RUNNING) {
+            pthread_cond_wait(&flight->progress, &flight->lock);
+        }
+        size_t avail = flight->size;
+        int state = flight->state;
+        pthread_mutex_unlock(&flight->lock);
+
+        // The header is out; a fetch that died midway can only be reported by
+        // dropping the connection
+        if (avail == sent) return state == FLIGHT_FAILED ? SERVER_FAILURE : (ssize_t)sent;
+
+        ssize_t n = gfs_send(ctx, flight->data + sent, avail - sent);
+        if (n < 0) return SERVER_FAILURE;
+        sent += n;
+    }
+    return sent;
+}
+
+void flight_release(flight_t *flight) {
+    if (__sync_sub_and_fetch(&flight->refs, 1) > 0) return;
+
+    pthread_mutex_destroy(&flight->lock);
+    pthread_cond_destroy(&flight->progress);
+    free(flight->data);
+    free(flight->key);
+    free(flight);
+}
@@ -0,0 +1,75 @@
+#ifndef __SINGLEFLIGHT_H__
+#define __SINGLEFLIGHT_H__
+
+#include "gfserver.h"
+
+/*
+ * Single-flight table for upstream fetches.  The first request for a URL
+ * becomes the leader and fetches it; requests for the same URL that arrive
+ * while the fetch is running join it and stream the leader's bytes as they
+ * come in instead of fetching again.
+ */
+
+#define FLIGHT_RUNNING 0
+#define FLIGHT_DONE 1
+#define FLIGHT_FAILED 2
+
+typedef struct flight_t {
+    char *key;
+    int refs;                 // one per request using it; the leader holds one while running
+    pthread_mutex_t lock;
+    pthread_cond_t progress;  // signalled on every append and on finish
+    char *data;
+    size_t size;              // bytes received so far
+    size_t cap;
+    long length;              // Content-Length, -1 until known or if the origin sent none
+    int state;                // FLIGHT_*
+    gfstatus_t status;        // what followers send if it failed before their header went out
+    void *runner;             // where the leader runs the fetch, fixed at the start; NULL = itself
+    void *clients;            // the runner's own list of clients it streams the flight to
+    struct flight_t *next;
+} flight_t;
+
+/*
+ * Returns the running flight for key, or starts a new one run by runner.
+ * *leader is set to 1 when the caller must fetch and call flight_finish.
+ */
+flight_t* flight_join(const char *key, void *runner, int *leader);
+
+// Takes one more reference, for a part of a request that outlives the rest
+void flight_hold(flight_t *flight);
+
+/*
+ * Leader: the body will be length bytes long (-1 = unknown).  A known
+ * length is allocated once so followers can read while the body grows.
+ */
+void flight_set_length(flight_t *flight, long length);
+
+/*
+ * Leader: stops sharing the flight if nobody has joined it yet, so the
+ * leader can stream straight to its client without keeping the body.
+ * Returns 1 if the flight is now private; later requests start their own.
+ */
+int flight_close(flight_t *flight);
+
+// Leader: appends received bytes; returns -1 if they overrun the length
+int flight_append(flight_t *flight, const void *data, size_t size);
+
+/*
+ * Leader: ends the flight with FLIGHT_DONE or FLIGHT_FAILED (status is
+ * the Getfile status for followers) and removes it from the table so new
+ * requests start a fresh fetch.
+ */
+void flight_finish(flight_t *flight, int state, gfstatus_t status);
+
+/*
+ * Sends the flight's response to ctx: the header as soon as the length is
+ * known, then the body as it arrives.  Returns what a gfserver handler
+ * returns.
+ */
+ssize_t flight_stream(flight_t *flight, gfcontext_t *ctx);
+
+// Drops the caller's reference
+void flight_release(flight_t *flight);
+
+#endif // __SINGLEFLIGHT_H__
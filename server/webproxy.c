@@ -1,13 +1,18 @@
 #include "gfserver.h"
+#include "proxy-student.h"
 
 #define USAGE                                                                         \
 "usage:\n"                                                                            \
 "  webproxy [options]\n"                                                              \
 "options:\n"                                                                          \
 "  -s [server]         The server to connect to (Default: GitHub test data)\n"        \
+"  -C [ca_file]        CA bundle for verifying the server (e.g. a local test origin)\n" \
 "  -h                  Show this help message\n"                                      \
 "  -p [listen_port]    Listen port (Default: 16642)\n"                                \
-"  -t [thread_count]   Num worker threads (Default is 8, Range is 1-80)\n"          
+"  -t [thread_count]   Num worker threads (Default is 8, Range is 1-80)\n"          \
+"  -e [event_loops]    Run upstream transfers, and stream their responses, on this\n" \
+"                      many curl_multi event loops instead of in each worker\n"       \
+"                      (Default: 0 = off)\n"
 
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -16,6 +21,8 @@ static struct option gLongOptions[] = {
   {"thread-count",  required_argument,      NULL,           't'},
   {"port",          required_argument,      NULL,           'p'},
   {"server",        required_argument,      NULL,           's'},
+  {"cacert",        required_argument,      NULL,           'C'},
+  {"event-loops",   required_argument,      NULL,           'e'},
   {NULL,            0,                      NULL,            0}
 };
 
@@ -23,11 +30,16 @@ static struct option gLongOptions[] = {
 #define MAX_REQUEST_LENGTH_N 822
 
 static gfserver_t gfs;
+static proxy_worker_arg_t *workers;
+static int nworkers;
+static volatile sig_atomic_t stop_signal;
 
+// Only async-signal-safe work here: main cleans up once gfserver_serve returns
 static void _sig_handler(int signo){
   if (signo == SIGTERM || signo == SIGINT){
+    stop_signal = signo;
+    curl_workers_stop();
     gfserver_stop(&gfs);
-    exit(signo);
   }
 }
 
@@ -40,6 +52,8 @@ int main(int argc, char **argv) {
   unsigned short port = 16642;
   unsigned short nworkerthreads = 8;
   const char *server = "https://raw.githubusercontent.com/gt-cs6200/image_data";
+  const char *cafile = NULL;
+  int nengines = 0;
 
   // disable buffering on stdout so it prints immediately 
   setbuf(stdout, NULL);
@@ -54,8 +68,14 @@ int main(int argc, char **argv) {
     exit(SERVER_FAILURE);
   }
 
+  // A client hanging up mid-body must fail that send, not kill the proxy
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR){
+    fprintf(stderr,"Can't ignore SIGPIPE...exiting.\n");
+    exit(SERVER_FAILURE);
+  }
+
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:qs:xt:h", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "p:qs:xt:hC:e:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       case 'a':
       case 'd':
@@ -68,6 +88,12 @@ int main(int argc, char **argv) {
       case 's': // file-path
         server = optarg;
         break;              
+      case 'e': // curl_multi event loops
+        nengines = atoi(optarg);
+        break;
+      case 'C': // CA bundle
+        cafile = optarg;
+        break;
       case 't': // thread-count 8
         nworkerthreads = atoi(optarg);
         break;
@@ -91,6 +117,11 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  if ((nengines < 0) || (nengines > 64)) {
+    fprintf(stderr, "Invalid number of event loops\n");
+    exit(__LINE__);
+  }
+
   if ((nworkerthreads < 1) || (nworkerthreads > 80)) {
     fprintf(stderr, "Invalid number of worker threads\n");
     exit(__LINE__);
@@ -102,13 +133,32 @@ int main(int argc, char **argv) {
   gfserver_setopt(&gfs, GFS_MAXNPENDING, 90);
   gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_curl);
   gfserver_setopt(&gfs, GFS_PORT, port);
-  // Set up arguments for worker here
+  // Set up arguments for worker here: each worker keeps its own curl handle
+  // so connections, DNS answers and TLS sessions outlive a single request
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  nworkers = nworkerthreads;
+  workers = calloc(nworkerthreads, sizeof(proxy_worker_arg_t));
+  if (curl_workers_init(workers, nworkerthreads, server, cafile) < 0) {
+    fprintf(stderr, "Unable to set up curl handles\n");
+    exit(__LINE__);
+  }
+  for(i = 0; i < nengines; i++) {
+    curl_engine_t *engine = curl_engine_create();
+    if (engine == NULL) {
+      fprintf(stderr, "Unable to start curl event loop\n");
+      exit(__LINE__);
+    }
+    for (int w = i; w < nworkerthreads; w += nengines) workers[w].engine = engine;
+  }
   for(i = 0; i < nworkerthreads; i++) {
-    gfserver_setopt(&gfs, GFS_WORKER_ARG, i, (void*)server);
+    gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &workers[i]);
   }
-  // Invoke the framework - this is an infinite loop and shouldn't return
+  // Invoke the framework - returns after gfserver_stop, once every worker
+  // has been joined, so no request is using a curl handle any more
   gfserver_serve(&gfs);
-  // not reached
-  return -2209;
+  curl_workers_cleanup(workers, nworkers);
+  free(workers);
+  curl_global_cleanup();
+  return stop_signal;
 
 }